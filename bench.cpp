@@ -0,0 +1,496 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#include "types.h"
+#include "rules.h"
+#include "deck.h"
+#include "engine.h"
+#include "policy.h"
+
+#define BENCH_ROUNDS 200
+#define LEGACY_MESSAGE_SIZE 256
+
+using namespace std;
+
+// Every heap allocation in the process goes through here, so each benchmark
+// can report allocations per operation next to its time.
+uint64_t allocations = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  void* ptr = malloc(size ? size : 1);
+  if (ptr == nullptr) throw bad_alloc();
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+typedef struct {
+  Card cards[HAND_SIZE];
+} BenchHand;
+
+typedef struct {
+  vector<string> names;
+} LegacyHand;
+
+typedef struct {
+  int type;
+  char text[LEGACY_MESSAGE_SIZE];
+} LegacyMessage;
+
+// The string based rules and messages the server used before cards became
+// ids and messages became frames, kept as the baseline everything else is
+// measured against.
+int legacy_get_card_rank(const string& card) {
+  static map<string, int> ranking = {
+    {"AE", 14}, {"AP", 13},
+    {"7E", 12}, {"7O", 11},
+    {"3C", 10}, {"3E", 10}, {"3P", 10}, {"3O", 10},
+    {"2C", 9},  {"2E", 9},  {"2P", 9},  {"2O", 9},
+    {"AC", 8},  {"AO", 8},
+    {"KC", 7},  {"KE", 7},  {"KP", 7},  {"KO", 7},
+    {"QC", 6},  {"QE", 6},  {"QP", 6},  {"QO", 6},
+    {"JC", 5},  {"JE", 5},  {"JP", 5},  {"JO", 5},
+    {"7C", 4},  {"7P", 4},
+    {"6C", 3},  {"6E", 3},  {"6P", 3},  {"6O", 3},
+    {"5C", 2},  {"5E", 2},  {"5P", 2},  {"5O", 2},
+    {"4C", 1},  {"4E", 1},  {"4P", 1},  {"4O", 1}
+  };
+
+  if (ranking.find(card) != ranking.end()) {
+    return ranking[card];
+  }
+  return 0;
+}
+
+int legacy_compare_cards(const string& card1, const string& card2) {
+  int rank1 = legacy_get_card_rank(card1);
+  int rank2 = legacy_get_card_rank(card2);
+
+  if (rank1 > rank2) return 0;
+  if (rank2 > rank1) return 1;
+  return -1;
+}
+
+string legacy_get_random_card(vector<string>& used_cards) {
+  const string suits[] = {"C", "E", "P", "O"};
+  const string values[] = {"4", "5", "6", "7", "J", "Q", "K", "A", "2", "3"};
+
+  string card;
+  do {
+    string value = values[rand() % 10];
+    string suit = suits[rand() % 4];
+    card = value + suit;
+  } while (find(used_cards.begin(), used_cards.end(), card) != used_cards.end());
+
+  used_cards.push_back(card);
+  return card;
+}
+
+void legacy_deal_cards(LegacyHand hands[TOTAL_PER_ROOM]) {
+  vector<string> used_cards;
+
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    hands[i].names.clear();
+    for (int j = 0; j < HAND_SIZE; j++) {
+      hands[i].names.push_back(legacy_get_random_card(used_cards));
+    }
+  }
+}
+
+int legacy_calculate_envido(vector<string>& cards) {
+  map<char, vector<int>> suits_map;
+
+  for (const string& card : cards) {
+    char suit = card[card.length() - 1];
+    int value = 0;
+
+    if (card[0] == 'A') value = 1;
+    else if (card[0] >= '2' && card[0] <= '7') value = card[0] - '0';
+    else value = 0;
+
+    suits_map[suit].push_back(value);
+  }
+
+  int max_envido = 0;
+  for (auto& pair : suits_map) {
+    if (pair.second.size() >= 2) {
+      sort(pair.second.rbegin(), pair.second.rend());
+      int envido = 20 + pair.second[0] + pair.second[1];
+      max_envido = max(max_envido, envido);
+    } else if (pair.second.size() == 1) {
+      max_envido = max(max_envido, pair.second[0]);
+    }
+  }
+
+  return max_envido;
+}
+
+bool legacy_check_flor(vector<string>& cards) {
+  if (cards.size() < 3) return false;
+
+  char first_suit = cards[0][cards[0].length() - 1];
+  for (size_t i = 1; i < cards.size(); i++) {
+    if (cards[i][cards[i].length() - 1] != first_suit) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// send_message() without the send(): the text is still copied into the
+// fixed-size Message the old protocol put on the wire.
+int legacy_send_message(int type, const string& text) {
+  LegacyMessage msg;
+  msg.type = type;
+  strncpy(msg.text, text.c_str(), LEGACY_MESSAGE_SIZE - 1);
+  msg.text[LEGACY_MESSAGE_SIZE - 1] = '\0';
+  return msg.text[0] + (int)text.size();
+}
+
+int legacy_send_scoreboard(const int points[TOTAL_PER_ROOM]) {
+  string scoreboard = "\n=== PLACAR ===\n";
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    scoreboard += "Jogador " + to_string(i) + ": " + to_string(points[i]) + " pontos\n";
+  }
+  scoreboard += "\n";
+
+  int sent = 0;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    sent += legacy_send_message(3, scoreboard);
+  }
+  return sent;
+}
+
+int legacy_send_hand(const vector<string>& cards, const vector<int>& cards_already_played,
+                     const string played_cards[], int cards_played) {
+  string full_msg = "\n=== MESA ===\n";
+  if (cards_played == 0) {
+    full_msg += "(vazia)\n";
+  } else {
+    for (int i = 0; i < cards_played; i++) {
+      full_msg += "Jogador " + to_string(i) + ": " + played_cards[i] + "\n";
+    }
+  }
+  full_msg += "\n=== SUAS CARTAS ===\n";
+
+  for (size_t i = 0; i < cards.size(); i++) {
+    bool played = find(cards_already_played.begin(), cards_already_played.end(), i) !=
+                  cards_already_played.end();
+
+    if (!played) {
+      full_msg += to_string(i + 1) + ". " + cards[i] + "\n";
+    }
+  }
+  full_msg += "\n";
+
+  return legacy_send_message(1, full_msg);
+}
+
+// One hand as room_thread used to run it: deal, envido and flor, scoreboard,
+// a hand message before every turn, and each player playing their cards in
+// order. Betting is left out so both versions do the same work.
+int legacy_play_hand(LegacyHand hands[TOTAL_PER_ROOM], const int points[TOTAL_PER_ROOM]) {
+  int checksum = 0;
+  legacy_deal_cards(hands);
+
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    checksum += legacy_calculate_envido(hands[i].names) + legacy_check_flor(hands[i].names);
+  }
+  checksum += legacy_send_scoreboard(points);
+
+  string empty_table[TOTAL_PER_ROOM];
+  vector<int> cards_already_played[TOTAL_PER_ROOM];
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    checksum += legacy_send_hand(hands[i].names, cards_already_played[i], empty_table, 0);
+  }
+
+  int rounds_won[TOTAL_PER_ROOM] = {0, 0};
+  for (int round = 0; round < HAND_SIZE; round++) {
+    string played_cards[TOTAL_PER_ROOM];
+    for (int turn = 0; turn < TOTAL_PER_ROOM; turn++) {
+      checksum += legacy_send_hand(hands[turn].names, cards_already_played[turn], played_cards, turn);
+      played_cards[turn] = hands[turn].names[round];
+      cards_already_played[turn].push_back(round);
+    }
+
+    int winner = legacy_compare_cards(played_cards[0], played_cards[1]);
+    if (winner != -1 && ++rounds_won[winner] == 2) break;
+  }
+
+  return checksum + rounds_won[0] * 2 + rounds_won[1];
+}
+
+typedef struct {
+  Deck deck;
+  Rng rng;
+  Card cards[TOTAL_PER_ROOM][HAND_SIZE];
+  string out[TOTAL_PER_ROOM];
+  Game game;
+  uint64_t games;
+} BenchRoom;
+
+void deal_room(BenchRoom* room) {
+  start_deal(&room->deck);
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    for (int j = 0; j < HAND_SIZE; j++) {
+      room->cards[i][j] = draw_card(&room->deck, &room->rng);
+    }
+  }
+}
+
+template <typename T>
+void broadcast(BenchRoom* room, MessageType type, const T& payload) {
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    append_frame(&room->out[i], type, &payload, sizeof(T));
+  }
+}
+
+// The frames a hand start and a turn produce today, appended to reused
+// per-player buffers the way the server queues them.
+int build_deal_messages(BenchRoom* room) {
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    room->out[i].clear();
+    DealPayload deal;
+    memcpy(deal.cards, room->cards[i], sizeof(deal.cards));
+    append_frame(&room->out[i], MSG_DEAL, &deal, sizeof(deal));
+  }
+  ScorePayload score = {{1, 0}};
+  broadcast(room, MSG_SCORE, score);
+
+  YourTurnPayload turn = {PROMPT_PLAY, 1};
+  append_frame(&room->out[0], MSG_YOUR_TURN, &turn, sizeof(turn));
+  return room->out[0].size() + room->out[1].size();
+}
+
+int play_hand(BenchRoom* room) {
+  deal_room(room);
+  int checksum = 0;
+
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    room->out[i].clear();
+    HandScore score = get_hand_score(room->cards[i]);
+    checksum += score.envido + score.flor;
+
+    DealPayload deal;
+    memcpy(deal.cards, room->cards[i], sizeof(deal.cards));
+    append_frame(&room->out[i], MSG_DEAL, &deal, sizeof(deal));
+  }
+
+  int rounds_won[TOTAL_PER_ROOM] = {0, 0};
+  for (int round = 0; round < HAND_SIZE; round++) {
+    for (int turn = 0; turn < TOTAL_PER_ROOM; turn++) {
+      YourTurnPayload prompt = {PROMPT_PLAY, 1};
+      append_frame(&room->out[turn], MSG_YOUR_TURN, &prompt, sizeof(prompt));
+
+      CardPlayedPayload played = {(uint8_t)turn, (uint8_t)round, room->cards[turn][round]};
+      broadcast(room, MSG_CARD_PLAYED, played);
+    }
+
+    int winner = compare_cards(room->cards[0][round], room->cards[1][round]);
+    RoundResultPayload result = {(uint8_t)(winner == -1 ? NO_SEAT : winner)};
+    broadcast(room, MSG_ROUND_RESULT, result);
+    if (winner != -1 && ++rounds_won[winner] == 2) break;
+  }
+
+  HandResultPayload result = {(uint8_t)(rounds_won[1] > rounds_won[0]), 1, HAND_WON_ROUNDS};
+  broadcast(room, MSG_HAND_RESULT, result);
+  ScorePayload score = {{(uint8_t)(rounds_won[0] >= rounds_won[1]), (uint8_t)(rounds_won[1] > rounds_won[0])}};
+  broadcast(room, MSG_SCORE, score);
+
+  return checksum + room->out[0].size() + room->out[1].size();
+}
+
+// A whole game through the engine, with random players, every event framed
+// into the players' buffers the way the server queues them. Once the
+// buffers have grown to a game's worth this should not allocate at all.
+int play_game(BenchRoom* room) {
+  Game* game = &room->game;
+  game_start(game, ++room->games);
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    room->out[i].clear();
+  }
+
+  int seat;
+  do {
+    for (int i = 0; i < game->event_count; i++) {
+      const GameEvent* event = &game->events[i];
+      for (int j = 0; j < TOTAL_PER_ROOM; j++) {
+        if (event->seat == ALL_SEATS || event->seat == j) {
+          append_frame(&room->out[j], event->opcode, event->payload, event->length);
+        }
+      }
+    }
+    game->event_count = 0;
+
+    seat = game_expected_seat(game);
+    if (seat >= 0) game_act(game, seat, random_policy(game, seat, &room->rng));
+  } while (seat >= 0);
+
+  return game->winner + room->out[0].size() + room->out[1].size();
+}
+
+vector<BenchHand> build_hands() {
+  vector<BenchHand> hands;
+  Rng rng;
+  seed_rng(&rng, 1);
+  Deck deck;
+  init_deck(&deck);
+
+  for (int i = 0; i < HAND_COMBINATIONS; i++) {
+    BenchHand hand;
+    start_deal(&deck);
+    for (int j = 0; j < HAND_SIZE; j++) {
+      hand.cards[j] = draw_card(&deck, &rng);
+    }
+    hands.push_back(hand);
+  }
+  return hands;
+}
+
+vector<LegacyHand> build_legacy_hands(const vector<BenchHand>& hands) {
+  vector<LegacyHand> legacy_hands;
+  for (const BenchHand& hand : hands) {
+    LegacyHand legacy;
+    for (int j = 0; j < HAND_SIZE; j++) {
+      legacy.names.push_back(card_to_string(hand.cards[j]));
+    }
+    legacy_hands.push_back(legacy);
+  }
+  return legacy_hands;
+}
+
+// One CSV row per benchmark: name,impl,ns_per_op,allocs_per_op,ops,checksum.
+// rounds scales the work for the slow legacy paths so every row takes about
+// the same wall time.
+template <typename T, typename F>
+void run_bench(const char* name, const char* impl, vector<T>& inputs, int rounds, F body) {
+  long checksum = 0;
+  uint64_t allocations_before = allocations;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int round = 0; round < rounds; round++) {
+    for (T& input : inputs) {
+      checksum += body(input);
+    }
+  }
+  chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+  double ops = (double)rounds * inputs.size();
+  double ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+  cout << name << "," << impl << "," << ns / ops << "," << (allocations - allocations_before) / ops << ","
+       << (uint64_t)ops << "," << checksum << endl;
+}
+
+int main() {
+  vector<BenchHand> hands = build_hands();
+  vector<LegacyHand> legacy_hands = build_legacy_hands(hands);
+  hand_score_table();
+  legacy_get_card_rank("4C");
+  srand(1);
+
+  BenchRoom room;
+  init_deck(&room.deck);
+  seed_rng(&room.rng, 1);
+  room.games = 0;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    room.out[i].reserve(MAX_FRAME_SIZE);
+  }
+  deal_room(&room);
+
+  LegacyHand legacy_room[TOTAL_PER_ROOM];
+  int points[TOTAL_PER_ROOM] = {3, 7};
+  string empty_table[TOTAL_PER_ROOM];
+  vector<int> none_played;
+
+  cout << "name,impl,ns_per_op,allocs_per_op,ops,checksum" << endl;
+
+  run_bench("card_rank", "legacy", legacy_hands, BENCH_ROUNDS / 10, [](LegacyHand& hand) {
+    return legacy_get_card_rank(hand.names[0]);
+  });
+  run_bench("card_rank", "ids", hands, BENCH_ROUNDS, [](BenchHand& hand) {
+    return get_card_rank(hand.cards[0]);
+  });
+
+  run_bench("compare_cards", "legacy", legacy_hands, BENCH_ROUNDS / 10, [](LegacyHand& hand) {
+    return legacy_compare_cards(hand.names[0], hand.names[1]);
+  });
+  run_bench("compare_cards", "ids", hands, BENCH_ROUNDS, [](BenchHand& hand) {
+    return compare_cards(hand.cards[0], hand.cards[1]);
+  });
+
+  run_bench("deal", "legacy", legacy_hands, BENCH_ROUNDS / 100, [&](LegacyHand&) {
+    legacy_deal_cards(legacy_room);
+    return legacy_room[1].names[2][0];
+  });
+  run_bench("deal", "ids", hands, BENCH_ROUNDS, [&](BenchHand&) {
+    deal_room(&room);
+    return room.cards[1][2];
+  });
+
+  run_bench("envido", "legacy", legacy_hands, BENCH_ROUNDS / 10, [](LegacyHand& hand) {
+    return legacy_calculate_envido(hand.names);
+  });
+  run_bench("envido", "ids", hands, BENCH_ROUNDS, [](BenchHand& hand) {
+    return calculate_envido(hand.cards);
+  });
+  run_bench("envido", "table", hands, BENCH_ROUNDS, [](BenchHand& hand) {
+    return get_hand_score(hand.cards).envido;
+  });
+
+  run_bench("flor", "legacy", legacy_hands, BENCH_ROUNDS / 10, [](LegacyHand& hand) {
+    return legacy_check_flor(hand.names);
+  });
+  run_bench("flor", "ids", hands, BENCH_ROUNDS, [](BenchHand& hand) {
+    return check_flor(hand.cards);
+  });
+  run_bench("flor", "table", hands, BENCH_ROUNDS, [](BenchHand& hand) {
+    return get_hand_score(hand.cards).flor != 0;
+  });
+
+  run_bench("envido+flor", "legacy", legacy_hands, BENCH_ROUNDS / 10, [](LegacyHand& hand) {
+    return legacy_calculate_envido(hand.names) + legacy_check_flor(hand.names);
+  });
+  run_bench("envido+flor", "ids", hands, BENCH_ROUNDS, [](BenchHand& hand) {
+    return calculate_envido(hand.cards) + check_flor(hand.cards);
+  });
+  run_bench("envido+flor", "table", hands, BENCH_ROUNDS, [](BenchHand& hand) {
+    HandScore score = get_hand_score(hand.cards);
+    return score.envido + (score.flor != 0);
+  });
+
+  run_bench("hand_messages", "legacy", legacy_hands, BENCH_ROUNDS / 100, [&](LegacyHand& hand) {
+    return legacy_send_scoreboard(points) + legacy_send_hand(hand.names, none_played, empty_table, 0);
+  });
+  run_bench("hand_messages", "frames", hands, BENCH_ROUNDS, [&](BenchHand&) {
+    return build_deal_messages(&room);
+  });
+
+  run_bench("full_hand", "legacy", legacy_hands, BENCH_ROUNDS / 200, [&](LegacyHand&) {
+    return legacy_play_hand(legacy_room, points);
+  });
+  run_bench("full_hand", "ids", hands, BENCH_ROUNDS / 10, [&](BenchHand&) {
+    return play_hand(&room);
+  });
+
+  // Warm the buffers up first, as a long-running server would have.
+  for (int i = 0; i < BENCH_ROUNDS; i++) {
+    play_game(&room);
+  }
+  room.games = 0;
+  run_bench("full_game", "engine", hands, 1, [&](BenchHand&) {
+    return play_game(&room);
+  });
+
+  return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef CARDS_H
+#define CARDS_H
+
+#include <stdint.h>
+#include <string>
+
+#define CARDS_IN_DECK 40
+#define CARD_SUITS_COUNT 4
+#define HAND_SIZE 3
+#define NO_CARD 0xFF
+
+using namespace std;
+
+// A card is its value index times the number of suits plus its suit index,
+// so "4C" is 0 and "3O" is 39.
+typedef uint8_t Card;
+
+constexpr char CARD_VALUES[] = "4567JQKA23";
+constexpr char CARD_SUITS[] = "CEPO";
+
+constexpr uint8_t CARD_RANKS[CARDS_IN_DECK] = {
+  /* 4 */ 1,  1,  1,  1,
+  /* 5 */ 2,  2,  2,  2,
+  /* 6 */ 3,  3,  3,  3,
+  /* 7 */ 4,  12, 4,  11,
+  /* J */ 5,  5,  5,  5,
+  /* Q */ 6,  6,  6,  6,
+  /* K */ 7,  7,  7,  7,
+  /* A */ 8,  14, 13, 8,
+  /* 2 */ 9,  9,  9,  9,
+  /* 3 */ 10, 10, 10, 10
+};
+
+constexpr uint8_t CARD_ENVIDO_VALUES[] = {4, 5, 6, 7, 0, 0, 0, 1, 2, 3};
+
+constexpr Card make_card(int value, int suit) {
+  return (Card)(value * CARD_SUITS_COUNT + suit);
+}
+
+constexpr int card_value(Card card) {
+  return card / CARD_SUITS_COUNT;
+}
+
+constexpr int card_suit(Card card) {
+  return card % CARD_SUITS_COUNT;
+}
+
+constexpr int get_card_rank(Card card) {
+  return CARD_RANKS[card];
+}
+
+constexpr int get_envido_value(Card card) {
+  return CARD_ENVIDO_VALUES[card_value(card)];
+}
+
+inline string card_to_string(Card card) {
+  string text(2, ' ');
+  text[0] = CARD_VALUES[card_value(card)];
+  text[1] = CARD_SUITS[card_suit(card)];
+  return text;
+}
+
+inline Card parse_card(const string& text) {
+  if (text.size() != 2) return NO_CARD;
+
+  for (int value = 0; CARD_VALUES[value]; value++) {
+    for (int suit = 0; CARD_SUITS[suit]; suit++) {
+      if (CARD_VALUES[value] == text[0] && CARD_SUITS[suit] == text[1]) {
+        return make_card(value, suit);
+      }
+    }
+  }
+  return NO_CARD;
+}
+
+#endif
@@ -1,135 +1,563 @@
 #include <arpa/inet.h>
 #include <iostream>
 #include <cstring>
+#include <cstdlib>
+#include <fstream>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <pthread.h>
 #include "types.h"
 
 #define PORT 8080
+#define SPECTATOR_PORT 8081
+#define RECV_BUFFER_SIZE 4096
+#define RECONNECT_ATTEMPTS 30
 
 using namespace std;
 
 int sock = 0;
 bool game_running = true;
+bool spectating = false;
 
+// The token from ROOM_JOIN takes the seat back if the connection drops.
+uint8_t session_token[SESSION_TOKEN_SIZE];
+bool has_session = false;
+bool reconnecting = false;
+
+// A named player keeps the secret the server issued for its name in
+// ~/.truco-<name> and sends it with every HELLO; without it the name is
+// refused once it has a rating.
+string secret_path;
+
+// Set by NOTICE_TOURNAMENT_ADVANCED: the game about to end is not the last,
+// and the next opponent comes on this same connection.
+bool advancing = false;
+
+// What this client knows of the game; the server only sends changes to it.
+int my_seat = 0;
+Card hand[HAND_SIZE] = {NO_CARD, NO_CARD, NO_CARD};
+Card table[TOTAL_PER_ROOM] = {NO_CARD, NO_CARD};
+int points[TOTAL_PER_ROOM] = {0, 0};
+
+const char* TRUCO_NAMES[] = {"", "TRUCO", "RETRUCO", "VALE 4"};
+const char* ENVIDO_NAMES[] = {"", "ENVIDO", "REAL ENVIDO", "FALTA ENVIDO"};
+
+int opponent_of(int player) {
+    return (player == 0) ? 1 : 0;
+}
+
+bool send_frame(MessageType type, const void* payload, uint8_t length);
+
+void render_scoreboard() {
+    cout << "\n=== PLACAR ===\n";
+    for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+        cout << "Jogador " << i << ": " << points[i] << " pontos\n";
+    }
+    cout << "\n";
+}
+
+void render_table() {
+    cout << "\n=== MESA ===\n";
+    bool empty = true;
+    for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+        if (table[i] != NO_CARD) {
+            cout << "Jogador " << i << ": " << card_to_string(table[i]) << "\n";
+            empty = false;
+        }
+    }
+    if (empty) cout << "(vazia)\n";
+}
+
+void render_hand() {
+    cout << "\n=== SUAS CARTAS ===\n";
+    for (int i = 0; i < HAND_SIZE; i++) {
+        if (hand[i] != NO_CARD) {
+            cout << i + 1 << ". " << card_to_string(hand[i]) << "\n";
+        }
+    }
+    cout << "\n";
+}
+
+void apply_snapshot(const SnapshotPayload* snapshot) {
+    my_seat = snapshot->seat;
+    for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+        points[i] = snapshot->points[i];
+        table[i] = snapshot->table[i];
+    }
+    for (int i = 0; i < HAND_SIZE; i++) {
+        hand[i] = snapshot->hand[i];
+    }
+
+    render_scoreboard();
+    render_table();
+    if (!spectating) render_hand();
+}
+
+void apply_deal(const DealPayload* deal) {
+    for (int i = 0; i < HAND_SIZE; i++) {
+        hand[i] = deal->cards[i];
+    }
+    for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+        table[i] = NO_CARD;
+    }
+
+    render_scoreboard();
+    render_table();
+    render_hand();
+}
+
+void apply_card_played(const CardPlayedPayload* played) {
+    if (played->seat >= TOTAL_PER_ROOM || played->slot >= HAND_SIZE ||
+        (played->seat == my_seat && hand[played->slot] != played->card)) {
+        send_frame(MSG_RESYNC, nullptr, 0);
+        return;
+    }
+
+    table[played->seat] = played->card;
+    if (played->seat == my_seat) hand[played->slot] = NO_CARD;
+
+    render_table();
+    if (!spectating) render_hand();
+}
+
+void apply_score(const ScorePayload* score) {
+    for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+        points[i] += score->delta[i];
+    }
+    render_scoreboard();
+}
+
+void render_prompt(const YourTurnPayload* turn) {
+    switch (turn->prompt) {
+        case PROMPT_PLAY:
+            render_table();
+            render_hand();
+            cout << "\nSua vez! Digite:\n- Número da carta (1-3)\n- 'T' para Truco\n- 'E' para Envido (só 1ª rodada)\n";
+            break;
+        case PROMPT_TRUCO_ANSWER:
+            cout << "\nAceitar? Digite:\n- 'S' para aceitar\n- 'N' para correr\n";
+            if (turn->can_raise) cout << "- 'T' para aumentar\n";
+            break;
+        case PROMPT_ENVIDO_ANSWER:
+            cout << "\nAceitar? Digite:\n- 'S' para aceitar\n- 'N' para correr\n";
+            if (turn->can_raise) cout << "- 'E' para aumentar\n";
+            break;
+    }
+}
+
+void render_envido_result(const EnvidoResultPayload* result) {
+    if (!result->accepted) {
+        cout << "Jogador " << opponent_of(result->winner) << " não quis! Jogador "
+             << (int)result->winner << " ganha " << (int)result->points << " ponto.\n";
+        return;
+    }
+
+    cout << "🔍 Comparando Envido:\n";
+    for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+        cout << "Jogador " << i << ": " << (int)result->envido[i] << " pontos\n";
+    }
+    if (result->tie) cout << "(Empate - mão ganha)\n";
+    cout << "Jogador " << (int)result->winner << " venceu e ganhou " << (int)result->points << " pontos!\n";
+}
+
+void render_winner(const WinnerPayload* result) {
+    switch (result->reason) {
+        case WIN_BY_ENVIDO:
+            cout << "\n\n🏆 JOGADOR " << (int)result->winner << " VENCEU O JOGO COM ENVIDO! 🏆\n\n";
+            break;
+        case WIN_BY_DISCONNECT:
+            cout << "\n\n❌ Jogador " << opponent_of(result->winner) << " desconectou. Fim de jogo.\n\n";
+            break;
+        case WIN_BY_TIMEOUT:
+            cout << "\n\n⌛ Jogador " << opponent_of(result->winner) << " parou de jogar. Fim de jogo.\n\n";
+            break;
+        default:
+            cout << "\n\n🏆 JOGADOR " << (int)result->winner << " VENCEU O JOGO! 🏆\n\n";
+            break;
+    }
+}
+
+void render_notice(const NoticePayload* notice) {
+    switch (notice->code) {
+        case NOTICE_NOT_YOUR_TURN:
+            cout << "Aguarde sua vez!\n";
+            break;
+        case NOTICE_INVALID_CARD:
+            cout << "Carta inválida! Escolha 1, 2 ou 3.\n";
+            break;
+        case NOTICE_CARD_ALREADY_PLAYED:
+            cout << "Você já jogou essa carta!\n";
+            break;
+        case NOTICE_TRUCO_MAX:
+            cout << "Já está no máximo (Vale 4)!\n";
+            break;
+        case NOTICE_ENVIDO_MAX:
+            cout << "Envido já está no máximo!\n";
+            break;
+        case NOTICE_ENVIDO_DONE:
+            cout << "Envido já foi jogado nesta mão! Jogue uma carta.\n";
+            break;
+        case NOTICE_ENVIDO_FIRST_ROUND:
+            cout << "Envido só pode ser cantado na 1ª rodada!\n";
+            break;
+        case NOTICE_TRUCO_RAISED:
+            cout << "Você aumentou! Voltando para o adversário...\n";
+            break;
+        case NOTICE_ENVIDO_RAISED:
+            cout << "Você aumentou o Envido! Voltando...\n";
+            break;
+        case NOTICE_ANSWER_FIRST:
+            cout << "Responda primeiro: aceitar, correr ou aumentar.\n";
+            break;
+        case NOTICE_BAD_VERSION:
+            cout << "❌ Versão do protocolo incompatível com o servidor.\n";
+            break;
+        case NOTICE_TURN_TIMEOUT:
+            cout << "⌛ Tempo esgotado! O servidor jogou por você.\n";
+            break;
+        case NOTICE_NO_TABLE:
+            cout << "❌ Mesa não encontrada ou já encerrada.\n";
+            break;
+        case NOTICE_OPPONENT_AWAY:
+            cout << "📡 O adversário caiu. Aguardando ele voltar...\n";
+            break;
+        case NOTICE_OPPONENT_BACK:
+            cout << "📡 O adversário voltou!\n";
+            break;
+        case NOTICE_SESSION_EXPIRED:
+            cout << "❌ Sua vaga na mesa expirou.\n";
+            game_running = false;
+            break;
+        case NOTICE_ACTION_QUEUED:
+            cout << "⏳ Jogada guardada; sai assim que for sua vez.\n";
+            break;
+        case NOTICE_TOURNAMENT_ADVANCED:
+            advancing = true;
+            break;
+        case NOTICE_TOURNAMENT_WON:
+            cout << "\n🏆 Você é o campeão do torneio! 🏆\n";
+            break;
+        case NOTICE_NAME_TAKEN:
+            cout << "❌ Esse nome já pertence a outro jogador.\n";
+            game_running = false;
+            break;
+    }
+}
+
+// Leaves secret all zeros when there is none yet.
+void load_secret(uint8_t* secret) {
+    char saved[PLAYER_SECRET_SIZE];
+    ifstream in(secret_path.c_str(), ios::binary);
+    if (in.read(saved, PLAYER_SECRET_SIZE)) memcpy(secret, saved, PLAYER_SECRET_SIZE);
+}
+
+void save_secret(const IdentityPayload* identity) {
+    ofstream out(secret_path.c_str(), ios::binary | ios::trunc);
+    out.write((const char*)identity->secret, PLAYER_SECRET_SIZE);
+    if (out) cout << "🔑 Nome registrado; a chave fica em " << secret_path << "\n";
+    else cout << "❌ Não foi possível guardar a chave em " << secret_path << "\n";
+}
+
+void render_frame(const Frame& frame) {
+    switch (frame.opcode) {
+        case MSG_ROOM_JOIN: {
+            const RoomJoinPayload* join = frame_payload<RoomJoinPayload>(frame);
+            if (join && join->version != PROTOCOL_VERSION) {
+                cout << "❌ Versão do protocolo incompatível com o servidor.\n";
+                game_running = false;
+                break;
+            }
+            if (join) my_seat = join->seat;
+            if (join && !spectating) {
+                memcpy(session_token, join->token, SESSION_TOKEN_SIZE);
+                has_session = true;
+            }
+            if (spectating) cout << "👀 Assistindo à mesa!\n";
+            else if (reconnecting) cout << "✅ Reconectado! De volta à mesa.\n";
+            else cout << "✅ Você entrou na sala!\n";
+            reconnecting = false;
+            break;
+        }
+
+        case MSG_SNAPSHOT:
+            if (const SnapshotPayload* snapshot = frame_payload<SnapshotPayload>(frame)) apply_snapshot(snapshot);
+            break;
+
+        case MSG_DEAL:
+            if (const DealPayload* deal = frame_payload<DealPayload>(frame)) apply_deal(deal);
+            break;
+
+        case MSG_CARD_PLAYED:
+            if (const CardPlayedPayload* played = frame_payload<CardPlayedPayload>(frame)) apply_card_played(played);
+            break;
+
+        case MSG_SCORE:
+            if (const ScorePayload* score = frame_payload<ScorePayload>(frame)) apply_score(score);
+            break;
+
+        case MSG_FLOR:
+            cout << "VOCÊ TEM FLOR!\n";
+            break;
+
+        case MSG_YOUR_TURN:
+            if (const YourTurnPayload* turn = frame_payload<YourTurnPayload>(frame)) render_prompt(turn);
+            break;
+
+        case MSG_TRUCO_CALL:
+            if (const TrucoCallPayload* call = frame_payload<TrucoCallPayload>(frame)) {
+                cout << "🔥 Jogador " << (int)call->seat << " pediu " << TRUCO_NAMES[call->level % 4]
+                     << " (vale " << (int)call->value << " pontos)!\n";
+            }
+            break;
+
+        case MSG_TRUCO_RESULT:
+            if (const TrucoResultPayload* result = frame_payload<TrucoResultPayload>(frame)) {
+                if (result->accepted) {
+                    cout << "Jogador " << (int)result->seat << " aceitou! Mão vale " << (int)result->value << " ponto(s).\n";
+                } else {
+                    cout << "Jogador " << (int)result->seat << " correu! Jogador " << opponent_of(result->seat)
+                         << " ganha " << (int)result->value << " ponto(s)!\n";
+                }
+            }
+            break;
+
+        case MSG_ENVIDO_CALL:
+            if (const EnvidoCallPayload* call = frame_payload<EnvidoCallPayload>(frame)) {
+                cout << "💎 Jogador " << (int)call->seat << " cantou " << ENVIDO_NAMES[call->level % 4] << "!\n";
+            }
+            break;
+
+        case MSG_ENVIDO_RESULT:
+            if (const EnvidoResultPayload* result = frame_payload<EnvidoResultPayload>(frame)) render_envido_result(result);
+            break;
+
+        case MSG_ROUND_RESULT:
+            if (const RoundResultPayload* result = frame_payload<RoundResultPayload>(frame)) {
+                if (result->winner == NO_SEAT) cout << "Rodada empatada!\n";
+                else cout << "Jogador " << (int)result->winner << " venceu a rodada!\n";
+            }
+            for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+                table[i] = NO_CARD;
+            }
+            break;
+
+        case MSG_HAND_RESULT:
+            if (const HandResultPayload* result = frame_payload<HandResultPayload>(frame)) {
+                if (result->reason == HAND_WON_TIE) {
+                    cout << "Empate total! Jogador " << (int)result->winner << " (que começou) venceu a mão!\n";
+                } else {
+                    cout << "Jogador " << (int)result->winner << " venceu a mão e ganhou "
+                         << (int)result->points << " ponto(s)!\n";
+                }
+            }
+            // Spectators get no DEAL, which is what clears the table for players.
+            for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+                table[i] = NO_CARD;
+            }
+            break;
+
+        case MSG_WINNER:
+            if (const WinnerPayload* result = frame_payload<WinnerPayload>(frame)) render_winner(result);
+            if (advancing) {
+                cout << "🏅 Você avançou no torneio! Aguardando o próximo adversário...\n\n";
+                advancing = false;
+                has_session = false;
+                break;
+            }
+            game_running = false;
+            break;
+
+        case MSG_NOTICE:
+            if (const NoticePayload* notice = frame_payload<NoticePayload>(frame)) render_notice(notice);
+            break;
+
+        case MSG_IDENTITY:
+            if (const IdentityPayload* identity = frame_payload<IdentityPayload>(frame)) save_secret(identity);
+            break;
+
+        default:
+            break;
+    }
+}
+
+int connect_server(int port) {
+    struct sockaddr_in serv_addr;
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// The server holds the seat for a while after a drop; RESUME takes it back
+// and the server answers with ROOM_JOIN and a fresh snapshot.
+bool reconnect() {
+    close(sock);
+    cout << "\n📡 Conexão perdida. Tentando reconectar...\n";
+    for (int attempt = 0; attempt < RECONNECT_ATTEMPTS && game_running; attempt++) {
+        sleep(1);
+        int fd = connect_server(PORT);
+        if (fd < 0) continue;
+
+        sock = fd;
+        reconnecting = true;
+        ResumePayload resume;
+        resume.version = PROTOCOL_VERSION;
+        memcpy(resume.token, session_token, SESSION_TOKEN_SIZE);
+        if (send_frame(MSG_RESUME, &resume, sizeof(resume))) return true;
+        close(fd);
+    }
+    return false;
+}
 
 void* receive_messages(void* arg) {
-    Message msg;
-    
+    uint8_t buffer[RECV_BUFFER_SIZE];
+    size_t buffered = 0;
+
     while (game_running) {
-        int bytes = recv(sock, &msg, sizeof(Message), 0);
-        
+        int bytes = recv(sock, buffer + buffered, sizeof(buffer) - buffered, 0);
+
+        if (bytes <= 0 && game_running && has_session && reconnect()) {
+            buffered = 0;
+            continue;
+        }
         if (bytes <= 0) {
             cout << "\n❌ Conexão perdida com o servidor.\n";
             game_running = false;
             break;
         }
-  
-        switch (msg.type) {
-            case MSG_WINNER:
-                cout << "\n" << msg.text << "\n";
-                game_running = false;
-                break;
-                
-            case MSG_SCOREBOARD:
-                cout << msg.text;
-                break;
-                
-            case MSG_HAND:
-                cout << msg.text;
-                break;
-                
-            case MSG_TABLE:
-                cout << msg.text;
-                break;
-                
-            case MSG_YOUR_TURN:
-                cout << "\n" << msg.text;
-                break;
-                
-            case MSG_TEXT:
-                cout << msg.text;
-                break;
-                
-            case MSG_ROOM_JOIN:
-                cout << "✅ " << msg.text;
-                break;
-                
-            default:
-                cout << msg.text;
-                break;
+        buffered += bytes;
+
+        Frame frame;
+        size_t offset = 0;
+        size_t frame_size;
+        while (game_running && (frame_size = parse_frame(buffer + offset, buffered - offset, &frame)) > 0) {
+            render_frame(frame);
+            offset += frame_size;
         }
-        
+        memmove(buffer, buffer + offset, buffered - offset);
+        buffered -= offset;
+
         fflush(stdout);
     }
-    
+
     return nullptr;
 }
 
+bool send_frame(MessageType type, const void* payload, uint8_t length) {
+    string frame;
+    append_frame(&frame, type, payload, length);
+    return send(sock, frame.data(), frame.size(), MSG_NOSIGNAL) == (ssize_t)frame.size();
+}
 
 void* send_commands(void* arg) {
     string input;
-    
+
     while (game_running) {
         getline(cin, input);
-        
+
         if (!game_running) break;
-        
+
         if (input.empty()) continue;
 
-        Message msg;
-        msg.type = MSG_GAME_ACTION;
-        strncpy(msg.text, input.c_str(), MESSAGE_SIZE - 1);
-        msg.text[MESSAGE_SIZE - 1] = '\0';
- 
-        if (send(sock, &msg, sizeof(Message), 0) < 0) {
+        bool sent;
+        if (input == "T" || input == "t") {
+            sent = send_frame(MSG_CALL_TRUCO, nullptr, 0);
+        } else if (input == "E" || input == "e") {
+            sent = send_frame(MSG_CALL_ENVIDO, nullptr, 0);
+        } else if (input == "S" || input == "s") {
+            sent = send_frame(MSG_ACCEPT, nullptr, 0);
+        } else if (input == "N" || input == "n") {
+            sent = send_frame(MSG_REJECT, nullptr, 0);
+        } else if (input == "R" || input == "r") {
+            sent = send_frame(MSG_RESYNC, nullptr, 0);
+        } else {
+            int choice = atoi(input.c_str());
+            if (choice < 1 || choice > HAND_SIZE) {
+                cout << "Comando inválido! Use 1-3, T, E, S, N ou R (redesenhar).\n";
+                continue;
+            }
+            PlayCardPayload play = {(uint8_t)(choice - 1)};
+            sent = send_frame(MSG_PLAY_CARD, &play, sizeof(play));
+        }
+
+        // A dropped session comes back through the receive thread.
+        if (!sent && has_session) {
+            cout << "📡 Sem conexão; o comando não foi enviado.\n";
+            continue;
+        }
+        if (!sent) {
             cout << "❌ Erro ao enviar mensagem.\n";
             game_running = false;
             break;
         }
     }
-    
+
     return nullptr;
 }
 
+// With -w the client only watches a table: the featured one, or the one
+// whose id the server logged.
 int main(int argc, char const* argv[]) {
-    struct sockaddr_in serv_addr;
-    
+    uint32_t watch_table = FEATURED_TABLE;
+    const char* name = "";
+    if (argc > 1 && strcmp(argv[1], "-w") == 0) {
+        spectating = true;
+        my_seat = NO_SEAT;
+        if (argc > 2) watch_table = strtoul(argv[2], nullptr, 10);
+    } else if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        name = argv[2];
+    }
+
     cout << "🃏 TRUCO GAUDÉRIO - Cliente\n";
     cout << "============================\n\n";
 
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        cout << "❌ Erro ao criar socket\n";
-        return -1;
-    }
-    
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-        cout << "❌ Endereço inválido ou não suportado\n";
-        return -1;
-    }
-
     cout << "🔄 Conectando ao servidor...\n";
-    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+    if ((sock = connect_server(spectating ? SPECTATOR_PORT : PORT)) < 0) {
         cout << "❌ Falha na conexão\n";
         return -1;
     }
-    
-    cout << "✅ Conectado ao servidor!\n";
-    cout << "⏳ Aguardando outro jogador...\n\n";
 
     pthread_t recv_thread, send_thread;
-    
-    pthread_create(&recv_thread, nullptr, receive_messages, nullptr);
-    pthread_create(&send_thread, nullptr, send_commands, nullptr);
 
-    pthread_join(recv_thread, nullptr);
-    pthread_join(send_thread, nullptr);
-    
+    if (spectating) {
+        SpectatePayload spectate = {PROTOCOL_VERSION,
+                                    {(uint8_t)watch_table, (uint8_t)(watch_table >> 8),
+                                     (uint8_t)(watch_table >> 16), (uint8_t)(watch_table >> 24)}};
+        send_frame(MSG_SPECTATE, &spectate, sizeof(spectate));
+        cout << "✅ Conectado ao servidor!\n\n";
+
+        pthread_create(&recv_thread, nullptr, receive_messages, nullptr);
+        pthread_join(recv_thread, nullptr);
+    } else {
+        // Only named players are rated.
+        HelloPayload hello = {PROTOCOL_VERSION, {}, {}};
+        strncpy(hello.name, name, PLAYER_NAME_SIZE);
+        if (name[0] != '\0') {
+            const char* home = getenv("HOME");
+            secret_path = string(home ? home : ".") + "/.truco-" + string(hello.name, strnlen(hello.name, PLAYER_NAME_SIZE));
+            load_secret(hello.secret);
+        }
+        send_frame(MSG_HELLO, &hello, sizeof(hello));
+
+        cout << "✅ Conectado ao servidor!\n";
+        cout << "⏳ Aguardando outro jogador...\n\n";
+
+        pthread_create(&recv_thread, nullptr, receive_messages, nullptr);
+        pthread_create(&send_thread, nullptr, send_commands, nullptr);
+
+        pthread_join(recv_thread, nullptr);
+        pthread_join(send_thread, nullptr);
+    }
+
     close(sock);
     cout << "\n👋 Desconectado do servidor.\n";
-    
+
     return 0;
 }
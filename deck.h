@@ -0,0 +1,34 @@
+#ifndef DECK_H
+#define DECK_H
+
+#include "cards.h"
+#include "rng.h"
+
+typedef struct {
+  Card cards[CARDS_IN_DECK];
+  int dealt;
+} Deck;
+
+inline void init_deck(Deck* deck) {
+  for (int i = 0; i < CARDS_IN_DECK; i++) {
+    deck->cards[i] = (Card)i;
+  }
+  deck->dealt = 0;
+}
+
+inline void start_deal(Deck* deck) {
+  deck->dealt = 0;
+}
+
+// One step of a partial Fisher-Yates shuffle: only the cards actually dealt
+// are drawn, and the permutation left behind stays a valid deck.
+inline Card draw_card(Deck* deck, Rng* rng) {
+  int pick = deck->dealt + random_below(rng, CARDS_IN_DECK - deck->dealt);
+  Card card = deck->cards[pick];
+  deck->cards[pick] = deck->cards[deck->dealt];
+  deck->cards[deck->dealt] = card;
+  deck->dealt++;
+  return card;
+}
+
+#endif
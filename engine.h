@@ -0,0 +1,585 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <string.h>
+#include "types.h"
+#include "cards.h"
+#include "deck.h"
+#include "rng.h"
+#include "rules.h"
+
+#define WIN_SCORE 12
+#define ALL_SEATS 0xFE
+#define MAX_EVENT_PAYLOAD 16
+#define GAME_MAX_EVENTS 32
+
+// The rules of one game, with no sockets attached. Actions go in through
+// game_act() and everything the players should be told comes out as events
+// in game->events, addressed to one seat or to ALL_SEATS. Events are the
+// protocol frames themselves, so a server only has to frame and queue them.
+
+typedef enum {
+  GAME_AWAIT_PLAY,
+  GAME_AWAIT_TRUCO_ANSWER,
+  GAME_AWAIT_ENVIDO_ANSWER,
+  GAME_OVER
+} GamePhase;
+
+typedef struct {
+  Card cards[HAND_SIZE];
+  bool played[HAND_SIZE];
+} Hand;
+
+typedef struct {
+  Hand hand;
+  int points;
+  int envido_points;
+  int flor_points;
+  int seen_points[TOTAL_PER_ROOM];
+} GamePlayer;
+
+typedef struct {
+  int hand_value;
+  bool truco_called;
+  bool retruco_called;
+  bool vale4_called;
+  int last_raiser;
+} TrucoState;
+
+typedef struct {
+  bool envido_called;
+  bool real_envido_called;
+  bool falta_envido_called;
+  int envido_value;
+  int last_caller;
+  bool finished;
+} EnvidoState;
+
+typedef struct {
+  uint8_t seat;
+  uint8_t opcode;
+  uint8_t length;
+  uint8_t payload[MAX_EVENT_PAYLOAD];
+} GameEvent;
+
+// type is one of the client opcodes (MSG_PLAY_CARD, MSG_CALL_TRUCO, ...).
+// slot is only read for MSG_PLAY_CARD; NO_CARD there means it was missing.
+typedef struct {
+  uint8_t type;
+  uint8_t slot;
+} GameAction;
+
+typedef struct {
+  GamePlayer players[TOTAL_PER_ROOM];
+  GamePhase phase;
+  Rng rng;
+  Deck deck;
+  int hands;
+  int winner;
+  int first_player;
+  int current_player;
+  int round;
+  int cards_played;
+  Card played_cards[TOTAL_PER_ROOM];
+  int rounds_won[TOTAL_PER_ROOM];
+  int pending_caller;
+  int pending_value;
+  TrucoState truco_state;
+  EnvidoState envido_state;
+  GameEvent events[GAME_MAX_EVENTS];
+  int event_count;
+} Game;
+
+inline void emit_event(Game* game, int seat, MessageType type, const void* payload, uint8_t length) {
+  GameEvent* event = &game->events[game->event_count++];
+  event->seat = seat;
+  event->opcode = type;
+  event->length = length;
+  memcpy(event->payload, payload, length);
+}
+
+template <typename T>
+inline void emit_event(Game* game, int seat, MessageType type, const T& payload) {
+  static_assert(sizeof(T) <= MAX_EVENT_PAYLOAD, "payload does not fit in an event");
+  emit_event(game, seat, type, &payload, sizeof(T));
+}
+
+inline void emit_notice(Game* game, int seat, NoticeCode code) {
+  NoticePayload notice = {(uint8_t)code};
+  emit_event(game, seat, MSG_NOTICE, notice);
+}
+
+inline void emit_prompt(Game* game, int seat, PromptKind prompt, bool can_raise) {
+  YourTurnPayload turn = {(uint8_t)prompt, (uint8_t)can_raise};
+  emit_event(game, seat, MSG_YOUR_TURN, turn);
+}
+
+inline int opponent_of(int player) {
+  return (player == 0) ? 1 : 0;
+}
+
+// The seat whose action the game is waiting for, or -1 once it is over.
+inline int game_expected_seat(const Game* game) {
+  switch (game->phase) {
+    case GAME_AWAIT_PLAY:
+      return game->current_player;
+    case GAME_AWAIT_TRUCO_ANSWER:
+      return opponent_of(game->pending_caller);
+    case GAME_AWAIT_ENVIDO_ANSWER:
+      return opponent_of(game->envido_state.last_caller);
+    default:
+      return -1;
+  }
+}
+
+inline void deal_cards(Game* game) {
+  start_deal(&game->deck);
+
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    for (int j = 0; j < HAND_SIZE; j++) {
+      game->players[i].hand.cards[j] = draw_card(&game->deck, &game->rng);
+      game->players[i].hand.played[j] = false;
+    }
+  }
+}
+
+inline void game_snapshot(Game* game, int seat, SnapshotPayload* snapshot) {
+  GamePlayer* player = &game->players[seat];
+  snapshot->seat = seat;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    snapshot->points[i] = game->players[i].points;
+    snapshot->table[i] = game->played_cards[i];
+    player->seen_points[i] = game->players[i].points;
+  }
+  for (int i = 0; i < HAND_SIZE; i++) {
+    snapshot->hand[i] = player->hand.played[i] ? NO_CARD : player->hand.cards[i];
+  }
+  snapshot->hand_value = game->truco_state.hand_value;
+}
+
+// What anyone watching the table may see: the score and the cards on the
+// table, no hand.
+inline void game_public_snapshot(const Game* game, SnapshotPayload* snapshot) {
+  snapshot->seat = NO_SEAT;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    snapshot->points[i] = game->players[i].points;
+    snapshot->table[i] = game->played_cards[i];
+  }
+  for (int i = 0; i < HAND_SIZE; i++) {
+    snapshot->hand[i] = NO_CARD;
+  }
+  snapshot->hand_value = game->truco_state.hand_value;
+}
+
+inline void emit_snapshot(Game* game, int seat) {
+  SnapshotPayload snapshot;
+  game_snapshot(game, seat, &snapshot);
+  emit_event(game, seat, MSG_SNAPSHOT, snapshot);
+}
+
+// Tells each player the points scored since the last score it has seen.
+inline void sync_scores(Game* game) {
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    GamePlayer* player = &game->players[i];
+    ScorePayload score;
+    bool changed = false;
+
+    for (int j = 0; j < TOTAL_PER_ROOM; j++) {
+      score.delta[j] = game->players[j].points - player->seen_points[j];
+      player->seen_points[j] = game->players[j].points;
+      changed |= score.delta[j] != 0;
+    }
+
+    if (changed) {
+      emit_event(game, i, MSG_SCORE, score);
+    }
+  }
+}
+
+inline void finish_game(Game* game, int winner, WinReason reason) {
+  WinnerPayload result = {(uint8_t)winner, (uint8_t)reason};
+  emit_event(game, ALL_SEATS, MSG_WINNER, result);
+  game->winner = winner;
+  game->phase = GAME_OVER;
+}
+
+inline void prompt_turn(Game* game) {
+  game->phase = GAME_AWAIT_PLAY;
+  emit_prompt(game, game->current_player, PROMPT_PLAY, !game->truco_state.vale4_called);
+}
+
+inline void prompt_answer(Game* game) {
+  if (game->phase == GAME_AWAIT_TRUCO_ANSWER) {
+    emit_prompt(game, opponent_of(game->pending_caller), PROMPT_TRUCO_ANSWER, !game->truco_state.vale4_called);
+  } else {
+    emit_prompt(game, opponent_of(game->envido_state.last_caller), PROMPT_ENVIDO_ANSWER,
+                !game->envido_state.falta_envido_called);
+  }
+}
+
+inline void start_round(Game* game) {
+  game->cards_played = 0;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    game->played_cards[i] = NO_CARD;
+  }
+  prompt_turn(game);
+}
+
+inline void start_hand(Game* game, bool first_hand) {
+  deal_cards(game);
+  game->hands++;
+
+  game->truco_state = {1, false, false, false, -1};
+  game->envido_state = {false, false, false, 0, -1, false};
+
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    HandScore score = get_hand_score(game->players[i].hand.cards);
+    game->players[i].envido_points = score.envido;
+    game->players[i].flor_points = score.flor;
+    game->played_cards[i] = NO_CARD;
+    game->rounds_won[i] = 0;
+  }
+
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    GamePlayer* player = &game->players[i];
+    if (first_hand) {
+      emit_snapshot(game, i);
+    } else {
+      DealPayload deal;
+      for (int j = 0; j < HAND_SIZE; j++) {
+        deal.cards[j] = player->hand.cards[j];
+      }
+      emit_event(game, i, MSG_DEAL, deal);
+    }
+
+    if (player->flor_points) {
+      FlorPayload flor = {(uint8_t)player->flor_points};
+      emit_event(game, i, MSG_FLOR, flor);
+    }
+  }
+
+  game->current_player = game->first_player;
+  game->round = 0;
+  start_round(game);
+}
+
+inline void finish_hand(Game* game) {
+  sync_scores(game);
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    if (game->players[i].points >= WIN_SCORE) {
+      finish_game(game, i, WIN_BY_SCORE);
+      return;
+    }
+  }
+
+  game->first_player = opponent_of(game->first_player);
+  start_hand(game, false);
+}
+
+inline void award_hand(Game* game, int winner, HandResultReason reason) {
+  game->players[winner].points += game->truco_state.hand_value;
+
+  HandResultPayload result = {(uint8_t)winner, (uint8_t)game->truco_state.hand_value, (uint8_t)reason};
+  emit_event(game, ALL_SEATS, MSG_HAND_RESULT, result);
+  finish_hand(game);
+}
+
+inline void finish_round(Game* game) {
+  int round_winner = compare_cards(game->played_cards[0], game->played_cards[1]);
+
+  RoundResultPayload result = {(uint8_t)(round_winner == -1 ? NO_SEAT : round_winner)};
+  emit_event(game, ALL_SEATS, MSG_ROUND_RESULT, result);
+
+  if (round_winner != -1) {
+    game->rounds_won[round_winner]++;
+    game->current_player = round_winner;
+
+    if (game->rounds_won[round_winner] == 2) {
+      award_hand(game, round_winner, HAND_WON_ROUNDS);
+      return;
+    }
+  } else {
+    // After a tie whoever led the round leads again.
+    game->current_player = opponent_of(game->current_player);
+  }
+
+  game->round++;
+  if (game->round < 3) {
+    start_round(game);
+  } else if (game->rounds_won[0] == game->rounds_won[1]) {
+    award_hand(game, game->first_player, HAND_WON_TIE);
+  } else {
+    award_hand(game, game->rounds_won[0] > game->rounds_won[1] ? 0 : 1, HAND_WON_ROUNDS);
+  }
+}
+
+inline bool call_envido(Game* game, int caller) {
+  EnvidoState* envido_state = &game->envido_state;
+  int opponent = opponent_of(caller);
+  int new_envido_value = 2;
+  int level = 1;
+
+  if (!envido_state->envido_called) {
+    envido_state->envido_called = true;
+    new_envido_value = 2;
+  } else if (!envido_state->real_envido_called) {
+    envido_state->real_envido_called = true;
+    new_envido_value = envido_state->envido_value + 3;
+    level = 2;
+  } else if (!envido_state->falta_envido_called) {
+    envido_state->falta_envido_called = true;
+    new_envido_value = WIN_SCORE - game->players[opponent].points;
+    level = 3;
+  } else {
+    emit_notice(game, caller, NOTICE_ENVIDO_MAX);
+    return false;
+  }
+
+  envido_state->envido_value = new_envido_value;
+  envido_state->last_caller = caller;
+  game->phase = GAME_AWAIT_ENVIDO_ANSWER;
+
+  EnvidoCallPayload call = {(uint8_t)caller, (uint8_t)level, (uint8_t)new_envido_value};
+  emit_event(game, ALL_SEATS, MSG_ENVIDO_CALL, call);
+  prompt_answer(game);
+  return true;
+}
+
+inline void handle_envido_answer(Game* game, const GameAction& action) {
+  EnvidoState* envido_state = &game->envido_state;
+  int caller = envido_state->last_caller;
+  int opponent = opponent_of(caller);
+
+  if (action.type == MSG_CALL_ENVIDO) {
+    if (envido_state->falta_envido_called) {
+      emit_notice(game, opponent, NOTICE_ENVIDO_MAX);
+      prompt_answer(game);
+      return;
+    }
+    emit_notice(game, opponent, NOTICE_ENVIDO_RAISED);
+    call_envido(game, opponent);
+    return;
+  }
+
+  if (action.type != MSG_ACCEPT && action.type != MSG_REJECT) {
+    emit_notice(game, opponent, NOTICE_ANSWER_FIRST);
+    prompt_answer(game);
+    return;
+  }
+
+  envido_state->finished = true;
+
+  if (action.type == MSG_REJECT) {
+    game->players[caller].points += 1;
+
+    EnvidoResultPayload result = {(uint8_t)caller, 1, 0, 0, {0, 0}};
+    emit_event(game, ALL_SEATS, MSG_ENVIDO_RESULT, result);
+    sync_scores(game);
+    prompt_turn(game);
+    return;
+  }
+
+  int envido_p0 = game->players[0].envido_points;
+  int envido_p1 = game->players[1].envido_points;
+
+  int envido_winner;
+  if (envido_p0 > envido_p1) {
+    envido_winner = 0;
+  } else if (envido_p1 > envido_p0) {
+    envido_winner = 1;
+  } else {
+    envido_winner = game->first_player;
+  }
+
+  game->players[envido_winner].points += envido_state->envido_value;
+
+  EnvidoResultPayload result = {(uint8_t)envido_winner, (uint8_t)envido_state->envido_value, 1,
+                                (uint8_t)(envido_p0 == envido_p1), {(uint8_t)envido_p0, (uint8_t)envido_p1}};
+  emit_event(game, ALL_SEATS, MSG_ENVIDO_RESULT, result);
+  sync_scores(game);
+
+  if (game->players[envido_winner].points >= WIN_SCORE) {
+    finish_game(game, envido_winner, WIN_BY_ENVIDO);
+    return;
+  }
+
+  prompt_turn(game);
+}
+
+inline bool call_truco(Game* game, int caller) {
+  TrucoState* truco_state = &game->truco_state;
+  int new_value = truco_state->hand_value;
+  int level;
+
+  if (!truco_state->truco_called) {
+    new_value = 2;
+    level = 1;
+    truco_state->truco_called = true;
+  } else if (!truco_state->retruco_called) {
+    new_value = 3;
+    level = 2;
+    truco_state->retruco_called = true;
+  } else if (!truco_state->vale4_called) {
+    new_value = 4;
+    level = 3;
+    truco_state->vale4_called = true;
+  } else {
+    emit_notice(game, caller, NOTICE_TRUCO_MAX);
+    return false;
+  }
+
+  game->pending_caller = caller;
+  game->pending_value = new_value;
+  game->phase = GAME_AWAIT_TRUCO_ANSWER;
+
+  TrucoCallPayload call = {(uint8_t)caller, (uint8_t)level, (uint8_t)new_value};
+  emit_event(game, ALL_SEATS, MSG_TRUCO_CALL, call);
+  prompt_answer(game);
+  return true;
+}
+
+inline void handle_truco_answer(Game* game, const GameAction& action) {
+  TrucoState* truco_state = &game->truco_state;
+  int caller = game->pending_caller;
+  int opponent = opponent_of(caller);
+
+  if (action.type == MSG_REJECT) {
+    game->players[caller].points += truco_state->hand_value;
+
+    TrucoResultPayload result = {(uint8_t)opponent, 0, (uint8_t)truco_state->hand_value};
+    emit_event(game, ALL_SEATS, MSG_TRUCO_RESULT, result);
+    finish_hand(game);
+  } else if (action.type == MSG_CALL_TRUCO) {
+    if (truco_state->vale4_called) {
+      emit_notice(game, opponent, NOTICE_TRUCO_MAX);
+      prompt_answer(game);
+      return;
+    }
+    emit_notice(game, opponent, NOTICE_TRUCO_RAISED);
+    truco_state->hand_value = game->pending_value;
+    call_truco(game, opponent);
+  } else if (action.type == MSG_ACCEPT) {
+    truco_state->hand_value = game->pending_value;
+    truco_state->last_raiser = caller;
+
+    TrucoResultPayload result = {(uint8_t)opponent, 1, (uint8_t)truco_state->hand_value};
+    emit_event(game, ALL_SEATS, MSG_TRUCO_RESULT, result);
+    prompt_turn(game);
+  } else {
+    emit_notice(game, opponent, NOTICE_ANSWER_FIRST);
+    prompt_answer(game);
+  }
+}
+
+inline void handle_play(Game* game, const GameAction& action) {
+  int current_player = game->current_player;
+  GamePlayer* player = &game->players[current_player];
+
+  if (action.type == MSG_CALL_ENVIDO) {
+    if (game->round != 0) {
+      emit_notice(game, current_player, NOTICE_ENVIDO_FIRST_ROUND);
+      prompt_turn(game);
+    } else if (game->envido_state.finished) {
+      emit_notice(game, current_player, NOTICE_ENVIDO_DONE);
+      prompt_turn(game);
+    } else if (!call_envido(game, current_player)) {
+      prompt_turn(game);
+    }
+    return;
+  }
+
+  if (action.type == MSG_CALL_TRUCO) {
+    if (!call_truco(game, current_player)) {
+      prompt_turn(game);
+    }
+    return;
+  }
+
+  if (action.type != MSG_PLAY_CARD || action.slot >= HAND_SIZE) {
+    emit_notice(game, current_player, NOTICE_INVALID_CARD);
+    prompt_turn(game);
+    return;
+  }
+
+  int card_choice = action.slot;
+  if (player->hand.played[card_choice]) {
+    emit_notice(game, current_player, NOTICE_CARD_ALREADY_PLAYED);
+    prompt_turn(game);
+    return;
+  }
+
+  player->hand.played[card_choice] = true;
+  game->played_cards[current_player] = player->hand.cards[card_choice];
+  game->cards_played++;
+
+  CardPlayedPayload played = {(uint8_t)current_player, (uint8_t)card_choice, player->hand.cards[card_choice]};
+  emit_event(game, ALL_SEATS, MSG_CARD_PLAYED, played);
+
+  if (game->cards_played < TOTAL_PER_ROOM) {
+    game->current_player = opponent_of(current_player);
+    prompt_turn(game);
+  } else {
+    finish_round(game);
+  }
+}
+
+// Deals the first hand of a new game. The whole game follows from seed.
+inline void game_start(Game* game, uint64_t seed) {
+  game->event_count = 0;
+  seed_rng(&game->rng, seed);
+  init_deck(&game->deck);
+
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    game->players[i].points = 0;
+  }
+
+  game->hands = 0;
+  game->winner = -1;
+  game->first_player = 0;
+  start_hand(game, true);
+}
+
+inline void game_act(Game* game, int seat, const GameAction& action) {
+  game->event_count = 0;
+
+  int expected = game_expected_seat(game);
+  if (expected < 0) return;
+
+  if (action.type == MSG_RESYNC) {
+    emit_snapshot(game, seat);
+    if (seat == expected) {
+      if (game->phase == GAME_AWAIT_PLAY) prompt_turn(game);
+      else prompt_answer(game);
+    }
+    return;
+  }
+
+  if (seat != expected) {
+    emit_notice(game, seat, NOTICE_NOT_YOUR_TURN);
+    return;
+  }
+
+  switch (game->phase) {
+    case GAME_AWAIT_PLAY:
+      handle_play(game, action);
+      break;
+    case GAME_AWAIT_TRUCO_ANSWER:
+      handle_truco_answer(game, action);
+      break;
+    case GAME_AWAIT_ENVIDO_ANSWER:
+      handle_envido_answer(game, action);
+      break;
+    default:
+      break;
+  }
+}
+
+// The player in seat left or stopped playing; the other one wins.
+inline void game_forfeit(Game* game, int seat, WinReason reason = WIN_BY_DISCONNECT) {
+  game->event_count = 0;
+  if (game->phase == GAME_OVER) return;
+
+  finish_game(game, opponent_of(seat), reason);
+}
+
+#endif
@@ -0,0 +1,211 @@
+#include <chrono>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <vector>
+#include "engine.h"
+#include "equity.h"
+
+using namespace std;
+
+static const char* PATH_NAMES[] = {"scalar", "sse2", "avx2"};
+
+void usage(const char* name) {
+  cerr << "Usage: " << name << " [-m] [-o our_card]... [-t their_card]... card card card" << endl;
+  cerr << "       " << name << " -v" << endl;
+  cerr << "Cards are written like AE or 7O; -m plays as mano. -o and -t give the cards each side" << endl;
+  cerr << "has played, one per round in order. Truco odds assume both sides play the rest of the" << endl;
+  cerr << "hand perfectly with both hands in the open. -v checks random hands at every stage" << endl;
+  cerr << "against the game engine playing each holding out and times each path." << endl;
+  exit(EXIT_FAILURE);
+}
+
+bool read_card(const char* text, Card* card) {
+  *card = parse_card(text);
+  return *card != NO_CARD;
+}
+
+int hand_winner(const Game* game) {
+  for (int i = 0; i < game->event_count; i++) {
+    const GameEvent* event = &game->events[i];
+    if (event->opcode == MSG_HAND_RESULT) return ((const HandResultPayload*)event->payload)->winner;
+  }
+  return -1;
+}
+
+int play_card(Game* game, Card card) {
+  int seat = game_expected_seat(game);
+  const Hand* hand = &game->players[seat].hand;
+  int slot = find(hand->cards, hand->cards + HAND_SIZE, card) - hand->cards;
+  game_act(game, seat, {MSG_PLAY_CARD, (uint8_t)slot});
+  return hand_winner(game);
+}
+
+// Whether seat 0 takes the hand when both seats play their best, tried by
+// playing every card left through game_act().
+bool engine_best(const Game* game) {
+  int seat = game_expected_seat(game);
+  for (int slot = 0; slot < HAND_SIZE; slot++) {
+    if (game->players[seat].hand.played[slot]) continue;
+    Game next = *game;
+    int winner = play_card(&next, next.players[seat].hand.cards[slot]);
+    bool win = winner < 0 ? engine_best(&next) : winner == 0;
+    if (win == (seat == 0)) return win;
+  }
+  return seat != 0;
+}
+
+// Deals the query's hand to seat 0 and holding to seat 1, with the mano
+// leading, and plays the cards on the table in the order they came out.
+// Returns the winner if that already settled the hand, or -1.
+int engine_table(Game* game, const EquityQuery* query, const Card holding[HAND_SIZE]) {
+  game_start(game, 0);
+  for (int i = 0; i < HAND_SIZE; i++) {
+    game->players[0].hand.cards[i] = query->hand[i];
+    game->players[1].hand.cards[i] = holding[i];
+  }
+  game->first_player = game->current_player = query->mano ? 0 : 1;
+
+  int taken[TOTAL_PER_ROOM] = {0, 0};
+  while (game->round < HAND_SIZE) {
+    int seat = game_expected_seat(game);
+    Card card = (seat == 0 ? query->ours : query->theirs)[game->round];
+    if (taken[seat] > game->round || card == NO_CARD) return -1;
+    taken[seat]++;
+    int winner = play_card(game, card);
+    if (winner >= 0) return winner;
+  }
+  return -1;
+}
+
+// Walks the rest of the deck card by card and plays every consistent
+// holding out in the engine.
+EquityCounts engine_equity(const EquityQuery* query) {
+  bool used[CARDS_IN_DECK] = {};
+  for (int i = 0; i < HAND_SIZE; i++) {
+    used[query->hand[i]] = true;
+  }
+  int our_envido = calculate_envido(query->hand);
+
+  EquityCounts counts = {0, 0, 0};
+  Game game;
+  for (int c = 2; c < CARDS_IN_DECK; c++) {
+    for (int b = 1; b < c; b++) {
+      for (int a = 0; a < b; a++) {
+        if (used[a] || used[b] || used[c]) continue;
+        Card theirs[HAND_SIZE] = {(Card)a, (Card)b, (Card)c};
+        bool holds_played = true;
+        for (int i = 0; i < HAND_SIZE; i++) {
+          holds_played &= query->theirs[i] == NO_CARD ||
+                          find(theirs, theirs + HAND_SIZE, query->theirs[i]) != theirs + HAND_SIZE;
+        }
+        if (!holds_played) continue;
+
+        int winner = engine_table(&game, query, theirs);
+        bool truco = winner < 0 ? engine_best(&game) : winner == 0;
+        int their_envido = calculate_envido(theirs);
+        counts.holdings++;
+        counts.truco_wins += truco;
+        counts.envido_wins += our_envido > their_envido || (our_envido == their_envido && query->mano);
+      }
+    }
+  }
+  return counts;
+}
+
+bool same_counts(const EquityCounts& a, const EquityCounts& b) {
+  return a.holdings == b.holdings && a.truco_wins == b.truco_wins && a.envido_wins == b.envido_wins;
+}
+
+// Random deals stopped after every number of cards played, from none to a
+// settled hand, each dealt once with us as mano and once without.
+int verify() {
+  vector<EquityQuery> queries;
+  Rng rng;
+  seed_rng(&rng, 1);
+  for (int deal = 0; queries.size() < 240; deal++) {
+    Game game;
+    game_start(&game, deal);
+    bool mano = deal % 2 == 0;
+    game.first_player = game.current_player = mano ? 0 : 1;
+    int stop = deal / 2 % (2 * HAND_SIZE + 1);
+
+    EquityQuery query = {{NO_CARD, NO_CARD, NO_CARD}, {NO_CARD, NO_CARD, NO_CARD}, {NO_CARD, NO_CARD, NO_CARD}, mano};
+    memcpy(query.hand, game.players[0].hand.cards, sizeof(query.hand));
+    for (int played = 0; played < stop; played++) {
+      int seat = game_expected_seat(&game);
+      const Hand* hand = &game.players[seat].hand;
+      int slot;
+      do {
+        slot = random_below(&rng, HAND_SIZE);
+      } while (hand->played[slot]);
+      (seat == 0 ? query.ours : query.theirs)[game.round] = hand->cards[slot];
+      if (play_card(&game, hand->cards[slot]) >= 0) break;
+    }
+    queries.push_back(query);
+  }
+
+  vector<EquityCounts> expected;
+  for (const EquityQuery& query : queries) {
+    expected.push_back(engine_equity(&query));
+  }
+  holding_table();
+
+  int mismatches = 0;
+  for (int path = EQUITY_SCALAR; path <= equity_path(); path++) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int wrong = 0;
+    for (size_t i = 0; i < queries.size(); i++) {
+      wrong += !same_counts(hand_equity(&queries[i], (EquityPath)path), expected[i]);
+    }
+    double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / queries.size();
+    printf("%-6s %zu queries, %d mismatches, %.2f us per query\n", PATH_NAMES[path], queries.size(), wrong, us);
+    mismatches += wrong;
+  }
+  return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+  EquityQuery query = {{NO_CARD, NO_CARD, NO_CARD}, {NO_CARD, NO_CARD, NO_CARD}, {NO_CARD, NO_CARD, NO_CARD}, false};
+  int ours = 0, theirs = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "mo:t:v")) != -1) {
+    switch (opt) {
+      case 'm': query.mano = true; break;
+      case 'o':
+        if (ours == HAND_SIZE || !read_card(optarg, &query.ours[ours++])) usage(argv[0]);
+        break;
+      case 't':
+        if (theirs == HAND_SIZE || !read_card(optarg, &query.theirs[theirs++])) usage(argv[0]);
+        break;
+      case 'v': return verify();
+      default: usage(argv[0]);
+    }
+  }
+  if (argc - optind != HAND_SIZE) usage(argv[0]);
+  for (int i = 0; i < HAND_SIZE; i++) {
+    if (!read_card(argv[optind + i], &query.hand[i])) usage(argv[0]);
+  }
+  EquityTable table;
+  if (!resolve_rounds(&query, &table)) {
+    cerr << "Those cards could not have been played in that order." << endl;
+    usage(argv[0]);
+  }
+
+  holding_table();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  EquityCounts counts = hand_equity(&query);
+  double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+
+  if (counts.holdings == 0) {
+    cout << "No opponent hand fits what was played." << endl;
+    return EXIT_FAILURE;
+  }
+  printf("Against %u opponent hands: truco %.2f%%, envido %.2f%% (%s, %.1f us)\n",
+         counts.holdings,
+         100.0 * counts.truco_wins / counts.holdings, 100.0 * counts.envido_wins / counts.holdings,
+         PATH_NAMES[equity_path()], us);
+  return EXIT_SUCCESS;
+}
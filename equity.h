@@ -0,0 +1,479 @@
+#ifndef EQUITY_H
+#define EQUITY_H
+
+#include <stdint.h>
+#include <string.h>
+#include "rules.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EQUITY_X86 1
+#endif
+
+// The exact odds of a dealt hand against every hand the opponent could
+// hold, from wherever the hand stands. Rounds already on the table are
+// played out as finish_round() scores them: the winner of a round leads
+// the next, a tie leaves the lead where it was, two rounds take the hand
+// and a level hand after three goes to the mano. What is left is played
+// double dummy, both sides playing their best with both hands in the open,
+// over every order the remaining cards can still come out in. Envido goes
+// to the higher score, or to the mano on a tie.
+//
+// Every three-card holding is kept once, in hand_key() order, as packed
+// byte arrays: its card ranks, its envido and its card ids. Whether we win
+// only depends on where each of their cards falls among the ranks we can
+// still put against it, so a query first solves every such placement into
+// a small outcome table and then sorts all holdings into it with a straight
+// pass of byte compares, 32 at a time with AVX2 or 16 with SSE2.
+
+typedef struct {
+  uint8_t ranks[HAND_SIZE][HAND_COMBINATIONS];
+  uint8_t envido[HAND_COMBINATIONS];
+  uint8_t cards[HAND_SIZE][HAND_COMBINATIONS];
+} HoldingTable;
+
+// What is known: our three dealt cards and the card each side has put on
+// the table in each round, NO_CARD where it has not played yet. Rounds are
+// filled in order and only the last may be half played, by its leader; the
+// mano leads the first. Their holding must contain every card they played.
+typedef struct {
+  Card hand[HAND_SIZE];
+  Card ours[HAND_SIZE];
+  Card theirs[HAND_SIZE];
+  bool mano;
+} EquityQuery;
+
+// holdings counts the opponent hands consistent with the query; the odds
+// are the wins over it.
+typedef struct {
+  uint32_t holdings;
+  uint32_t truco_wins;
+  uint32_t envido_wins;
+} EquityCounts;
+
+// Where the hand stands once the finished rounds are scored. winner is 0
+// or 1 once the hand is decided, -1 while it is still being played; led is
+// the card on the table in the round under way, or NO_CARD.
+typedef struct {
+  int won, lost;
+  int round;
+  bool we_lead;
+  int winner;
+  Card led;
+} EquityTable;
+
+// Mirrors finish_round() for one round, our card against theirs.
+inline void score_round(EquityTable* table, Card ours, Card theirs, bool mano) {
+  int winner = compare_cards(ours, theirs);
+  if (winner == 0) {
+    table->we_lead = true;
+    if (++table->won == 2) table->winner = 0;
+  } else if (winner == 1) {
+    table->we_lead = false;
+    if (++table->lost == 2) table->winner = 1;
+  }
+  if (table->winner < 0 && ++table->round == HAND_SIZE) {
+    table->winner = table->won == table->lost ? !mano : table->won < table->lost;
+  }
+}
+
+// Scores the rounds on the table. False when the cards could not have come
+// out that way in a real hand.
+inline bool resolve_rounds(const EquityQuery* query, EquityTable* table) {
+  *table = {0, 0, 0, query->mano, -1, NO_CARD};
+  bool seen[CARDS_IN_DECK] = {};
+  for (int i = 0; i < HAND_SIZE; i++) {
+    if (query->hand[i] >= CARDS_IN_DECK || seen[query->hand[i]]) return false;
+    seen[query->hand[i]] = true;
+  }
+  bool dealt[CARDS_IN_DECK] = {};
+  for (int i = 0; i < HAND_SIZE; i++) {
+    dealt[query->hand[i]] = true;
+  }
+
+  for (int round = 0; round < HAND_SIZE; round++) {
+    Card ours = query->ours[round], theirs = query->theirs[round];
+    if (ours == NO_CARD && theirs == NO_CARD) continue;
+    if (round != table->round || table->winner >= 0 || table->led != NO_CARD) return false;
+    if (ours != NO_CARD && (ours >= CARDS_IN_DECK || !dealt[ours])) return false;
+    if (theirs != NO_CARD && (theirs >= CARDS_IN_DECK || seen[theirs])) return false;
+    if (ours != NO_CARD) dealt[ours] = false;
+    if (theirs != NO_CARD) seen[theirs] = true;
+
+    if (ours == NO_CARD || theirs == NO_CARD) {
+      if ((ours != NO_CARD) != table->we_lead) return false;
+      table->led = ours != NO_CARD ? ours : theirs;
+    } else {
+      score_round(table, ours, theirs, query->mano);
+    }
+  }
+  return true;
+}
+
+// A hand left to play, with cards as small values that order the same way
+// their ranks do, -1 once played. table is the value led this round, or -1.
+typedef struct {
+  int8_t ours[HAND_SIZE];
+  int8_t theirs[HAND_SIZE];
+  int8_t table;
+  int8_t won, lost, round;
+  bool we_lead;
+  bool mano;
+} EquityLine;
+
+// True when we take the hand from line with both sides playing their best.
+inline bool best_line(const EquityLine* line) {
+  bool our_turn = line->table < 0 ? line->we_lead : !line->we_lead;
+  const int8_t* cards = our_turn ? line->ours : line->theirs;
+  for (int i = 0; i < HAND_SIZE; i++) {
+    if (cards[i] < 0) continue;
+    EquityLine next = *line;
+    (our_turn ? next.ours : next.theirs)[i] = -1;
+    bool win;
+    if (line->table < 0) {
+      next.table = cards[i];
+      win = best_line(&next);
+    } else {
+      int ours = our_turn ? cards[i] : line->table;
+      int theirs = our_turn ? line->table : cards[i];
+      next.table = -1;
+      int winner = -1;
+      if (ours > theirs) {
+        next.we_lead = true;
+        if (++next.won == 2) winner = 0;
+      } else if (theirs > ours) {
+        next.we_lead = false;
+        if (++next.lost == 2) winner = 1;
+      }
+      if (winner < 0 && ++next.round == HAND_SIZE) {
+        winner = next.won == next.lost ? !next.mano : next.won < next.lost;
+      }
+      win = winner < 0 ? best_line(&next) : winner == 0;
+    }
+    if (win == our_turn) return win;
+  }
+  return !our_turn;
+}
+
+// Each of their cards still in hand is placed among the distinct ranks we
+// can still put against it, ranks[0..count), as a category: twice the
+// number of those ranks it beats, plus one if it ties one. Our card of the
+// k-th rank then orders as 2k + 1 against it. Cards they already played
+// fall into EQUITY_PLAYED, and outcome maps the categories of a holding's
+// three cards, as cat0 + 8 * cat1 + 64 * cat2, to whether we take the hand.
+#define EQUITY_PLAYED 7
+#define EQUITY_OUTCOMES 512
+
+// The query reduced to what a pass compares against.
+typedef struct {
+  uint8_t ranks[HAND_SIZE];
+  uint8_t envido;
+  uint8_t mano;
+  Card hand[HAND_SIZE];
+  Card played[HAND_SIZE];
+  int played_count;
+  uint8_t outcome[EQUITY_OUTCOMES];
+} EquityKey;
+
+inline int rank_category(const EquityKey* key, int rank) {
+  int category = 0;
+  for (int k = 0; k < HAND_SIZE; k++) {
+    category += (rank > key->ranks[k]) + (rank >= key->ranks[k]);
+  }
+  return category;
+}
+
+inline int rank_value(const EquityKey* key, int rank) {
+  int k = 0;
+  while (key->ranks[k] != rank) k++;
+  return 2 * k + 1;
+}
+
+// Solves every placement of their unplayed cards once per multiset and
+// copies the answer to each order it can come in.
+inline void solve_outcomes(const EquityQuery* query, const EquityTable* table, EquityKey* key) {
+  memset(key->outcome, 0, sizeof(key->outcome));
+  if (table->winner >= 0) {
+    memset(key->outcome, table->winner == 0, sizeof(key->outcome));
+    return;
+  }
+
+  EquityLine line;
+  line.won = table->won;
+  line.lost = table->lost;
+  line.round = table->round;
+  line.we_lead = table->we_lead;
+  line.mano = query->mano;
+  line.table = -1;
+  if (table->led != NO_CARD) {
+    int rank = get_card_rank(table->led);
+    line.table = table->we_lead ? rank_value(key, rank) : rank_category(key, rank);
+  }
+  bool used[HAND_SIZE] = {};
+  for (int round = 0; round < HAND_SIZE; round++) {
+    for (int i = 0; i < HAND_SIZE; i++) {
+      used[i] |= query->ours[round] == query->hand[i];
+    }
+  }
+  for (int i = 0; i < HAND_SIZE; i++) {
+    line.ours[i] = used[i] ? -1 : rank_value(key, get_card_rank(query->hand[i]));
+  }
+
+  for (int c = 0; c <= EQUITY_PLAYED; c++) {
+    for (int b = 0; b <= c; b++) {
+      for (int a = 0; a <= b; a++) {
+        int categories[HAND_SIZE] = {a, b, c};
+        int played = (a == EQUITY_PLAYED) + (b == EQUITY_PLAYED) + (c == EQUITY_PLAYED);
+        if (played != key->played_count) continue;
+        for (int i = 0; i < HAND_SIZE; i++) {
+          line.theirs[i] = categories[i] == EQUITY_PLAYED ? -1 : categories[i];
+        }
+        uint8_t win = best_line(&line);
+        sort(categories, categories + HAND_SIZE);
+        do {
+          key->outcome[categories[0] + 8 * categories[1] + 64 * categories[2]] = win;
+        } while (next_permutation(categories, categories + HAND_SIZE));
+      }
+    }
+  }
+}
+
+inline const HoldingTable* holding_table() {
+  static HoldingTable* table = []() {
+    HoldingTable* holdings = new HoldingTable;
+    const HandScore* scores = hand_score_table();
+    for (int c = 2; c < CARDS_IN_DECK; c++) {
+      for (int b = 1; b < c; b++) {
+        for (int a = 0; a < b; a++) {
+          int key = hand_key_sorted(a, b, c);
+          Card cards[HAND_SIZE] = {(Card)a, (Card)b, (Card)c};
+          holdings->envido[key] = scores[key].envido;
+          for (int i = 0; i < HAND_SIZE; i++) {
+            holdings->ranks[i][key] = get_card_rank(cards[i]);
+            holdings->cards[i][key] = cards[i];
+          }
+        }
+      }
+    }
+    return holdings;
+  }();
+  return table;
+}
+
+// Ranks we no longer hold and did not lead this round are left out; the
+// unused slots are padded with a rank nothing reaches.
+inline EquityKey equity_key(const EquityQuery* query, const EquityTable* table) {
+  EquityKey key;
+  key.envido = get_hand_score(query->hand).envido;
+  key.mano = query->mano;
+  key.played_count = 0;
+  for (int round = 0; round < HAND_SIZE; round++) {
+    if (query->theirs[round] != NO_CARD) key.played[key.played_count++] = query->theirs[round];
+  }
+  for (int i = 0; i < HAND_SIZE; i++) {
+    key.hand[i] = query->hand[i];
+    key.ranks[i] = 127;
+    if (i >= key.played_count) key.played[i] = NO_CARD;
+  }
+
+  int count = 0;
+  for (int i = 0; i < HAND_SIZE; i++) {
+    Card card = query->hand[i];
+    bool gone = card != table->led &&
+                find(query->ours, query->ours + HAND_SIZE, card) != query->ours + HAND_SIZE;
+    int rank = get_card_rank(card);
+    if (!gone && find(key.ranks, key.ranks + count, rank) == key.ranks + count) key.ranks[count++] = rank;
+  }
+  sort(key.ranks, key.ranks + count);
+  solve_outcomes(query, table, &key);
+  return key;
+}
+
+inline void count_holdings(const HoldingTable* table, const EquityKey* key, int begin, int end, EquityCounts* counts) {
+  for (int i = begin; i < end; i++) {
+    bool valid = true;
+    for (int j = 0; j < HAND_SIZE; j++) {
+      Card card = table->cards[j][i];
+      valid &= card != key->hand[0] && card != key->hand[1] && card != key->hand[2];
+    }
+    int index = 0;
+    for (int j = 0, scale = 1; j < HAND_SIZE; j++, scale *= 8) {
+      Card card = table->cards[j][i];
+      bool played = false;
+      for (int k = 0; k < key->played_count; k++) {
+        played |= card == key->played[k];
+      }
+      index += scale * (played ? EQUITY_PLAYED : rank_category(key, table->ranks[j][i]));
+    }
+    for (int k = 0; k < key->played_count; k++) {
+      Card played = key->played[k];
+      valid &= table->cards[0][i] == played || table->cards[1][i] == played || table->cards[2][i] == played;
+    }
+    counts->holdings += valid;
+    counts->truco_wins += valid && key->outcome[index];
+    counts->envido_wins += valid && key->envido + key->mano > table->envido[i];
+  }
+}
+
+#ifdef EQUITY_X86
+// Each compare leaves -1 in a lane where it holds, so summing the masks
+// gives a card's category negated. The categories are spilled and the
+// valid lanes looked up in the outcome table one by one.
+__attribute__((target("avx2"))) inline int count_holdings_avx2(const HoldingTable* table, const EquityKey* key,
+                                                                EquityCounts* counts) {
+  const __m256i envido = _mm256_set1_epi8(key->envido + key->mano);
+  const __m256i played_category = _mm256_set1_epi8(EQUITY_PLAYED);
+  __m256i above[HAND_SIZE], reached[HAND_SIZE], hand[HAND_SIZE], played[HAND_SIZE];
+  for (int i = 0; i < HAND_SIZE; i++) {
+    above[i] = _mm256_set1_epi8(key->ranks[i]);
+    reached[i] = _mm256_set1_epi8(key->ranks[i] - 1);
+    hand[i] = _mm256_set1_epi8(key->hand[i]);
+    played[i] = _mm256_set1_epi8(key->played[i]);
+  }
+
+  alignas(32) uint8_t categories[HAND_SIZE][32];
+  int end = HAND_COMBINATIONS / 32 * 32;
+  for (int i = 0; i < end; i += 32) {
+    __m256i cards[HAND_SIZE];
+    for (int j = 0; j < HAND_SIZE; j++) {
+      cards[j] = _mm256_loadu_si256((const __m256i*)&table->cards[j][i]);
+    }
+    __m256i clash = _mm256_setzero_si256();
+    for (int j = 0; j < HAND_SIZE; j++) {
+      for (int k = 0; k < HAND_SIZE; k++) {
+        clash = _mm256_or_si256(clash, _mm256_cmpeq_epi8(cards[j], hand[k]));
+      }
+    }
+    __m256i valid = _mm256_cmpeq_epi8(clash, _mm256_setzero_si256());
+    __m256i shown[HAND_SIZE] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256()};
+    for (int k = 0; k < key->played_count; k++) {
+      __m256i held = _mm256_setzero_si256();
+      for (int j = 0; j < HAND_SIZE; j++) {
+        __m256i match = _mm256_cmpeq_epi8(cards[j], played[k]);
+        shown[j] = _mm256_or_si256(shown[j], match);
+        held = _mm256_or_si256(held, match);
+      }
+      valid = _mm256_and_si256(valid, held);
+    }
+
+    for (int j = 0; j < HAND_SIZE; j++) {
+      __m256i ranks = _mm256_loadu_si256((const __m256i*)&table->ranks[j][i]);
+      __m256i category = _mm256_setzero_si256();
+      for (int k = 0; k < HAND_SIZE; k++) {
+        category = _mm256_sub_epi8(category, _mm256_cmpgt_epi8(ranks, above[k]));
+        category = _mm256_sub_epi8(category, _mm256_cmpgt_epi8(ranks, reached[k]));
+      }
+      category = _mm256_blendv_epi8(category, played_category, shown[j]);
+      _mm256_store_si256((__m256i*)categories[j], category);
+    }
+    __m256i their_envido = _mm256_loadu_si256((const __m256i*)&table->envido[i]);
+    __m256i envido_won = _mm256_and_si256(valid, _mm256_cmpgt_epi8(envido, their_envido));
+
+    uint32_t lanes = _mm256_movemask_epi8(valid);
+    counts->holdings += __builtin_popcount(lanes);
+    counts->envido_wins += __builtin_popcount(_mm256_movemask_epi8(envido_won));
+    for (; lanes; lanes &= lanes - 1) {
+      int lane = __builtin_ctz(lanes);
+      counts->truco_wins += key->outcome[categories[0][lane] + 8 * categories[1][lane] + 64 * categories[2][lane]];
+    }
+  }
+  return end;
+}
+
+// SSE2 has no byte blend, so played cards are masked in with and/or.
+inline int count_holdings_sse2(const HoldingTable* table, const EquityKey* key, EquityCounts* counts) {
+  const __m128i envido = _mm_set1_epi8(key->envido + key->mano);
+  const __m128i played_category = _mm_set1_epi8(EQUITY_PLAYED);
+  __m128i above[HAND_SIZE], reached[HAND_SIZE], hand[HAND_SIZE], played[HAND_SIZE];
+  for (int i = 0; i < HAND_SIZE; i++) {
+    above[i] = _mm_set1_epi8(key->ranks[i]);
+    reached[i] = _mm_set1_epi8(key->ranks[i] - 1);
+    hand[i] = _mm_set1_epi8(key->hand[i]);
+    played[i] = _mm_set1_epi8(key->played[i]);
+  }
+
+  alignas(16) uint8_t categories[HAND_SIZE][16];
+  int end = HAND_COMBINATIONS / 16 * 16;
+  for (int i = 0; i < end; i += 16) {
+    __m128i cards[HAND_SIZE];
+    for (int j = 0; j < HAND_SIZE; j++) {
+      cards[j] = _mm_loadu_si128((const __m128i*)&table->cards[j][i]);
+    }
+    __m128i clash = _mm_setzero_si128();
+    for (int j = 0; j < HAND_SIZE; j++) {
+      for (int k = 0; k < HAND_SIZE; k++) {
+        clash = _mm_or_si128(clash, _mm_cmpeq_epi8(cards[j], hand[k]));
+      }
+    }
+    __m128i valid = _mm_cmpeq_epi8(clash, _mm_setzero_si128());
+    __m128i shown[HAND_SIZE] = {_mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128()};
+    for (int k = 0; k < key->played_count; k++) {
+      __m128i held = _mm_setzero_si128();
+      for (int j = 0; j < HAND_SIZE; j++) {
+        __m128i match = _mm_cmpeq_epi8(cards[j], played[k]);
+        shown[j] = _mm_or_si128(shown[j], match);
+        held = _mm_or_si128(held, match);
+      }
+      valid = _mm_and_si128(valid, held);
+    }
+
+    for (int j = 0; j < HAND_SIZE; j++) {
+      __m128i ranks = _mm_loadu_si128((const __m128i*)&table->ranks[j][i]);
+      __m128i category = _mm_setzero_si128();
+      for (int k = 0; k < HAND_SIZE; k++) {
+        category = _mm_sub_epi8(category, _mm_cmpgt_epi8(ranks, above[k]));
+        category = _mm_sub_epi8(category, _mm_cmpgt_epi8(ranks, reached[k]));
+      }
+      category = _mm_or_si128(_mm_andnot_si128(shown[j], category), _mm_and_si128(shown[j], played_category));
+      _mm_store_si128((__m128i*)categories[j], category);
+    }
+    __m128i their_envido = _mm_loadu_si128((const __m128i*)&table->envido[i]);
+    __m128i envido_won = _mm_and_si128(valid, _mm_cmpgt_epi8(envido, their_envido));
+
+    uint32_t lanes = _mm_movemask_epi8(valid);
+    counts->holdings += __builtin_popcount(lanes);
+    counts->envido_wins += __builtin_popcount(_mm_movemask_epi8(envido_won));
+    for (; lanes; lanes &= lanes - 1) {
+      int lane = __builtin_ctz(lanes);
+      counts->truco_wins += key->outcome[categories[0][lane] + 8 * categories[1][lane] + 64 * categories[2][lane]];
+    }
+  }
+  return end;
+}
+#endif
+
+typedef enum {
+  EQUITY_SCALAR,
+  EQUITY_SSE2,
+  EQUITY_AVX2
+} EquityPath;
+
+// The widest path this CPU runs, checked once; builds need no -m flags.
+inline EquityPath equity_path() {
+#ifdef EQUITY_X86
+  static EquityPath path = __builtin_cpu_supports("avx2") ? EQUITY_AVX2 : EQUITY_SSE2;
+  return path;
+#else
+  return EQUITY_SCALAR;
+#endif
+}
+
+// The holdings left over past the last full vector are counted one by one.
+// A query resolve_rounds() rejects counts no holdings.
+inline EquityCounts hand_equity(const EquityQuery* query, EquityPath path = equity_path()) {
+  EquityCounts counts = {0, 0, 0};
+  EquityTable state;
+  if (!resolve_rounds(query, &state)) return counts;
+
+  const HoldingTable* table = holding_table();
+  EquityKey key = equity_key(query, &state);
+  int done = 0;
+#ifdef EQUITY_X86
+  if (path == EQUITY_AVX2) done = count_holdings_avx2(table, &key, &counts);
+  else if (path == EQUITY_SSE2) done = count_holdings_sse2(table, &key, &counts);
+#endif
+  count_holdings(table, &key, done, HAND_COMBINATIONS, &counts);
+  return counts;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EVENT_LOG_MAGIC "TRUCOLOG"
+#define EVENT_LOG_VERSION 1
+
+// A game log is a header followed by fixed-size records from every room of
+// one shard, interleaved. The engine is deterministic, so the seed and the
+// actions in order are enough to replay a game; deals, calls, answers and
+// score changes all come back out of the replay. GAME_END carries the
+// outcome the server saw so a replay can be checked against it.
+
+typedef enum {
+  LOG_GAME_START,
+  LOG_ACTION,
+  LOG_FORFEIT,
+  LOG_GAME_END
+} LogRecordType;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+} LogHeader;
+
+// game is the index of the game's LOG_GAME_START record in its file.
+//   LOG_GAME_START  value = seed
+//   LOG_ACTION      seat, arg0 = opcode, arg1 = slot
+//   LOG_FORFEIT     seat, arg0 = WinReason
+//   LOG_GAME_END    seat = winner, arg0/arg1 = final points, value = hands
+typedef struct {
+  uint32_t game;
+  uint8_t type;
+  uint8_t seat;
+  uint8_t arg0;
+  uint8_t arg1;
+  uint64_t value;
+} LogRecord;
+
+static_assert(sizeof(LogRecord) == 16, "LogRecord must stay 16 bytes");
+
+inline LogRecord log_record(uint32_t game, LogRecordType type, int seat, int arg0, int arg1, uint64_t value) {
+  LogRecord record = {game, (uint8_t)type, (uint8_t)seat, (uint8_t)arg0, (uint8_t)arg1, value};
+  return record;
+}
+
+inline bool write_fully(int fd, const void* data, size_t size) {
+  const char* bytes = (const char*)data;
+  while (size > 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+// Opens path for appending, writing the header into a new file. A record
+// torn by a crash is cut off. Sets *records to how many the file holds.
+// Returns -1 if the file cannot be opened or is not a game log.
+inline int open_event_log(const char* path, uint64_t* records) {
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  if (st.st_size == 0) {
+    LogHeader header;
+    memcpy(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic));
+    header.version = EVENT_LOG_VERSION;
+    header.record_size = sizeof(LogRecord);
+    if (!write_fully(fd, &header, sizeof(header))) {
+      close(fd);
+      return -1;
+    }
+    *records = 0;
+    return fd;
+  }
+
+  LogHeader header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != EVENT_LOG_VERSION || header.record_size != sizeof(LogRecord)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  *records = (st.st_size - sizeof(LogHeader)) / sizeof(LogRecord);
+  off_t whole = sizeof(LogHeader) + *records * sizeof(LogRecord);
+  if (whole != st.st_size && ftruncate(fd, whole) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "types.h"
+
+#define HANDOFF_VERSION 12
+#define HANDOFF_MAX_FDS 4
+#define HANDOFF_MAX_MESSAGE (128 * 1024)
+
+// A restart hands everything over on a SOCK_SEQPACKET Unix socket: the
+// running server listens on it, and a new one started with -u connects.
+// The old server sends HANDOFF_BEGIN with the spectator listening socket,
+// if it has one, HANDOFF_TOURNAMENT with the bracket if a tournament is
+// under way, one HANDOFF_SHARD per shard with its listening socket, one
+// HANDOFF_LOBBY per waiting or still greeting connection, rostered players
+// waiting in their bracket slot included, one HANDOFF_ROOM
+// per room with its players' sockets, whether its game is under way or was
+// paired and not started yet, each preceded by one HANDOFF_WATCHER per
+// spectator watching it, one HANDOFF_REQUEST per resume or spectate request
+// a worker had not taken yet, one HANDOFF_SPECTATOR per spectator that has
+// not named its table, one HANDOFF_ARRIVAL per rostered player or finished
+// match shard 0 had not taken yet, then HANDOFF_END. The new server answers one byte
+// once it owns everything, and the old one exits.
+// Room state travels as raw structs, so both sides must be built from the
+// same layout; BEGIN carries the sizes that have to agree.
+
+typedef enum {
+  HANDOFF_BEGIN = 1,
+  HANDOFF_SHARD,
+  HANDOFF_LOBBY,
+  HANDOFF_ROOM,
+  HANDOFF_END,
+  HANDOFF_REQUEST,
+  HANDOFF_SPECTATOR,
+  HANDOFF_WATCHER,
+  HANDOFF_TOURNAMENT,
+  HANDOFF_ARRIVAL
+} HandoffType;
+
+typedef struct {
+  uint32_t type;
+  uint32_t version;
+  uint32_t room_state_size;
+  uint32_t shards;
+  uint32_t workers;
+  uint32_t rooms;
+} HandoffBegin;
+
+typedef struct {
+  uint32_t type;
+  uint32_t shard;
+} HandoffShard;
+
+// A connection that has not greeted yet is followed by the in_len bytes of
+// its first frame read so far. slot is the bracket slot a rostered player
+// waits in, or 0.
+typedef struct {
+  uint32_t type;
+  uint32_t shard;
+  uint32_t greeted;
+  uint32_t in_len;
+  uint32_t slot;
+  uint64_t joined_ns;
+  uint64_t owner;
+  int32_t rating;
+  char name[PLAYER_NAME_SIZE];
+} HandoffLobby;
+
+// A connection that was routed to a table, as its TableRequest.
+typedef struct {
+  uint32_t type;
+  uint32_t table;
+  uint32_t seat;
+  uint64_t secret;
+} HandoffRequest;
+
+// Followed by the len bytes of its first frame read so far.
+typedef struct {
+  uint32_t type;
+  uint32_t len;
+} HandoffSpectator;
+
+// Followed by the 2 * size slots of the bracket.
+typedef struct {
+  uint32_t type;
+  uint32_t size;
+  uint32_t players;
+  uint32_t playing;
+  uint64_t started_ns;
+} HandoffTournament;
+
+// A TournamentArrival, with its socket alongside if it has one.
+typedef struct {
+  uint32_t type;
+  uint32_t match;
+  int32_t rating;
+  char name[PLAYER_NAME_SIZE];
+  uint64_t owner;
+} HandoffArrival;
+
+// A spectator of the room that comes next, followed by the len bytes it
+// had queued and not been sent yet.
+typedef struct {
+  uint32_t type;
+  uint32_t len;
+} HandoffWatcher;
+
+inline bool send_handoff(int fd, const void* data, size_t size, const int* fds, int fd_count) {
+  iovec iov = {(void*)data, size};
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  if (fd_count > 0) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+  }
+
+  ssize_t sent;
+  while ((sent = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+  }
+  return sent == (ssize_t)size;
+}
+
+// Returns the message size, or -1. Received descriptors are close-on-exec.
+inline ssize_t recv_handoff(int fd, void* data, size_t size, int* fds, int* fd_count) {
+  iovec iov = {data, size};
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t received;
+  while ((received = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+  }
+  if (received <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) return -1;
+
+  *fd_count = 0;
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds + *fd_count, CMSG_DATA(cmsg), sizeof(int) * count);
+    *fd_count += count;
+  }
+  return received;
+}
+
+inline int handoff_address(const char* path, sockaddr_un* address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address->sun_path)) return -1;
+  strcpy(address->sun_path, path);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,466 @@
+#include <arpa/inet.h>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "types.h"
+#include "rng.h"
+
+#define DEFAULT_PORT 8080
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_DURATION 10
+#define RECONNECT_DELAY_MS 100
+#define LOADGEN_EVENTS 256
+#define RECV_BUFFER_SIZE 4096
+
+using namespace std;
+
+typedef enum {
+  POLICY_RANDOM,
+  POLICY_SCRIPTED
+} Policy;
+
+typedef struct {
+  const char* host;
+  int port;
+  int connections;
+  int duration;
+  int think_min;
+  int think_max;
+  Policy policy;
+  uint64_t seed;
+} Config;
+
+// One simulated player. A bot keeps just enough of the game to only send
+// actions the server will take: its hand and whether envido is still open.
+typedef struct {
+  int fd;
+  bool connected;
+  bool dealt;
+  bool finished;
+  int seat;
+  Card hand[HAND_SIZE];
+  bool envido_open;
+  uint64_t connect_start;
+  uint64_t action_sent;
+  uint32_t generation;
+  uint8_t next_opcode;
+  uint8_t next_payload;
+  uint8_t next_length;
+  uint8_t in_buf[RECV_BUFFER_SIZE];
+  size_t in_len;
+  Rng rng;
+} Bot;
+
+// Think time and reconnect delays. generation tells stale timers and epoll
+// events apart from ones that still belong to the bot's current connection.
+typedef struct {
+  uint64_t due;
+  int bot;
+  uint32_t generation;
+} Timer;
+
+struct TimerLater {
+  bool operator()(const Timer& a, const Timer& b) const {
+    return a.due > b.due;
+  }
+};
+
+typedef struct {
+  uint64_t games;
+  uint64_t dropped;
+  uint64_t connect_failures;
+  uint64_t actions;
+  vector<uint32_t> first_deal_us;
+  vector<uint32_t> action_us;
+} Stats;
+
+Config config = {"127.0.0.1", DEFAULT_PORT, DEFAULT_CONNECTIONS, DEFAULT_DURATION, 0, 0, POLICY_RANDOM, 1};
+struct sockaddr_in server_addr;
+int epoll_fd;
+bool running = true;
+vector<Bot> bots;
+priority_queue<Timer, vector<Timer>, TimerLater> timers;
+Stats stats = {0, 0, 0, 0, vector<uint32_t>(), vector<uint32_t>()};
+
+uint64_t bot_tag(Bot* bot) {
+  return (uint64_t)(bot - bots.data()) << 32 | bot->generation;
+}
+
+uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void schedule(Bot* bot, uint64_t delay_ms) {
+  Timer timer = {now_ns() + delay_ms * 1000000ULL, (int)(bot - bots.data()), bot->generation};
+  timers.push(timer);
+}
+
+void close_bot(Bot* bot) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, bot->fd, nullptr);
+  close(bot->fd);
+  bot->fd = -1;
+  bot->generation++;
+}
+
+void connect_bot(Bot* bot) {
+  bot->connected = false;
+  bot->dealt = false;
+  bot->finished = false;
+  bot->seat = 0;
+  bot->envido_open = false;
+  bot->action_sent = 0;
+  bot->next_opcode = 0;
+  bot->in_len = 0;
+  bot->connect_start = now_ns();
+
+  bot->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (bot->fd < 0) {
+    stats.connect_failures++;
+    schedule(bot, RECONNECT_DELAY_MS);
+    return;
+  }
+
+  const int opt = 1;
+  setsockopt(bot->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+  if (connect(bot->fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+    stats.connect_failures++;
+    close_bot(bot);
+    schedule(bot, RECONNECT_DELAY_MS);
+    return;
+  }
+
+  epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.u64 = bot_tag(bot);
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bot->fd, &ev);
+}
+
+bool send_frame(Bot* bot, uint8_t opcode, const void* payload, uint8_t length) {
+  uint8_t frame[MAX_FRAME_SIZE];
+  frame[0] = length;
+  frame[1] = opcode;
+  memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+
+  size_t size = FRAME_HEADER_SIZE + length;
+  return send(bot->fd, frame, size, MSG_NOSIGNAL) == (ssize_t)size;
+}
+
+// A lost connection is replaced right away so the offered load stays at N.
+void drop_bot(Bot* bot) {
+  if (!bot->finished) stats.dropped++;
+  close_bot(bot);
+  if (running) connect_bot(bot);
+}
+
+void send_action(Bot* bot) {
+  if (!send_frame(bot, bot->next_opcode, &bot->next_payload, bot->next_length)) {
+    drop_bot(bot);
+    return;
+  }
+  bot->action_sent = now_ns();
+  bot->next_opcode = 0;
+  stats.actions++;
+}
+
+int pick_slot(Bot* bot) {
+  int slots[HAND_SIZE];
+  int count = 0;
+  for (int i = 0; i < HAND_SIZE; i++) {
+    if (bot->hand[i] != NO_CARD) slots[count++] = i;
+  }
+  if (count == 0) return 0;
+  if (config.policy == POLICY_SCRIPTED) return slots[0];
+  return slots[random_below(&bot->rng, count)];
+}
+
+// Scripted bots always play their leftmost card and accept every call, which
+// makes runs comparable; random bots also sing and raise now and then.
+void choose_action(Bot* bot, const YourTurnPayload* turn) {
+  uint32_t roll = config.policy == POLICY_RANDOM ? random_below(&bot->rng, 100) : 100;
+
+  bot->next_length = 0;
+  switch (turn->prompt) {
+    case PROMPT_PLAY:
+      if (roll < 10 && turn->can_raise) {
+        bot->next_opcode = MSG_CALL_TRUCO;
+      } else if (roll < 20 && bot->envido_open) {
+        bot->next_opcode = MSG_CALL_ENVIDO;
+      } else {
+        bot->next_opcode = MSG_PLAY_CARD;
+        bot->next_payload = (uint8_t)pick_slot(bot);
+        bot->next_length = sizeof(PlayCardPayload);
+      }
+      break;
+    case PROMPT_TRUCO_ANSWER:
+      if (roll < 10 && turn->can_raise) bot->next_opcode = MSG_CALL_TRUCO;
+      else if (roll < 30) bot->next_opcode = MSG_REJECT;
+      else bot->next_opcode = MSG_ACCEPT;
+      break;
+    case PROMPT_ENVIDO_ANSWER:
+      if (roll < 10 && turn->can_raise) bot->next_opcode = MSG_CALL_ENVIDO;
+      else if (roll < 30) bot->next_opcode = MSG_REJECT;
+      else bot->next_opcode = MSG_ACCEPT;
+      break;
+    default:
+      return;
+  }
+
+  if (config.think_max == 0) {
+    send_action(bot);
+    return;
+  }
+  int think = config.think_min + random_below(&bot->rng, config.think_max - config.think_min + 1);
+  schedule(bot, think);
+}
+
+void handle_frame(Bot* bot, const Frame& frame, uint64_t now) {
+  if (bot->action_sent != 0) {
+    stats.action_us.push_back((uint32_t)((now - bot->action_sent) / 1000));
+    bot->action_sent = 0;
+  }
+
+  switch (frame.opcode) {
+    case MSG_ROOM_JOIN:
+      if (const RoomJoinPayload* join = frame_payload<RoomJoinPayload>(frame)) bot->seat = join->seat;
+      break;
+
+    case MSG_SNAPSHOT:
+      if (const SnapshotPayload* snapshot = frame_payload<SnapshotPayload>(frame)) {
+        bot->seat = snapshot->seat;
+        memcpy(bot->hand, snapshot->hand, sizeof(bot->hand));
+        bot->envido_open = snapshot->table[0] == NO_CARD && snapshot->table[1] == NO_CARD;
+        if (!bot->dealt) {
+          stats.first_deal_us.push_back((uint32_t)((now - bot->connect_start) / 1000));
+          bot->dealt = true;
+        }
+      }
+      break;
+
+    case MSG_DEAL:
+      if (const DealPayload* deal = frame_payload<DealPayload>(frame)) {
+        memcpy(bot->hand, deal->cards, sizeof(bot->hand));
+        bot->envido_open = true;
+      }
+      break;
+
+    case MSG_CARD_PLAYED:
+      if (const CardPlayedPayload* played = frame_payload<CardPlayedPayload>(frame)) {
+        if (played->seat == bot->seat && played->slot < HAND_SIZE) bot->hand[played->slot] = NO_CARD;
+      }
+      break;
+
+    case MSG_ENVIDO_RESULT:
+    case MSG_ROUND_RESULT:
+      bot->envido_open = false;
+      break;
+
+    case MSG_YOUR_TURN:
+      if (const YourTurnPayload* turn = frame_payload<YourTurnPayload>(frame)) choose_action(bot, turn);
+      break;
+
+    case MSG_WINNER:
+      // Counted once per game: seat 0 always hears the end unless it is the
+      // one that left, and rooms with a server bot only have seat 0.
+      if (const WinnerPayload* result = frame_payload<WinnerPayload>(frame)) {
+        if (bot->seat == 0 || result->reason == WIN_BY_DISCONNECT) stats.games++;
+      }
+      bot->finished = true;
+      break;
+
+    default:
+      break;
+  }
+}
+
+void read_bot(Bot* bot) {
+  while (bot->fd >= 0) {
+    ssize_t bytes = recv(bot->fd, bot->in_buf + bot->in_len, sizeof(bot->in_buf) - bot->in_len, 0);
+    if (bytes == 0) {
+      drop_bot(bot);
+      return;
+    }
+    if (bytes < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) drop_bot(bot);
+      return;
+    }
+
+    bot->in_len += bytes;
+    uint64_t now = now_ns();
+
+    Frame frame;
+    size_t offset = 0;
+    size_t frame_size;
+    while (bot->fd >= 0 && (frame_size = parse_frame(bot->in_buf + offset, bot->in_len - offset, &frame)) > 0) {
+      handle_frame(bot, frame, now);
+      offset += frame_size;
+    }
+    if (bot->fd < 0) return;
+    memmove(bot->in_buf, bot->in_buf + offset, bot->in_len - offset);
+    bot->in_len -= offset;
+  }
+}
+
+void finish_connect(Bot* bot) {
+  int error = 0;
+  socklen_t length = sizeof(error);
+  getsockopt(bot->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+
+  HelloPayload hello = {PROTOCOL_VERSION};
+  if (error != 0 || !send_frame(bot, MSG_HELLO, &hello, sizeof(hello))) {
+    stats.connect_failures++;
+    close_bot(bot);
+    schedule(bot, RECONNECT_DELAY_MS);
+    return;
+  }
+
+  bot->connected = true;
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u64 = bot_tag(bot);
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, bot->fd, &ev);
+}
+
+void fire_timers(uint64_t now) {
+  while (!timers.empty() && timers.top().due <= now) {
+    Timer timer = timers.top();
+    timers.pop();
+
+    Bot* bot = &bots[timer.bot];
+    if (timer.generation != bot->generation) continue;
+
+    if (bot->fd < 0) connect_bot(bot);
+    else if (bot->next_opcode != 0) send_action(bot);
+  }
+}
+
+uint32_t percentile(const vector<uint32_t>& sorted, double fraction) {
+  if (sorted.empty()) return 0;
+  size_t index = min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+  return sorted[index];
+}
+
+void report_latency(const char* name, vector<uint32_t>& samples) {
+  sort(samples.begin(), samples.end());
+  cout << name << " (us): p50 " << percentile(samples, 0.50) << ", p99 " << percentile(samples, 0.99)
+       << ", p999 " << percentile(samples, 0.999) << ", max " << (samples.empty() ? 0 : samples.back())
+       << " (" << samples.size() << " samples)" << endl;
+}
+
+void report(double seconds) {
+  cout << "Connections: " << config.connections << ", duration " << seconds << " s, policy "
+       << (config.policy == POLICY_RANDOM ? "random" : "scripted") << ", think " << config.think_min << "-"
+       << config.think_max << " ms" << endl;
+  cout << "Games: " << stats.games << " (" << stats.games / seconds << " games/s), dropped " << stats.dropped
+       << ", connect failures " << stats.connect_failures << endl;
+  cout << "Actions: " << stats.actions << " (" << stats.actions / seconds << " actions/s)" << endl;
+  report_latency("Connect to first deal", stats.first_deal_us);
+  report_latency("Action response", stats.action_us);
+}
+
+void usage(const char* name) {
+  cerr << "Usage: " << name << " [-h host] [-p port] [-c connections] [-d seconds]"
+       << " [-t think_min_ms] [-T think_max_ms] [-m random|scripted] [-s seed]" << endl;
+  exit(EXIT_FAILURE);
+}
+
+void parse_args(int argc, char* argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:c:d:t:T:m:s:")) != -1) {
+    switch (opt) {
+      case 'h': config.host = optarg; break;
+      case 'p': config.port = atoi(optarg); break;
+      case 'c': config.connections = atoi(optarg); break;
+      case 'd': config.duration = atoi(optarg); break;
+      case 't': config.think_min = atoi(optarg); break;
+      case 'T': config.think_max = atoi(optarg); break;
+      case 'm':
+        if (strcmp(optarg, "random") == 0) config.policy = POLICY_RANDOM;
+        else if (strcmp(optarg, "scripted") == 0) config.policy = POLICY_SCRIPTED;
+        else usage(argv[0]);
+        break;
+      case 's': config.seed = strtoull(optarg, nullptr, 10); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (config.think_max < config.think_min) config.think_max = config.think_min;
+  if (config.connections <= 0 || config.duration <= 0 || config.think_min < 0) usage(argv[0]);
+}
+
+int main(int argc, char* argv[]) {
+  parse_args(argc, argv);
+
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(config.port);
+  if (inet_pton(AF_INET, config.host, &server_addr.sin_addr) <= 0) {
+    cerr << "Invalid address " << config.host << endl;
+    return EXIT_FAILURE;
+  }
+
+  epoll_fd = epoll_create1(0);
+  bots.resize(config.connections);
+  for (int i = 0; i < config.connections; i++) {
+    bots[i].fd = -1;
+    bots[i].generation = 0;
+    seed_rng(&bots[i].rng, config.seed + i);
+    connect_bot(&bots[i]);
+  }
+
+  uint64_t start = now_ns();
+  uint64_t end = start + (uint64_t)config.duration * 1000000000ULL;
+  epoll_event events[LOADGEN_EVENTS];
+
+  while (true) {
+    uint64_t now = now_ns();
+    if (now >= end) break;
+
+    uint64_t wake = end;
+    if (!timers.empty() && timers.top().due < wake) wake = timers.top().due;
+    int timeout = (int)((wake - now + 999999) / 1000000);
+
+    int ready = epoll_wait(epoll_fd, events, LOADGEN_EVENTS, timeout);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait failed");
+      return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < ready; i++) {
+      Bot* bot = &bots[events[i].data.u64 >> 32];
+      if (bot->fd < 0 || (uint32_t)events[i].data.u64 != bot->generation) continue;
+
+      if (!bot->connected) {
+        if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) finish_connect(bot);
+        continue;
+      }
+      read_bot(bot);
+    }
+
+    fire_timers(now_ns());
+  }
+
+  running = false;
+  report((now_ns() - start) / 1e9);
+
+  for (Bot& bot : bots) {
+    if (bot.fd >= 0) close(bot.fd);
+  }
+  close(epoll_fd);
+  return 0;
+}
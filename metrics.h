@@ -0,0 +1,190 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "types.h"
+
+#define HISTOGRAM_BUCKETS 48
+#define MAX_OPCODES 128
+#define METRICS_ALIGN 64
+
+using namespace std;
+
+// Every thread records into its own Metrics, so recording is a relaxed load
+// and store with no read-modify-write and no shared cache lines: each block
+// starts on a cache line of its own and fills whole lines. Readers sum all
+// threads' blocks and may see a value a few events stale.
+
+typedef enum {
+  COUNTER_ACCEPTS,
+  COUNTER_ACCEPT_ERRORS,
+  COUNTER_REJECTS,
+  COUNTER_DISCONNECTS,
+  COUNTER_ROOMS_STARTED,
+  COUNTER_ROOMS_CLOSED,
+  COUNTER_BOT_ROOMS,
+  COUNTER_ACTIONS,
+  COUNTER_BYTES_SENT,
+  COUNTER_BYTES_RECEIVED,
+  COUNTER_ACCEPT_CALLS,
+  COUNTER_SEND_CALLS,
+  COUNTER_RECV_CALLS,
+  COUNTER_EPOLL_WAITS,
+  COUNTER_TURN_TIMEOUTS,
+  COUNTER_TIMEOUT_FORFEITS,
+  COUNTER_ROOMS_RESUMED,
+  COUNTER_SPECTATORS,
+  COUNTER_SPECTATOR_SKIPS,
+  COUNTER_SPECTATOR_DROPS,
+  COUNTER_ALLOCATIONS,
+  COUNTER_SEATS_HELD,
+  COUNTER_SEATS_RESUMED,
+  COUNTER_PLAYER_SKIPS,
+  COUNTER_PLAYER_DROPS,
+  COUNTER_BOTS_DEFERRED,
+  COUNTER_COUNT
+} CounterId;
+
+typedef enum {
+  HISTOGRAM_TURN_NS,
+  HISTOGRAM_THINK_NS,
+  HISTOGRAM_BOT_NS,
+  HISTOGRAM_COUNT
+} HistogramId;
+
+const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+  "accepts", "accept_errors", "rejects", "disconnects", "rooms_started", "rooms_closed", "bot_rooms",
+  "actions", "bytes_sent", "bytes_received", "accept_calls", "send_calls", "recv_calls", "epoll_waits",
+  "turn_timeouts", "timeout_forfeits", "rooms_resumed", "spectators", "spectator_skips", "spectator_drops",
+  "allocations", "seats_held", "seats_resumed", "player_skips",
+  "player_drops", "bots_deferred"
+};
+
+const char* const HISTOGRAM_NAMES[HISTOGRAM_COUNT] = {"turn_ns", "think_ns", "bot_decision_ns"};
+
+// Bucket i holds values in [2^(i-1), 2^i); bucket 0 holds zero.
+typedef struct {
+  atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+  atomic<uint64_t> sum;
+} Histogram;
+
+typedef struct alignas(METRICS_ALIGN) {
+  atomic<uint64_t> counters[COUNTER_COUNT];
+  atomic<uint64_t> messages[MAX_OPCODES];
+  atomic<uint64_t> message_bytes[MAX_OPCODES];
+  Histogram histograms[HISTOGRAM_COUNT];
+} Metrics;
+
+static_assert(sizeof(Metrics) % METRICS_ALIGN == 0, "Metrics must fill whole cache lines");
+
+extern thread_local Metrics* thread_metrics;
+
+inline void bump(atomic<uint64_t>* value, uint64_t amount) {
+  value->store(value->load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+inline void count_metric(CounterId id, uint64_t amount = 1) {
+  bump(&thread_metrics->counters[id], amount);
+}
+
+inline void count_message(uint8_t opcode, size_t bytes) {
+  bump(&thread_metrics->messages[opcode % MAX_OPCODES], 1);
+  bump(&thread_metrics->message_bytes[opcode % MAX_OPCODES], bytes);
+}
+
+inline int histogram_bucket(uint64_t value) {
+  int bucket = value ? 64 - __builtin_clzll(value) : 0;
+  return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+inline void record_metric(HistogramId id, uint64_t value) {
+  Histogram* histogram = &thread_metrics->histograms[id];
+  bump(&histogram->buckets[histogram_bucket(value)], 1);
+  bump(&histogram->sum, value);
+}
+
+// C++11 new ignores the alignment, so the block is allocated aligned and
+// constructed in place. It lives as long as the process.
+inline Metrics* create_metrics() {
+  void* memory;
+  if (posix_memalign(&memory, METRICS_ALIGN, sizeof(Metrics)) != 0) throw bad_alloc();
+  Metrics* metrics = new (memory) Metrics;
+  for (atomic<uint64_t>& counter : metrics->counters) counter.store(0);
+  for (int i = 0; i < MAX_OPCODES; i++) {
+    metrics->messages[i].store(0);
+    metrics->message_bytes[i].store(0);
+  }
+  for (Histogram& histogram : metrics->histograms) {
+    for (atomic<uint64_t>& bucket : histogram.buckets) bucket.store(0);
+    histogram.sum.store(0);
+  }
+  return metrics;
+}
+
+inline uint64_t sum_counter(Metrics* const* all, int threads, CounterId id) {
+  uint64_t total = 0;
+  for (int i = 0; i < threads; i++) {
+    total += all[i]->counters[id].load(memory_order_relaxed);
+  }
+  return total;
+}
+
+// Upper bound of the bucket holding the given fraction of samples.
+inline uint64_t bucket_percentile(const uint64_t buckets[HISTOGRAM_BUCKETS], uint64_t count, double fraction) {
+  uint64_t rank = (uint64_t)(fraction * count);
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen > rank) return i ? 1ULL << i : 0;
+  }
+  return 1ULL << (HISTOGRAM_BUCKETS - 1);
+}
+
+// Writes everything in "name value" lines, histograms as count, sum,
+// estimated percentiles and the non-empty buckets by upper bound.
+inline void write_metrics(FILE* out, Metrics* const* all, int threads) {
+  for (int id = 0; id < COUNTER_COUNT; id++) {
+    fprintf(out, "%s %llu\n", COUNTER_NAMES[id], (unsigned long long)sum_counter(all, threads, (CounterId)id));
+  }
+
+  for (int opcode = 0; opcode < MAX_OPCODES; opcode++) {
+    uint64_t messages = 0, bytes = 0;
+    for (int i = 0; i < threads; i++) {
+      messages += all[i]->messages[opcode].load(memory_order_relaxed);
+      bytes += all[i]->message_bytes[opcode].load(memory_order_relaxed);
+    }
+    if (messages == 0) continue;
+    fprintf(out, "messages_sent{type=\"%s\"} %llu\n", message_name(opcode), (unsigned long long)messages);
+    fprintf(out, "message_bytes_sent{type=\"%s\"} %llu\n", message_name(opcode), (unsigned long long)bytes);
+  }
+
+  for (int id = 0; id < HISTOGRAM_COUNT; id++) {
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {0};
+    uint64_t count = 0, sum = 0;
+    for (int i = 0; i < threads; i++) {
+      const Histogram* histogram = &all[i]->histograms[id];
+      for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        buckets[b] += histogram->buckets[b].load(memory_order_relaxed);
+      }
+      sum += histogram->sum.load(memory_order_relaxed);
+    }
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) count += buckets[b];
+
+    const char* name = HISTOGRAM_NAMES[id];
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long)count);
+    fprintf(out, "%s_sum %llu\n", name, (unsigned long long)sum);
+    fprintf(out, "%s_p50 %llu\n", name, (unsigned long long)bucket_percentile(buckets, count, 0.50));
+    fprintf(out, "%s_p99 %llu\n", name, (unsigned long long)bucket_percentile(buckets, count, 0.99));
+    fprintf(out, "%s_p999 %llu\n", name, (unsigned long long)bucket_percentile(buckets, count, 0.999));
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+      if (buckets[b] == 0) continue;
+      fprintf(out, "%s_bucket{le=\"%llu\"} %llu\n", name, b ? 1ULL << b : 0ULL, (unsigned long long)buckets[b]);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <string.h>
+#include <time.h>
+#include "engine.h"
+
+#define MC_MAX_CANDIDATES 5
+#define MC_MAX_ROLLOUTS 256
+#define MC_DEFAULT_BUDGET_NS 250000
+#define MC_GAME_BONUS 24
+
+// A policy decides what the player in seat does next. It is only called
+// for the seat game_expected_seat() returns and must only look at that
+// seat's own cards, the table and the public betting state.
+typedef GameAction (*PolicyFn)(const Game* game, int seat, Rng* rng);
+
+typedef struct {
+  const char* name;
+  PolicyFn decide;
+} Policy;
+
+inline bool envido_open(const Game* game) {
+  return game->phase == GAME_AWAIT_PLAY && game->round == 0 && !game->envido_state.finished;
+}
+
+inline int unplayed_slots(const Game* game, int seat, int slots[HAND_SIZE]) {
+  const Hand* hand = &game->players[seat].hand;
+  int count = 0;
+  for (int i = 0; i < HAND_SIZE; i++) {
+    if (!hand->played[i]) slots[count++] = i;
+  }
+  return count;
+}
+
+inline GameAction play_slot(int slot) {
+  GameAction action = {MSG_PLAY_CARD, (uint8_t)slot};
+  return action;
+}
+
+inline GameAction simple_action(MessageType type) {
+  GameAction action = {(uint8_t)type, NO_CARD};
+  return action;
+}
+
+// Plays a random card, and sings or raises now and then.
+inline GameAction random_policy(const Game* game, int seat, Rng* rng) {
+  uint32_t roll = random_below(rng, 100);
+
+  switch (game->phase) {
+    case GAME_AWAIT_TRUCO_ANSWER:
+      if (roll < 10 && !game->truco_state.vale4_called) return simple_action(MSG_CALL_TRUCO);
+      return simple_action(roll < 30 ? MSG_REJECT : MSG_ACCEPT);
+    case GAME_AWAIT_ENVIDO_ANSWER:
+      if (roll < 10 && !game->envido_state.falta_envido_called) return simple_action(MSG_CALL_ENVIDO);
+      return simple_action(roll < 30 ? MSG_REJECT : MSG_ACCEPT);
+    default:
+      break;
+  }
+
+  if (roll < 10 && !game->truco_state.vale4_called) return simple_action(MSG_CALL_TRUCO);
+  if (roll < 20 && envido_open(game)) return simple_action(MSG_CALL_ENVIDO);
+
+  int slots[HAND_SIZE];
+  int count = unplayed_slots(game, seat, slots);
+  return play_slot(slots[random_below(rng, count)]);
+}
+
+// Leftmost card, accepts everything. Fully deterministic given the deal.
+inline GameAction first_policy(const Game* game, int seat, Rng* rng) {
+  if (game->phase != GAME_AWAIT_PLAY) return simple_action(MSG_ACCEPT);
+
+  int slots[HAND_SIZE];
+  unplayed_slots(game, seat, slots);
+  return play_slot(slots[0]);
+}
+
+// Plays like a careful beginner: sings envido on a good hand, bets truco
+// holding two strong cards, and answers the lowest card that still wins.
+inline GameAction greedy_policy(const Game* game, int seat, Rng* rng) {
+  const GamePlayer* player = &game->players[seat];
+  int slots[HAND_SIZE];
+  int count = unplayed_slots(game, seat, slots);
+
+  int strong = 0;
+  for (int i = 0; i < count; i++) {
+    if (get_card_rank(player->hand.cards[slots[i]]) >= 10) strong++;
+  }
+
+  switch (game->phase) {
+    case GAME_AWAIT_TRUCO_ANSWER:
+      if (strong >= 2 && !game->truco_state.vale4_called) return simple_action(MSG_CALL_TRUCO);
+      return simple_action(strong >= 1 || game->rounds_won[seat] > 0 ? MSG_ACCEPT : MSG_REJECT);
+    case GAME_AWAIT_ENVIDO_ANSWER:
+      if (player->envido_points >= 31 && !game->envido_state.falta_envido_called) {
+        return simple_action(MSG_CALL_ENVIDO);
+      }
+      return simple_action(player->envido_points >= 26 ? MSG_ACCEPT : MSG_REJECT);
+    default:
+      break;
+  }
+
+  if (envido_open(game) && player->envido_points >= 28) return simple_action(MSG_CALL_ENVIDO);
+  if (strong >= 2 && !game->truco_state.truco_called) return simple_action(MSG_CALL_TRUCO);
+
+  // Sort the remaining slots from the weakest card up.
+  for (int i = 1; i < count; i++) {
+    for (int j = i; j > 0 && get_card_rank(player->hand.cards[slots[j]]) <
+                             get_card_rank(player->hand.cards[slots[j - 1]]); j--) {
+      int slot = slots[j];
+      slots[j] = slots[j - 1];
+      slots[j - 1] = slot;
+    }
+  }
+
+  Card opponent_card = game->played_cards[opponent_of(seat)];
+  if (opponent_card == NO_CARD) return play_slot(slots[count - 1]);
+
+  for (int i = 0; i < count; i++) {
+    if (compare_cards(player->hand.cards[slots[i]], opponent_card) == 0) return play_slot(slots[i]);
+  }
+  return play_slot(slots[0]);
+}
+
+// What the server plays for someone whose turn timed out: the weakest card,
+// and a refusal of any pending call, so idling never wins anything.
+inline GameAction timeout_policy(const Game* game, int seat, Rng* rng) {
+  if (game->phase != GAME_AWAIT_PLAY) return simple_action(MSG_REJECT);
+
+  const Hand* hand = &game->players[seat].hand;
+  int slots[HAND_SIZE];
+  int count = unplayed_slots(game, seat, slots);
+  int weakest = slots[0];
+  for (int i = 1; i < count; i++) {
+    if (get_card_rank(hand->cards[slots[i]]) < get_card_rank(hand->cards[weakest])) weakest = slots[i];
+  }
+  return play_slot(weakest);
+}
+
+inline uint64_t clock_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+inline int legal_actions(const Game* game, int seat, GameAction actions[MC_MAX_CANDIDATES]) {
+  int count = 0;
+
+  switch (game->phase) {
+    case GAME_AWAIT_PLAY: {
+      int slots[HAND_SIZE];
+      int slot_count = unplayed_slots(game, seat, slots);
+      for (int i = 0; i < slot_count; i++) {
+        actions[count++] = play_slot(slots[i]);
+      }
+      if (!game->truco_state.vale4_called) actions[count++] = simple_action(MSG_CALL_TRUCO);
+      if (envido_open(game)) actions[count++] = simple_action(MSG_CALL_ENVIDO);
+      break;
+    }
+    case GAME_AWAIT_TRUCO_ANSWER:
+      actions[count++] = simple_action(MSG_ACCEPT);
+      actions[count++] = simple_action(MSG_REJECT);
+      if (!game->truco_state.vale4_called) actions[count++] = simple_action(MSG_CALL_TRUCO);
+      break;
+    case GAME_AWAIT_ENVIDO_ANSWER:
+      actions[count++] = simple_action(MSG_ACCEPT);
+      actions[count++] = simple_action(MSG_REJECT);
+      if (!game->envido_state.falta_envido_called) actions[count++] = simple_action(MSG_CALL_ENVIDO);
+      break;
+    default:
+      break;
+  }
+  return count;
+}
+
+// Replaces what seat cannot know, the opponent's unplayed cards, with a
+// random draw from the cards it has not seen.
+inline void determinize(Game* game, int seat, Rng* rng) {
+  int opponent = opponent_of(seat);
+  Hand* hidden = &game->players[opponent].hand;
+  bool seen[CARDS_IN_DECK] = {false};
+
+  for (int i = 0; i < HAND_SIZE; i++) {
+    seen[game->players[seat].hand.cards[i]] = true;
+    if (hidden->played[i]) seen[hidden->cards[i]] = true;
+  }
+
+  Card unseen[CARDS_IN_DECK];
+  int count = 0;
+  for (int card = 0; card < CARDS_IN_DECK; card++) {
+    if (!seen[card]) unseen[count++] = (Card)card;
+  }
+
+  for (int i = 0; i < HAND_SIZE; i++) {
+    if (hidden->played[i]) continue;
+    int pick = random_below(rng, count);
+    hidden->cards[i] = unseen[pick];
+    unseen[pick] = unseen[--count];
+  }
+
+  HandScore score = get_hand_score(hidden->cards);
+  game->players[opponent].envido_points = score.envido;
+  game->players[opponent].flor_points = score.flor;
+}
+
+// Plays action in a determinized copy of the game and finishes the hand
+// with greedy_policy on both sides. Returns the points seat gained over its
+// opponent, plus a bonus when the game ends in the hand.
+inline int rollout(const Game* game, int seat, const GameAction& action, Rng* rng, Game* sim) {
+  *sim = *game;
+  determinize(sim, seat, rng);
+
+  int opponent = opponent_of(seat);
+  int before = sim->players[seat].points - sim->players[opponent].points;
+  int hands = sim->hands;
+
+  game_act(sim, seat, action);
+  int next;
+  while (sim->hands == hands && (next = game_expected_seat(sim)) >= 0) {
+    game_act(sim, next, greedy_policy(sim, next, rng));
+  }
+
+  int gained = sim->players[seat].points - sim->players[opponent].points - before;
+  if (sim->phase == GAME_OVER) gained += sim->winner == seat ? MC_GAME_BONUS : -MC_GAME_BONUS;
+  return gained;
+}
+
+// Flat Monte Carlo over the legal actions. Each iteration draws one
+// determinization and plays every candidate against it, so candidates are
+// compared on the same hidden cards. Stops at MC_MAX_ROLLOUTS iterations or
+// once budget_ns has passed, whichever comes first. The deadline is checked
+// before every rollout and an iteration cut short is dropped, so the
+// budget is only ever overrun by one rollout; if not even one iteration
+// fits, the greedy move is made.
+inline GameAction monte_carlo_decide(const Game* game, int seat, Rng* rng, uint64_t budget_ns) {
+  GameAction actions[MC_MAX_CANDIDATES];
+  int count = legal_actions(game, seat, actions);
+  if (count == 1) return actions[0];
+
+  long totals[MC_MAX_CANDIDATES] = {0};
+  Game sim;
+  uint64_t deadline = clock_ns() + budget_ns;
+  int iterations = 0;
+
+  while (iterations < MC_MAX_ROLLOUTS) {
+    uint64_t sample_seed = next_random(rng);
+    long gains[MC_MAX_CANDIDATES];
+    int done = 0;
+    for (; done < count && clock_ns() < deadline; done++) {
+      Rng sample;
+      seed_rng(&sample, sample_seed);
+      gains[done] = rollout(game, seat, actions[done], &sample, &sim);
+    }
+    if (done < count) break;
+
+    for (int i = 0; i < count; i++) {
+      totals[i] += gains[i];
+    }
+    iterations++;
+  }
+  if (iterations == 0) return greedy_policy(game, seat, rng);
+
+  int best = 0;
+  for (int i = 1; i < count; i++) {
+    if (totals[i] > totals[best]) best = i;
+  }
+  return actions[best];
+}
+
+inline GameAction monte_carlo_policy(const Game* game, int seat, Rng* rng) {
+  return monte_carlo_decide(game, seat, rng, MC_DEFAULT_BUDGET_NS);
+}
+
+const Policy POLICIES[] = {
+  {"random", random_policy},
+  {"first", first_policy},
+  {"greedy", greedy_policy},
+  {"montecarlo", monte_carlo_policy},
+};
+
+inline const Policy* find_policy(const char* name) {
+  for (const Policy& policy : POLICIES) {
+    if (strcmp(policy.name, name) == 0) return &policy;
+  }
+  return nullptr;
+}
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef RATINGS_H
+#define RATINGS_H
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include "types.h"
+
+#define RATING_MAGIC "TRUCORAT"
+#define RATING_VERSION 1
+#define RATING_DEFAULT 1500
+#define RATING_K 32
+#define RATING_INITIAL_CAPACITY 4096
+#define RATING_MAX_MAPPING (1ULL << 36)
+
+// The rating store is a header followed by fixed-size records, one per
+// named player, in the order they first finished a game. The file is
+// mapped whole and grows by doubling, always at the start of an address
+// range reserved at open, so records never move. The index is only ever
+// in memory: an open addressing table of record numbers, rebuilt at open
+// from the hash each record keeps, so opening never reads a name.
+//
+// A record belongs to whoever holds the secret its owner digest came from:
+// a new name is claimed by the first game it finishes, and a result under
+// a name claimed with another secret is not counted. Records written before
+// owners existed have none, and go to the first owner to finish a game.
+//
+// Nothing here locks. Updates must come from one thread at a time, but
+// rating_lookup() may run on any thread meanwhile: a record is complete
+// before the index points at it, ratings are read and written atomically,
+// and a table that is outgrown stays allocated behind the one replacing
+// it, so a lookup that still holds it reads it safely.
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t count;
+  uint8_t reserved[40];
+} RatingHeader;
+
+typedef struct {
+  char name[PLAYER_NAME_SIZE];
+  uint64_t hash;
+  int32_t rating;
+  uint32_t games;
+  uint32_t wins;
+  uint32_t envidos_won;
+  uint32_t envidos_lost;
+  uint32_t trucos_won;
+  uint32_t trucos_lost;
+  uint32_t owner[2];
+  uint8_t reserved[4];
+} RatingRecord;
+
+static_assert(sizeof(RatingHeader) == 64, "RatingHeader must stay 64 bytes");
+static_assert(sizeof(RatingRecord) == 64, "RatingRecord must stay 64 bytes");
+
+// Per seat, counted over one game: envidos accepted and won or lost, and
+// trucos won or lost, whether by a refusal or by playing the hand out.
+typedef struct {
+  uint8_t envidos_won[TOTAL_PER_ROOM];
+  uint8_t envidos_lost[TOTAL_PER_ROOM];
+  uint8_t trucos_won[TOTAL_PER_ROOM];
+  uint8_t trucos_lost[TOTAL_PER_ROOM];
+  uint8_t truco_accepted;
+} GameTally;
+
+// A game is rated only when both seats have names; a named player still
+// gets its counts against a bot or an anonymous opponent. owners are the
+// digests of the seats' secrets.
+typedef struct {
+  char names[TOTAL_PER_ROOM][PLAYER_NAME_SIZE];
+  uint64_t owners[TOTAL_PER_ROOM];
+  uint8_t winner;
+  GameTally tally;
+} GameResult;
+
+typedef struct RatingIndex {
+  size_t mask;
+  std::vector<uint32_t> slots;
+  struct RatingIndex* replaced;
+} RatingIndex;
+
+typedef struct {
+  int fd;
+  RatingHeader* header;
+  RatingRecord* records;
+  uint64_t capacity;
+  std::atomic<RatingIndex*> index;
+} RatingStore;
+
+inline bool rating_named(const char* name) {
+  return name[0] != '\0';
+}
+
+// FNV-1a over the whole zero-padded name.
+inline uint64_t rating_hash(const char* name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < PLAYER_NAME_SIZE; i++) {
+    hash = (hash ^ (uint8_t)name[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// FNV-1a over the secret; never 0, which is a record with no owner yet.
+inline uint64_t rating_owner(const uint8_t* secret) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < PLAYER_SECRET_SIZE; i++) {
+    hash = (hash ^ secret[i]) * 1099511628211ULL;
+  }
+  return hash | 1;
+}
+
+// The two halves are stored one at a time, so a reader racing the first
+// claim of an old record may see neither or half of it; either way not the
+// owner it is checking for.
+inline uint64_t rating_owner_of(const RatingRecord* record) {
+  return (uint64_t)__atomic_load_n(&record->owner[1], __ATOMIC_RELAXED) << 32 |
+         __atomic_load_n(&record->owner[0], __ATOMIC_RELAXED);
+}
+
+inline void rating_set_owner(RatingRecord* record, uint64_t owner) {
+  __atomic_store_n(&record->owner[0], (uint32_t)owner, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->owner[1], (uint32_t)(owner >> 32), __ATOMIC_RELAXED);
+}
+
+inline void rating_index_put(RatingIndex* index, uint64_t hash, uint32_t record) {
+  size_t slot = hash & index->mask;
+  while (index->slots[slot] != 0) {
+    slot = (slot + 1) & index->mask;
+  }
+  __atomic_store_n(&index->slots[slot], record + 1, __ATOMIC_RELEASE);
+}
+
+// Keeps the table at most half full. The new table is filled before it is
+// published.
+inline void rating_reindex(RatingStore* store) {
+  size_t size = 1024;
+  while (size < store->header->count * 2) {
+    size *= 2;
+  }
+  RatingIndex* index = new RatingIndex;
+  index->mask = size - 1;
+  index->slots.assign(size, 0);
+  index->replaced = store->index.load(std::memory_order_relaxed);
+  for (uint64_t i = 0; i < store->header->count; i++) {
+    rating_index_put(index, store->records[i].hash, (uint32_t)i);
+  }
+  store->index.store(index, std::memory_order_release);
+}
+
+// The first call reserves RATING_MAX_MAPPING of address space; every call
+// maps the file over the start of it, replacing the old mapping in place.
+inline bool rating_map(RatingStore* store, size_t size) {
+  if (size > RATING_MAX_MAPPING) return false;
+  if (store->header == nullptr) {
+    void* range = mmap(nullptr, RATING_MAX_MAPPING, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (range == MAP_FAILED) return false;
+    store->header = (RatingHeader*)range;
+    store->records = (RatingRecord*)(store->header + 1);
+  }
+  void* base = mmap(store->header, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, store->fd, 0);
+  if (base == MAP_FAILED) return false;
+  store->capacity = (size - sizeof(RatingHeader)) / sizeof(RatingRecord);
+  return true;
+}
+
+// Creates the file if needed. Returns false if it cannot be opened or
+// mapped, or is not a rating store.
+inline bool open_rating_store(RatingStore* store, const char* path) {
+  store->header = nullptr;
+  store->index.store(nullptr, std::memory_order_relaxed);
+  store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (store->fd < 0) return false;
+
+  struct stat st;
+  if (fstat(store->fd, &st) < 0) return false;
+  if (st.st_size == 0) {
+    RatingHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RATING_MAGIC, sizeof(header.magic));
+    header.version = RATING_VERSION;
+    header.record_size = sizeof(RatingRecord);
+    st.st_size = sizeof(RatingHeader) + RATING_INITIAL_CAPACITY * sizeof(RatingRecord);
+    if (pwrite(store->fd, &header, sizeof(header), 0) != sizeof(header) || ftruncate(store->fd, st.st_size) < 0) {
+      return false;
+    }
+  }
+  if ((size_t)st.st_size < sizeof(RatingHeader) || !rating_map(store, st.st_size)) return false;
+
+  const RatingHeader* header = store->header;
+  if (memcmp(header->magic, RATING_MAGIC, sizeof(header->magic)) != 0 || header->version != RATING_VERSION ||
+      header->record_size != sizeof(RatingRecord) || header->count > store->capacity) {
+    return false;
+  }
+  rating_reindex(store);
+  return true;
+}
+
+inline RatingRecord* rating_find(const RatingStore* store, const char* name, uint64_t hash) {
+  const RatingIndex* index = store->index.load(std::memory_order_acquire);
+  uint32_t number;
+  for (size_t slot = hash & index->mask; (number = __atomic_load_n(&index->slots[slot], __ATOMIC_ACQUIRE)) != 0;
+       slot = (slot + 1) & index->mask) {
+    RatingRecord* record = &store->records[number - 1];
+    if (record->hash == hash && memcmp(record->name, name, PLAYER_NAME_SIZE) == 0) return record;
+  }
+  return nullptr;
+}
+
+// Safe on any thread while updates go on; a player first rated meanwhile
+// may still read as RATING_DEFAULT.
+inline int rating_lookup(const RatingStore* store, const char* name) {
+  const RatingRecord* record = rating_find(store, name, rating_hash(name));
+  return record ? __atomic_load_n(&record->rating, __ATOMIC_RELAXED) : RATING_DEFAULT;
+}
+
+// The owner of a name, or 0 if it has none yet. Safe on any thread, like
+// rating_lookup().
+inline uint64_t rating_name_owner(const RatingStore* store, const char* name) {
+  const RatingRecord* record = rating_find(store, name, rating_hash(name));
+  return record ? rating_owner_of(record) : 0;
+}
+
+inline uint64_t rating_count(const RatingStore* store) {
+  return __atomic_load_n(&store->header->count, __ATOMIC_RELAXED);
+}
+
+inline RatingRecord* rating_insert(RatingStore* store, const char* name, uint64_t hash, uint64_t owner) {
+  if (store->header->count == store->capacity) {
+    size_t new_size = sizeof(RatingHeader) + store->capacity * 2 * sizeof(RatingRecord);
+    if (new_size > RATING_MAX_MAPPING || ftruncate(store->fd, new_size) < 0 || !rating_map(store, new_size)) {
+      return nullptr;
+    }
+  }
+
+  uint32_t number = (uint32_t)store->header->count;
+  RatingRecord* record = &store->records[number];
+  memset(record, 0, sizeof(*record));
+  memcpy(record->name, name, PLAYER_NAME_SIZE);
+  record->hash = hash;
+  record->rating = RATING_DEFAULT;
+  rating_set_owner(record, owner);
+  __atomic_store_n(&store->header->count, number + 1, __ATOMIC_RELAXED);
+
+  RatingIndex* index = store->index.load(std::memory_order_relaxed);
+  if (store->header->count * 2 > index->slots.size()) rating_reindex(store);
+  else rating_index_put(index, hash, number);
+  return record;
+}
+
+// The record for name if owner may count games on it, claiming it if it
+// has no owner yet; nullptr if it belongs to someone else.
+inline RatingRecord* rating_get(RatingStore* store, const char* name, uint64_t owner) {
+  uint64_t hash = rating_hash(name);
+  RatingRecord* record = rating_find(store, name, hash);
+  if (record == nullptr) return rating_insert(store, name, hash, owner);
+
+  uint64_t current = rating_owner_of(record);
+  if (current == 0) rating_set_owner(record, owner);
+  return current == 0 || current == owner ? record : nullptr;
+}
+
+// Elo: the winner takes what its win was worth against the loser's rating.
+inline int rating_gain(int winner, int loser) {
+  double expected = 1.0 / (1.0 + pow(10.0, (loser - winner) / 400.0));
+  return (int)lround(RATING_K * (1.0 - expected));
+}
+
+inline void rating_apply(RatingStore* store, const GameResult& result) {
+  RatingRecord* records[TOTAL_PER_ROOM];
+  for (int seat = 0; seat < TOTAL_PER_ROOM; seat++) {
+    bool named = rating_named(result.names[seat]) && result.owners[seat] != 0;
+    records[seat] = named ? rating_get(store, result.names[seat], result.owners[seat]) : nullptr;
+  }
+
+  for (int seat = 0; seat < TOTAL_PER_ROOM; seat++) {
+    RatingRecord* record = records[seat];
+    if (record == nullptr) continue;
+    record->games++;
+    record->wins += seat == result.winner;
+    record->envidos_won += result.tally.envidos_won[seat];
+    record->envidos_lost += result.tally.envidos_lost[seat];
+    record->trucos_won += result.tally.trucos_won[seat];
+    record->trucos_lost += result.tally.trucos_lost[seat];
+  }
+
+  RatingRecord* winner = records[result.winner];
+  RatingRecord* loser = records[1 - result.winner];
+  if (winner && loser && winner != loser) {
+    int gain = rating_gain(winner->rating, loser->rating);
+    __atomic_store_n(&winner->rating, winner->rating + gain, __ATOMIC_RELAXED);
+    __atomic_store_n(&loser->rating, loser->rating - gain, __ATOMIC_RELAXED);
+  }
+}
+
+#endif
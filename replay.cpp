@@ -0,0 +1,202 @@
+#include <chrono>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+#include "engine.h"
+#include "eventlog.h"
+
+using namespace std;
+
+typedef struct {
+  uint64_t records;
+  uint64_t games;
+  uint64_t finished;
+  uint64_t mismatches;
+  uint64_t orphans;
+} ReplayStats;
+
+const char* const RECORD_NAMES[] = {"GAME_START", "ACTION", "FORFEIT", "GAME_END"};
+
+void print_record(const LogRecord* record) {
+  cout << RECORD_NAMES[record->type];
+  switch (record->type) {
+    case LOG_GAME_START:
+      cout << " seed " << record->value;
+      break;
+    case LOG_ACTION:
+      cout << " seat " << (int)record->seat << " " << message_name(record->arg0);
+      if (record->arg0 == MSG_PLAY_CARD) cout << " slot " << (int)record->arg1;
+      break;
+    case LOG_FORFEIT:
+      cout << " seat " << (int)record->seat << " reason " << (int)record->arg0;
+      break;
+    case LOG_GAME_END:
+      cout << " winner " << (int)record->seat << " points " << (int)record->arg0 << "-" << (int)record->arg1
+           << " hands " << record->value;
+      break;
+  }
+  cout << endl;
+}
+
+void print_events(const Game* game) {
+  for (int i = 0; i < game->event_count; i++) {
+    const GameEvent* event = &game->events[i];
+    cout << "    -> ";
+    if (event->seat == ALL_SEATS) cout << "all";
+    else cout << "seat " << (int)event->seat;
+    cout << " " << message_name(event->opcode);
+    for (int j = 0; j < event->length; j++) {
+      cout << " " << (int)event->payload[j];
+    }
+    cout << endl;
+  }
+}
+
+// The server logged what it saw at the end of the game; the replay has to
+// arrive at the same winner, score and number of hands.
+bool matches_end(const Game* game, const LogRecord* end) {
+  return game->phase == GAME_OVER && game->winner == end->seat && game->players[0].points == end->arg0 &&
+         game->players[1].points == end->arg1 && (uint64_t)game->hands == end->value;
+}
+
+// Replays every game in one mapped log. Games from different rooms are
+// interleaved, so each open game keeps its own engine state until its end
+// record. trace >= 0 prints that game record by record with its events.
+void replay_log(const LogRecord* records, uint64_t count, int64_t trace, ReplayStats* stats) {
+  unordered_map<uint32_t, Game*> open_games;
+  vector<Game*> spare;
+
+  for (uint64_t i = 0; i < count; i++) {
+    const LogRecord* record = &records[i];
+    bool traced = trace >= 0 && record->game == (uint64_t)trace;
+    if (traced) print_record(record);
+
+    if (record->type == LOG_GAME_START) {
+      Game* game;
+      if (spare.empty()) {
+        game = new Game;
+      } else {
+        game = spare.back();
+        spare.pop_back();
+      }
+      game_start(game, record->value);
+      open_games[record->game] = game;
+      stats->games++;
+      if (traced) print_events(game);
+      continue;
+    }
+
+    unordered_map<uint32_t, Game*>::iterator found = open_games.find(record->game);
+    if (found == open_games.end()) {
+      stats->orphans++;
+      continue;
+    }
+    Game* game = found->second;
+
+    switch (record->type) {
+      case LOG_ACTION: {
+        GameAction action = {record->arg0, record->arg1};
+        game_act(game, record->seat, action);
+        break;
+      }
+      case LOG_FORFEIT:
+        game_forfeit(game, record->seat, (WinReason)record->arg0);
+        break;
+      case LOG_GAME_END:
+        stats->finished++;
+        if (!matches_end(game, record)) {
+          stats->mismatches++;
+          cerr << "Game " << record->game << " does not replay to its logged result." << endl;
+        }
+        open_games.erase(found);
+        spare.push_back(game);
+        continue;
+      default:
+        stats->orphans++;
+        continue;
+    }
+    if (traced) print_events(game);
+  }
+
+  for (Game* game : spare) delete game;
+  for (auto& open : open_games) delete open.second;
+}
+
+bool replay_file(const char* path, int64_t trace, ReplayStats* stats) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  if ((size_t)st.st_size < sizeof(LogHeader)) {
+    cerr << path << ": not a game log" << endl;
+    close(fd);
+    return false;
+  }
+
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  const LogHeader* header = (const LogHeader*)data;
+  bool valid = memcmp(header->magic, EVENT_LOG_MAGIC, sizeof(header->magic)) == 0 &&
+               header->version == EVENT_LOG_VERSION && header->record_size == sizeof(LogRecord);
+  if (valid) {
+    uint64_t count = (st.st_size - sizeof(LogHeader)) / sizeof(LogRecord);
+    replay_log((const LogRecord*)(header + 1), count, trace, stats);
+    stats->records += count;
+  } else {
+    cerr << path << ": not a game log" << endl;
+  }
+
+  munmap(data, st.st_size);
+  return valid;
+}
+
+void usage(const char* name) {
+  cerr << "Usage: " << name << " [-g game] log..." << endl;
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+  int64_t trace = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "g:")) != -1) {
+    switch (opt) {
+      case 'g': trace = strtoll(optarg, nullptr, 10); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind >= argc) usage(argv[0]);
+
+  hand_score_table();
+
+  ReplayStats stats;
+  memset(&stats, 0, sizeof(stats));
+  bool ok = true;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int i = optind; i < argc; i++) {
+    ok = replay_file(argv[i], trace, &stats) && ok;
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  cout << "Replayed " << stats.records << " records, " << stats.games << " games in " << seconds << " s ("
+       << stats.records / seconds << " records/s)" << endl;
+  cout << "Finished games: " << stats.finished << ", unfinished " << stats.games - stats.finished
+       << ", mismatched " << stats.mismatches << ", orphan records " << stats.orphans << endl;
+
+  return ok && stats.mismatches == 0 && stats.orphans == 0 ? 0 : EXIT_FAILURE;
+}
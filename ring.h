@@ -0,0 +1,58 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#define OUT_RING_SIZE 8192
+#define OUT_RING_MASK (OUT_RING_SIZE - 1)
+
+// Fixed-size byte ring holding one connection's outbound frames. Frames go
+// in whole and come out as however many bytes the socket takes, so a
+// partial send never splits what is still queued. The caller checks
+// ring_space() before writing; nothing here allocates.
+
+typedef struct {
+  uint8_t data[OUT_RING_SIZE];
+  uint32_t head;
+  uint32_t size;
+} OutRing;
+
+inline void ring_clear(OutRing* ring) {
+  ring->head = 0;
+  ring->size = 0;
+}
+
+inline uint32_t ring_space(const OutRing* ring) {
+  return OUT_RING_SIZE - ring->size;
+}
+
+inline void ring_write(OutRing* ring, const void* data, uint32_t size) {
+  uint32_t tail = (ring->head + ring->size) & OUT_RING_MASK;
+  uint32_t first = size < OUT_RING_SIZE - tail ? size : OUT_RING_SIZE - tail;
+  memcpy(ring->data + tail, data, first);
+  memcpy(ring->data, (const uint8_t*)data + first, size - first);
+  ring->size += size;
+}
+
+// Points iov at the queued bytes, oldest first, and returns how many of the
+// two entries it used.
+inline int ring_iov(const OutRing* ring, iovec* iov) {
+  if (ring->size == 0) return 0;
+
+  uint32_t first = ring->size < OUT_RING_SIZE - ring->head ? ring->size : OUT_RING_SIZE - ring->head;
+  iov[0].iov_base = (void*)(ring->data + ring->head);
+  iov[0].iov_len = first;
+  if (first == ring->size) return 1;
+  iov[1].iov_base = (void*)ring->data;
+  iov[1].iov_len = ring->size - first;
+  return 2;
+}
+
+inline void ring_consume(OutRing* ring, uint32_t size) {
+  ring->head = (ring->head + size) & OUT_RING_MASK;
+  ring->size -= size;
+}
+
+#endif
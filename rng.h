@@ -0,0 +1,57 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// xoshiro256** seeded through splitmix64. Each room owns one, so dealing
+// never touches shared state and a logged seed reproduces a game exactly.
+typedef struct {
+  uint64_t s[4];
+} Rng;
+
+inline uint64_t splitmix64(uint64_t* state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+inline void seed_rng(Rng* rng, uint64_t seed) {
+  for (int i = 0; i < 4; i++) {
+    rng->s[i] = splitmix64(&seed);
+  }
+}
+
+inline uint64_t rotl64(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+inline uint64_t next_random(Rng* rng) {
+  uint64_t* s = rng->s;
+  uint64_t result = rotl64(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl64(s[3], 45);
+  return result;
+}
+
+// Unbiased integer in [0, bound) using Lemire's multiply-shift reduction.
+inline uint32_t random_below(Rng* rng, uint32_t bound) {
+  uint64_t product = (next_random(rng) >> 32) * bound;
+  uint32_t low = (uint32_t)product;
+  if (low < bound) {
+    uint32_t threshold = -bound % bound;
+    while (low < threshold) {
+      product = (next_random(rng) >> 32) * bound;
+      low = (uint32_t)product;
+    }
+  }
+  return (uint32_t)(product >> 32);
+}
+
+#endif
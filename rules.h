@@ -0,0 +1,92 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <algorithm>
+#include "cards.h"
+
+#define HAND_COMBINATIONS 9880
+
+using namespace std;
+
+// Envido and flor points of a dealt hand. flor is 0 when the three cards
+// do not share a suit.
+typedef struct {
+  uint8_t envido;
+  uint8_t flor;
+} HandScore;
+
+// 0 when card1 wins, 1 when card2 wins, -1 on a tie.
+inline int compare_cards(Card card1, Card card2) {
+  int rank1 = get_card_rank(card1);
+  int rank2 = get_card_rank(card2);
+
+  return (rank1 < rank2) - (rank1 == rank2);
+}
+
+inline int calculate_envido(const Card cards[HAND_SIZE]) {
+  int max_envido = 0;
+
+  for (int i = 0; i < HAND_SIZE; i++) {
+    int value = get_envido_value(cards[i]);
+    max_envido = max(max_envido, value);
+
+    for (int j = i + 1; j < HAND_SIZE; j++) {
+      if (card_suit(cards[i]) == card_suit(cards[j])) {
+        max_envido = max(max_envido, 20 + value + get_envido_value(cards[j]));
+      }
+    }
+  }
+
+  return max_envido;
+}
+
+inline bool check_flor(const Card cards[HAND_SIZE]) {
+  return card_suit(cards[0]) == card_suit(cards[1]) &&
+         card_suit(cards[0]) == card_suit(cards[2]);
+}
+
+inline int calculate_flor(const Card cards[HAND_SIZE]) {
+  if (!check_flor(cards)) return 0;
+  return 20 + get_envido_value(cards[0]) + get_envido_value(cards[1]) + get_envido_value(cards[2]);
+}
+
+// Position of the sorted triple a < b < c in the combinatorial number
+// system, i.e. a dense index in [0, HAND_COMBINATIONS).
+constexpr int hand_key_sorted(int a, int b, int c) {
+  return a + b * (b - 1) / 2 + c * (c - 1) * (c - 2) / 6;
+}
+
+// Sorts the three ids with conditional moves; dealt hands arrive in random
+// order, so a branchy sort would mispredict on almost every call.
+inline int hand_key(const Card cards[HAND_SIZE]) {
+  unsigned a = cards[0], b = cards[1], c = cards[2];
+  unsigned low = a < b ? a : b;
+  unsigned high = a < b ? b : a;
+  unsigned top = high < c ? c : high;
+  high = high < c ? high : c;
+  return hand_key_sorted(low < high ? low : high, low < high ? high : low, top);
+}
+
+inline const HandScore* hand_score_table() {
+  static HandScore* table = []() {
+    HandScore* scores = new HandScore[HAND_COMBINATIONS];
+    for (int c = 2; c < CARDS_IN_DECK; c++) {
+      for (int b = 1; b < c; b++) {
+        for (int a = 0; a < b; a++) {
+          Card cards[HAND_SIZE] = {(Card)a, (Card)b, (Card)c};
+          HandScore* score = &scores[hand_key_sorted(a, b, c)];
+          score->envido = calculate_envido(cards);
+          score->flor = calculate_flor(cards);
+        }
+      }
+    }
+    return scores;
+  }();
+  return table;
+}
+
+inline HandScore get_hand_score(const Card cards[HAND_SIZE]) {
+  return hand_score_table()[hand_key(cards)];
+}
+
+#endif
@@ -0,0 +1,177 @@
+#include <chrono>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "engine.h"
+#include "policy.h"
+
+#define DEFAULT_GAMES 1000000
+#define MAX_GAME_ACTIONS 10000
+
+using namespace std;
+
+typedef struct {
+  uint64_t games;
+  uint64_t wins[TOTAL_PER_ROOM];
+  uint64_t hands;
+  uint64_t actions;
+  uint64_t notices;
+  uint64_t stuck;
+  uint64_t bad_endings;
+  uint64_t wrong_leads;
+} SimStats;
+
+// One per thread. Policy a sits in seat 0 on even games and seat 1 on odd
+// ones, so wins[0] is policy a's total whichever seat starts as mano.
+typedef struct {
+  pthread_t id;
+  uint64_t games;
+  uint64_t seed;
+  const Policy* policies[TOTAL_PER_ROOM];
+  SimStats stats;
+} SimThread;
+
+// Apart from the raise confirmations, the engine only sends notices for
+// actions it refuses. Every policy is meant to play legally, so any other
+// notice is a bug in one or the other. A tied round is also checked: its
+// closing card, the result and the next prompt come in one batch, and the
+// prompt has to go back to whoever led the round.
+void count_events(const Game* game, SimStats* stats) {
+  int last_card_seat = -1;
+  for (int i = 0; i < game->event_count; i++) {
+    const GameEvent* event = &game->events[i];
+    if (event->opcode == MSG_CARD_PLAYED) {
+      last_card_seat = event->payload[0];
+    } else if (event->opcode == MSG_ROUND_RESULT && event->payload[0] == NO_SEAT && i + 1 < game->event_count) {
+      const GameEvent* next = &game->events[i + 1];
+      bool prompted = next->opcode == MSG_YOUR_TURN && next->payload[0] == PROMPT_PLAY;
+      if (prompted && next->seat != opponent_of(last_card_seat)) stats->wrong_leads++;
+    } else if (event->opcode == MSG_NOTICE) {
+      if (event->payload[0] != NOTICE_TRUCO_RAISED && event->payload[0] != NOTICE_ENVIDO_RAISED) stats->notices++;
+    }
+  }
+}
+
+void play_game(Game* game, uint64_t seed, const Policy* seats[TOTAL_PER_ROOM], Rng* rng, SimStats* stats) {
+  game_start(game, seed);
+  count_events(game, stats);
+
+  int actions = 0;
+  int seat;
+  while ((seat = game_expected_seat(game)) >= 0) {
+    if (++actions > MAX_GAME_ACTIONS) {
+      stats->stuck++;
+      return;
+    }
+    game_act(game, seat, seats[seat]->decide(game, seat, rng));
+    count_events(game, stats);
+  }
+
+  stats->actions += actions;
+  stats->hands += game->hands;
+  if (game->winner < 0 || game->players[game->winner].points < WIN_SCORE) stats->bad_endings++;
+}
+
+void* sim_thread(void* arg) {
+  SimThread* thread = (SimThread*)arg;
+  SimStats* stats = &thread->stats;
+  Rng rng;
+  seed_rng(&rng, thread->seed);
+  Game* game = new Game;
+
+  for (uint64_t i = 0; i < thread->games; i++) {
+    int seat_a = i & 1;
+    const Policy* seats[TOTAL_PER_ROOM];
+    seats[seat_a] = thread->policies[0];
+    seats[opponent_of(seat_a)] = thread->policies[1];
+
+    play_game(game, next_random(&rng), seats, &rng, stats);
+    stats->games++;
+    if (game->winner >= 0) stats->wins[game->winner == seat_a ? 0 : 1]++;
+  }
+
+  delete game;
+  return nullptr;
+}
+
+void usage(const char* name) {
+  cerr << "Usage: " << name << " [-g games] [-j threads] [-a policy] [-b policy] [-s seed]" << endl;
+  cerr << "Policies:";
+  for (const Policy& policy : POLICIES) {
+    cerr << " " << policy.name;
+  }
+  cerr << endl;
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t games = DEFAULT_GAMES;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const Policy* policies[TOTAL_PER_ROOM] = {find_policy("random"), find_policy("random")};
+  uint64_t seed = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "g:j:a:b:s:")) != -1) {
+    switch (opt) {
+      case 'g': games = strtoull(optarg, nullptr, 10); break;
+      case 'j': threads = atoi(optarg); break;
+      case 'a': policies[0] = find_policy(optarg); break;
+      case 'b': policies[1] = find_policy(optarg); break;
+      case 's': seed = strtoull(optarg, nullptr, 10); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (threads < 1 || policies[0] == nullptr || policies[1] == nullptr) usage(argv[0]);
+
+  hand_score_table();
+
+  SimThread* sims = new SimThread[threads];
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int i = 0; i < threads; i++) {
+    SimThread* sim = &sims[i];
+    memset(&sim->stats, 0, sizeof(sim->stats));
+    sim->games = games / threads + (i < (int)(games % threads));
+    sim->seed = seed + i;
+    sim->policies[0] = policies[0];
+    sim->policies[1] = policies[1];
+    if (pthread_create(&sim->id, nullptr, sim_thread, sim) != 0) {
+      perror("Failed to create simulator thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  SimStats total;
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < threads; i++) {
+    pthread_join(sims[i].id, nullptr);
+    SimStats* stats = &sims[i].stats;
+    total.games += stats->games;
+    total.hands += stats->hands;
+    total.actions += stats->actions;
+    total.notices += stats->notices;
+    total.stuck += stats->stuck;
+    total.bad_endings += stats->bad_endings;
+    total.wrong_leads += stats->wrong_leads;
+    for (int j = 0; j < TOTAL_PER_ROOM; j++) {
+      total.wins[j] += stats->wins[j];
+    }
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  delete[] sims;
+
+  cout << policies[0]->name << " vs " << policies[1]->name << ": " << total.games << " games on " << threads
+       << " threads in " << seconds << " s" << endl;
+  cout << "Throughput: " << total.games / seconds << " games/s, " << total.games / seconds / threads
+       << " games/s/core" << endl;
+  cout << "Wins: " << policies[0]->name << " " << 100.0 * total.wins[0] / total.games << "%, "
+       << policies[1]->name << " " << 100.0 * total.wins[1] / total.games << "%" << endl;
+  cout << "Per game: " << (double)total.hands / total.games << " hands, " << (double)total.actions / total.games
+       << " actions" << endl;
+  cout << "Rule checks: " << total.notices << " refused actions, " << total.stuck << " stuck games, "
+       << total.bad_endings << " bad endings, " << total.wrong_leads << " wrong leads after a tie" << endl;
+
+  return total.notices || total.stuck || total.bad_endings || total.wrong_leads ? EXIT_FAILURE : 0;
+}
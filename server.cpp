@@ -1,636 +1,3385 @@
 #include <arpa/inet.h>
 #include <iostream>
 #include <cstring>
+#include <cerrno>
 #include <pthread.h>
 #include <string>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
-#include <semaphore.h>
 #include <vector>
-#include <map>
 #include <algorithm>
 #include <cstdlib>
-#include <ctime>
-#include "types.h"  
+#include <random>
+#include <getopt.h>
+#include <csignal>
+#include <cstdio>
+#include <sys/signalfd.h>
+#include <sys/random.h>
+#include <netinet/tcp.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <fstream>
+#include <new>
+#include "types.h"
+#include "engine.h"
+#include "policy.h"
+#include "metrics.h"
+#include "timer.h"
+#include "eventlog.h"
+#include "handoff.h"
+#include "ring.h"
+#include "ratings.h"
 
 #define PORT 8080
-#define TOTAL_PER_ROOM 2
-#define MAX_ROOMS 2
-#define NOT_AVAILABLE_MESSAGE "No rooms available. Try again later.\n"
-#define WIN_SCORE 12
+#define SPECTATOR_PORT 8081
+#define ROOM_POOL_CHUNK 64
+#define WORKER_EVENTS 64
+#define DEFAULT_STATS_PATH "server.stats"
+#define TIMER_TICK_MS 100
+#define BOT_PASS_BUDGET_NS 2000000
+#define DEFAULT_TURN_TIMEOUT_MS 30000
+#define TURN_TIMEOUT_LIMIT 3
+#define DEFAULT_RESUME_GRACE_MS 30000
+#define CLOSE_LINGER_MS 5000
+#define KEEPALIVE_IDLE_S 30
+#define KEEPALIVE_INTERVAL_S 10
+#define KEEPALIVE_PROBES 3
+#define DEFAULT_LOG_PREFIX "games"
+#define LOG_FLUSH_MS 10
+#define DEFAULT_HANDOFF_PATH "server.handoff"
+#define HANDOFF_TIMEOUT_S 10
+#define SPECTATOR_MAX_QUEUED_BYTES (16 * 1024)
+#define SPECTATOR_MAX_SKIPS 3
+#define SPECTATOR_MAX_PENDING 1024
+#define SPECTATOR_IOV 16
+#define SPECTATOR_QUEUE_SLOTS 64
+#define SHARED_BUFFER_SIZE ((GAME_MAX_EVENTS + 1) * (FRAME_HEADER_SIZE + MAX_EVENT_PAYLOAD))
+#define PLAYER_OUT_HIGH_WATER (6 * 1024)
+#define PLAYER_OUT_LOW_WATER (2 * 1024)
+#define PLAYER_MAX_BEHIND_MS 10000
+#define PLAYER_IN_BUF_SIZE (4 * MAX_FRAME_SIZE)
+#define PLAYER_MAX_QUEUED 4
+#define TABLE_SEQUENCE_MASK 0xFFFFFF
+#define DEFAULT_RATINGS_PATH "ratings.db"
+#define RATING_FLUSH_MS 100
+#define RATING_BUCKET_WIDTH 100
+#define RATING_BUCKETS 32
+#define RATING_MATCH_SPAN 1
+#define RATING_RELAX_MS 10000
+#define TOURNAMENT_NO_SHOW_MS 60000
 
 using namespace std;
 
+typedef enum {
+  ROOM_WAITING,
+  ROOM_PLAYING,
+  ROOM_CLOSING,
+  ROOM_CLOSED
+} RoomPhase;
+
+struct Room;
+
+// One batch of public frames, serialized once and queued to every
+// spectator of a room. Only the room's worker ever touches it, so the
+// count is a plain int; the last spectator to send it hands it back to the
+// worker. A batch is at most one frame per engine event plus a score.
+typedef struct {
+  int refs;
+  uint32_t size;
+  uint8_t data[SHARED_BUFFER_SIZE];
+} SharedBuffer;
+
+// Watches one room from its worker. The queue is a ring of buffers; offset
+// is how much of the front one has been sent and queued_bytes how much of
+// the queue has not.
+typedef struct {
+  int socket;
+  struct Room* room;
+  SharedBuffer* queue[SPECTATOR_QUEUE_SLOTS];
+  int queue_head;
+  int queue_count;
+  size_t offset;
+  size_t queued_bytes;
+  int skips;
+  bool want_write;
+} Spectator;
+
+// A spectator connection on shard 0 that has not named its table yet.
+typedef struct {
+  int socket;
+  uint8_t buf[MAX_FRAME_SIZE];
+  size_t len;
+} PendingSpectator;
+
+// A connection handed to the worker that owns a table: a spectator, with
+// seat NO_SEAT, or a player taking its seat back with the seat's secret.
 typedef struct {
-  vector<string> cards;
-  vector<int> cards_already_played;
-} Hand;
+  int socket;
+  uint32_t table;
+  uint8_t seat;
+  uint64_t secret;
+} TableRequest;
 
+// Bots have no socket; their moves are made on the worker thread right
+// after the events that prompt them, as are moves a player queued before
+// its turn. Received frames are parsed where they land in in_buf, from
+// in_start for in_len bytes. A player whose connection drops keeps
+// the seat for resume_grace_ms; away_ns is when it dropped and secret what
+// a reconnect must present. owner is the digest of the secret behind name.
 typedef struct {
   int socket_player;
-  Hand hand;
-  int points;
-  int envido_points;
-  bool has_flor;
+  bool bot;
+  uint64_t prompted_ns;
+  int timeouts;
+  uint64_t secret;
+  uint64_t away_ns;
+  TimerNode grace_timer;
+  char name[PLAYER_NAME_SIZE];
+  uint64_t owner;
+  int rating;
+  struct Room* room;
+  int seat;
+  uint8_t in_buf[PLAYER_IN_BUF_SIZE];
+  size_t in_start;
+  size_t in_len;
+  GameAction queued[PLAYER_MAX_QUEUED];
+  int queued_count;
+  OutRing out;
+  uint64_t behind_ns;
+  bool want_write;
 } Player;
 
-typedef struct {
+typedef struct Worker {
   pthread_t id;
-  sem_t start_round;
-  vector<Player> players;
+  int epoll_fd;
+  int wake_fd;
+  pthread_mutex_t lock;
+  vector<struct Room*> incoming;
+  vector<struct Room*> accepted;
+  bool wake_pending;
+  Rng rng;
+  Metrics* metrics;
+  TimerWheel wheel;
+  struct Shard* shard;
+  int log_fd;
+  uint64_t log_records;
+  vector<LogRecord> log_batch;
+  pthread_mutex_t log_lock;
+  vector<LogRecord> log_queue;
+  vector<GameResult> results;
+  pthread_mutex_t result_lock;
+  vector<GameResult> result_queue;
+  int spectator_epoll_fd;
+  vector<TableRequest> incoming_requests;
+  vector<TableRequest> accepted_requests;
+  uint64_t bot_pass_ns;
+  vector<struct Room*> deferred_bots;
+  vector<struct Room*> ready_bots;
+  unordered_map<uint32_t, struct Room*> tables;
+  uint32_t next_table;
+  string broadcast;
+  string scratch;
+  vector<SharedBuffer*> spare_buffers;
+} Worker;
+
+typedef struct Room {
+  Player players[TOTAL_PER_ROOM];
   int total_players;
+  Worker* worker;
+  RoomPhase phase;
+  uint64_t seed;
+  uint64_t actions;
+  uint64_t send_calls;
+  uint32_t log_id;
+  TimerNode turn_timer;
+  uint32_t table;
+  vector<Spectator*> spectators;
+  int spectator_points[TOTAL_PER_ROOM];
+  GameTally tally;
+  int match;
+  bool bot_deferred;
+  Game game;
 } Room;
 
 typedef struct {
-  int hand_value;      
-  bool truco_called;
-  bool retruco_called;
-  bool vale4_called;
-  int last_raiser;     
-} TrucoState;
+  pthread_mutex_t lock;
+  vector<Room*> free_rooms;
+  vector<Room*> chunks;
+  size_t total_rooms;
+} RoomPool;
+
+typedef struct LobbyEntry {
+  int socket_player;
+  uint64_t joined_ns;
+  bool greeted;
+  uint8_t in_buf[MAX_FRAME_SIZE];
+  size_t in_len;
+  char name[PLAYER_NAME_SIZE];
+  uint64_t owner;
+  int rating;
+  int bucket;
+  int slot;
+  struct LobbyEntry* prev;
+  struct LobbyEntry* next;
+  struct LobbyEntry* bucket_prev;
+  struct LobbyEntry* bucket_next;
+} LobbyEntry;
+
+// A new connection is greeting until its first frame says whether it wants
+// a game or its seat back. Players waiting for an opponent queue from head
+// to tail, and again within the bucket of RATING_BUCKET_WIDTH their rating
+// falls in.
+typedef struct {
+  LobbyEntry* head;
+  LobbyEntry* tail;
+  LobbyEntry* bucket_heads[RATING_BUCKETS];
+  LobbyEntry* bucket_tails[RATING_BUCKETS];
+  LobbyEntry* greeting;
+  vector<LobbyEntry*> spare;
+  vector<LobbyEntry*> retired;
+  int waiting;
+} Lobby;
+
+// A shard is an acceptor thread with its own listening socket, lobby, room
+// pool and slice of the workers, so shards never share a lock. The kernel
+// spreads new connections across their SO_REUSEPORT listeners. Players are
+// only ever paired within a shard.
+typedef struct Shard {
+  int index;
+  pthread_t id;
+  int server_fd;
+  int epoll_fd;
+  int wake_fd;
+  Lobby lobby;
+  RoomPool room_pool;
+  Worker* workers;
+  int total_workers;
+  int next_worker;
+  atomic<int> waiting;
+  Metrics* metrics;
+} Shard;
+
+typedef enum {
+  SLOT_OPEN,
+  SLOT_FILLED,
+  SLOT_BYE
+} SlotState;
+
+// A place in the bracket, which is a complete binary tree kept in an array:
+// the seeds are the leaves, from size to 2 * size - 1, and slot m is filled
+// by the winner of the match between slots 2m and 2m + 1, so slot 1 holds
+// the champion. An empty seed or a match nobody showed up for is a bye.
+// entry is the occupant while it is connected and waiting to play from
+// here; ready_ns is when both children of a match were decided. owner is
+// the digest of the secret the name first showed up with, or 0 before it
+// has.
+typedef struct {
+  SlotState state;
+  char name[PLAYER_NAME_SIZE];
+  uint64_t owner;
+  LobbyEntry* entry;
+  uint64_t ready_ns;
+  bool playing;
+} TournamentSlot;
+
+// A rostered player for shard 0 to seat: a new connection from any shard,
+// with match 0, or the winner of a match handed back by its worker, whose
+// socket is -1 if it is no longer connected.
+typedef struct {
+  int socket;
+  int match;
+  char name[PLAYER_NAME_SIZE];
+  uint64_t owner;
+  int rating;
+} TournamentArrival;
+
+// What a room needs to carry on in another process. Each player with a
+// socket sends it alongside, in seat order, and out_len bytes of unsent
+// frames per player follow the struct.
+typedef struct {
+  uint8_t bot;
+  uint8_t has_socket;
+  uint16_t in_len;
+  int32_t timeouts;
+  uint64_t prompted_ns;
+  uint64_t secret;
+  uint64_t away_ns;
+  uint64_t behind_ns;
+  uint64_t owner;
+  uint32_t out_len;
+  int32_t queued_count;
+  int32_t rating;
+  char name[PLAYER_NAME_SIZE];
+  GameAction queued[PLAYER_MAX_QUEUED];
+  uint8_t in_buf[PLAYER_IN_BUF_SIZE];
+} PlayerState;
+
+typedef struct {
+  uint32_t type;
+  uint32_t worker;
+  uint32_t phase;
+  uint32_t log_id;
+  uint32_t table;
+  uint32_t match;
+  uint64_t seed;
+  uint64_t actions;
+  uint64_t send_calls;
+  PlayerState players[TOTAL_PER_ROOM];
+  GameTally tally;
+  Game game;
+} RoomState;
+
+// A bracket slot as it follows HandoffTournament. Whoever waits in it goes
+// over as a lobby entry.
+typedef struct {
+  uint32_t state;
+  uint32_t playing;
+  uint64_t ready_ns;
+  uint64_t owner;
+  char name[PLAYER_NAME_SIZE];
+} SlotRecord;
+
+Shard* shards;
+int total_shards = 1;
+Worker* workers;
+int total_workers;
+
+// A player left alone in the lobby for bot_wait_ms gets a bot opponent;
+// negative disables bots. Each bot decision gets at most bot_budget_ns,
+// and the bots on one worker get BOT_PASS_BUDGET_NS per epoll pass between
+// them; a bot whose turn comes up after that is deferred to the next pass,
+// so players' frames on the worker are never held up behind many bots.
+int bot_wait_ms = -1;
+uint64_t bot_budget_ns = MC_DEFAULT_BUDGET_NS;
+
+// A human gets turn_timeout_ms per prompt before the server plays for them,
+// and forfeits after TURN_TIMEOUT_LIMIT turns in a row; 0 disables this.
+int turn_timeout_ms = DEFAULT_TURN_TIMEOUT_MS;
+
+// A player whose connection drops mid-game has resume_grace_ms to come
+// back with its session token before forfeiting; 0 forfeits at once.
+int resume_grace_ms = DEFAULT_RESUME_GRACE_MS;
 
+// Each worker appends its rooms' games to <log_prefix>.<worker>.log; an
+// empty prefix turns the logs off. Records gather in log_batch during an
+// epoll pass, move to log_queue after it, and the log writer thread writes
+// and fsyncs every queue once per LOG_FLUSH_MS.
+const char* log_prefix = DEFAULT_LOG_PREFIX;
+pthread_mutex_t log_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Named players' ratings and counts live in ratings_path; an empty path
+// turns rating off. Workers queue each finished game like log records, and
+// the rating thread applies them once per RATING_FLUSH_MS under
+// ratings_lock, which only keeps a handoff's sync from applying at the same
+// time. Shards read a rating without any lock when a player says HELLO, so
+// an accept never waits on the rating thread.
+const char* ratings_path = DEFAULT_RATINGS_PATH;
+RatingStore ratings;
+bool ratings_open = false;
+pthread_mutex_t ratings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// With -T, the players named in roster_path, one per line in seed order,
+// play a single elimination tournament alongside the lobby. Shard 0 owns
+// the bracket and is the only thread to touch it; other threads only read
+// the roster, fixed at startup, and hand rostered players over through the
+// inbox. Every match starts as soon as both of its players are there, so
+// nothing waits for a round to finish. A player who does not show up for
+// TOURNAMENT_NO_SHOW_MS after the match could start loses it. A handoff
+// takes the bracket along, deadlines included, and a new server started
+// with -T only starts a tournament if it was not handed one.
 typedef struct {
-  bool envido_called;
-  bool real_envido_called;
-  bool falta_envido_called;
-  int envido_value;    
-  int last_caller;    
-} EnvidoState;
+  atomic<bool> running;
+  int size;
+  int rounds;
+  int players;
+  int playing;
+  uint64_t started_ns;
+  vector<TournamentSlot> slots;
+  unordered_set<string> roster;
+  unordered_map<string, int> current;
+  deque<int> due;
+  pthread_mutex_t lock;
+  vector<TournamentArrival> inbox;
+  vector<TournamentArrival> accepted;
+} Tournament;
+
+const char* roster_path = "";
+Tournament tournament;
+
+// The running server takes restart requests on handoff_path; one started
+// with -u connects there and takes over. While a handoff is pending every
+// other shard parks, then every worker, so shard 0 can read all rooms,
+// lobbies and worker queues without locks.
+const char* handoff_path = DEFAULT_HANDOFF_PATH;
+bool take_over = false;
+int handoff_fd = -1;
+atomic<bool> handoff_pending(false);
+atomic<bool> workers_parking(false);
+pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+int parked_threads = 0;
+
+// Spectators connect to spectator_port, which shard 0 owns; 0 turns them
+// off. A table id is its worker's index plus one in the top byte and a
+// sequence number below, so shard 0 can route a spectator without asking
+// anyone. The first table to start while none is featured becomes the
+// featured one until it closes.
+int spectator_port = SPECTATOR_PORT;
+int spectator_fd = -1;
+int spectator_epoll_fd = -1;
+vector<PendingSpectator*> pending_spectators;
+atomic<uint32_t> featured_table(0);
+
+// Written on SIGUSR1. The shards' own metrics come first in all_metrics,
+// then the workers', so a dump is one pass over it.
+const char* stats_path = DEFAULT_STATS_PATH;
+int stats_signal_fd = -1;
+Metrics** all_metrics;
+int total_metrics;
+thread_local Metrics* thread_metrics;
+
+// Every operator new is counted against the thread making it. Once rooms,
+// buffers and lists have grown to what the load needs, turns should not
+// move the count at all. They stay out of line: inlined, GCC takes the
+// free() below for a mismatch with new.
+__attribute__((noinline)) void* operator new(size_t size) {
+  if (thread_metrics) count_metric(COUNTER_ALLOCATIONS);
+  void* ptr = malloc(size ? size : 1);
+  if (ptr == nullptr) throw bad_alloc();
+  return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+
+void* worker_thread(void* arg);
+
+uint64_t timer_tick(uint64_t ns) {
+  return ns / (TIMER_TICK_MS * 1000000ULL);
+}
+
+void open_worker_log(Worker* worker, int index) {
+  pthread_mutex_init(&worker->log_lock, nullptr);
+  worker->log_fd = -1;
+  worker->log_records = 0;
+  if (log_prefix[0] == '\0') return;
+
+  string path = string(log_prefix) + "." + to_string(index) + ".log";
+  worker->log_fd = open_event_log(path.c_str(), &worker->log_records);
+  if (worker->log_fd < 0) {
+    perror(("Failed to open game log " + path).c_str());
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Returns the record's index in the file, which for LOG_GAME_START is the
+// id every later record of that game carries.
+uint32_t log_event(Room* room, LogRecordType type, int seat, int arg0, int arg1, uint64_t value) {
+  Worker* worker = room->worker;
+  if (worker->log_fd < 0) return 0;
+
+  uint32_t index = (uint32_t)worker->log_records++;
+  uint32_t game = type == LOG_GAME_START ? index : room->log_id;
+  worker->log_batch.push_back(log_record(game, type, seat, arg0, arg1, value));
+  return index;
+}
+
+void log_action(Room* room, int seat, const GameAction& action) {
+  log_event(room, LOG_ACTION, seat, action.type, action.slot, 0);
+}
+
+// One lock per epoll pass, not per record.
+void queue_log_batch(Worker* worker) {
+  if (worker->log_batch.empty()) return;
+
+  pthread_mutex_lock(&worker->log_lock);
+  if (worker->log_queue.empty()) worker->log_queue.swap(worker->log_batch);
+  else worker->log_queue.insert(worker->log_queue.end(), worker->log_batch.begin(), worker->log_batch.end());
+  pthread_mutex_unlock(&worker->log_lock);
+  worker->log_batch.clear();
+}
+
+// Group commit: whatever every worker queued since the last pass goes out
+// in one write and one fdatasync per file. Passes never overlap, so each
+// file keeps the order its worker queued in.
+void write_logs(vector<LogRecord>* records) {
+  pthread_mutex_lock(&log_write_lock);
+  for (int i = 0; i < total_workers; i++) {
+    Worker* worker = &workers[i];
+    if (worker->log_fd < 0) continue;
+
+    pthread_mutex_lock(&worker->log_lock);
+    records->swap(worker->log_queue);
+    pthread_mutex_unlock(&worker->log_lock);
+    if (records->empty()) continue;
+
+    if (!write_fully(worker->log_fd, records->data(), records->size() * sizeof(LogRecord)) ||
+        fdatasync(worker->log_fd) < 0) {
+      perror("Failed to write game log");
+    }
+    records->clear();
+  }
+  pthread_mutex_unlock(&log_write_lock);
+}
+
+// Keeps turns off the disk entirely; they only ever append to memory.
+void* log_writer_thread(void* arg) {
+  vector<LogRecord> records;
+  timespec interval = {0, LOG_FLUSH_MS * 1000000L};
+
+  while (true) {
+    nanosleep(&interval, nullptr);
+    write_logs(&records);
+  }
+
+  return nullptr;
+}
+
+int lookup_rating(const char* name) {
+  if (!ratings_open || !rating_named(name)) return RATING_DEFAULT;
+  return rating_lookup(&ratings, name);
+}
+
+void queue_results(Worker* worker) {
+  if (worker->results.empty()) return;
+
+  pthread_mutex_lock(&worker->result_lock);
+  worker->result_queue.insert(worker->result_queue.end(), worker->results.begin(), worker->results.end());
+  pthread_mutex_unlock(&worker->result_lock);
+  worker->results.clear();
+}
+
+// Drains under the lock, so once a caller returns every game queued before
+// it has been applied, whichever thread applied it.
+void apply_results(vector<GameResult>* results) {
+  pthread_mutex_lock(&ratings_lock);
+  for (int i = 0; i < total_workers; i++) {
+    Worker* worker = &workers[i];
+    pthread_mutex_lock(&worker->result_lock);
+    results->insert(results->end(), worker->result_queue.begin(), worker->result_queue.end());
+    worker->result_queue.clear();
+    pthread_mutex_unlock(&worker->result_lock);
+  }
+  for (const GameResult& result : *results) {
+    rating_apply(&ratings, result);
+  }
+  pthread_mutex_unlock(&ratings_lock);
+  results->clear();
+}
+
+// The mapping is written back by the kernel; a handoff syncs it before the
+// new server opens the file.
+void* rating_thread(void* arg) {
+  vector<GameResult> results;
+  timespec interval = {0, RATING_FLUSH_MS * 1000000L};
+
+  while (true) {
+    nanosleep(&interval, nullptr);
+    apply_results(&results);
+  }
+
+  return nullptr;
+}
+
+void sync_ratings() {
+  if (!ratings_open) return;
+
+  vector<GameResult> results;
+  apply_results(&results);
+  pthread_mutex_lock(&ratings_lock);
+  msync(ratings.header, sizeof(RatingHeader) + ratings.capacity * sizeof(RatingRecord), MS_SYNC);
+  pthread_mutex_unlock(&ratings_lock);
+}
+
+void init_ratings() {
+  if (ratings_path[0] == '\0') return;
+
+  uint64_t start = clock_ns();
+  if (!open_rating_store(&ratings, ratings_path)) {
+    perror((string("Failed to open rating store ") + ratings_path).c_str());
+    exit(EXIT_FAILURE);
+  }
+  ratings_open = true;
+  cout << "Loaded " << ratings.header->count << " player ratings in " << (clock_ns() - start) / 1000000 << " ms."
+       << endl;
 
-int server_fd, new_socket;
-struct sockaddr_in address;
-int addrlen = sizeof(address);
+  pthread_t id;
+  if (pthread_create(&id, nullptr, rating_thread, nullptr) != 0) {
+    perror("Failed to create rating thread");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(id);
+}
 
+void start_log_writer() {
+  if (log_prefix[0] == '\0') return;
 
-void* room_thread(void* arg);
-void send_message(int socket_fd, MessageType type, const string& text);
+  pthread_t id;
+  if (pthread_create(&id, nullptr, log_writer_thread, nullptr) != 0) {
+    perror("Failed to create log writer thread");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(id);
+}
 
-int init_main_socket() {
+// Every shard binds its own socket to the port; SO_REUSEPORT lets them all
+// listen at once and has the kernel balance connections between them.
+int init_main_socket(int port) {
   const int opt = 1;
   int server_fd;
-  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+  struct sockaddr_in address;
+  if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
     perror("Socket failed");
     exit(EXIT_FAILURE);
   }
 
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
+  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+      setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
     perror("Setsockopt failed");
     exit(EXIT_FAILURE);
   }
 
+  memset(&address, 0, sizeof(address));
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(PORT);
+  address.sin_port = htons(port);
 
   if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
     perror("Bind failed");
     exit(EXIT_FAILURE);
   }
 
-  if (listen(server_fd, 4) < 0) {
+  if (listen(server_fd, SOMAXCONN) < 0) {
     perror("Listen failed");
     exit(EXIT_FAILURE);
   }
 
-  cout << "Server listening on port " << PORT << endl;
   return server_fd;
 }
 
-bool is_room_full(Room* room) {
-  return room->total_players >= TOTAL_PER_ROOM;
+void init_shard(Shard* shard, int index, Metrics* metrics) {
+  shard->index = index;
+  shard->server_fd = -1;
+  shard->epoll_fd = epoll_create1(0);
+  shard->wake_fd = eventfd(0, EFD_NONBLOCK);
+  if (shard->epoll_fd < 0 || shard->wake_fd < 0) {
+    perror("Failed to create shard event loop");
+    exit(EXIT_FAILURE);
+  }
+
+  shard->lobby.head = nullptr;
+  shard->lobby.tail = nullptr;
+  for (int i = 0; i < RATING_BUCKETS; i++) {
+    shard->lobby.bucket_heads[i] = nullptr;
+    shard->lobby.bucket_tails[i] = nullptr;
+  }
+  shard->lobby.greeting = nullptr;
+  shard->lobby.waiting = 0;
+  pthread_mutex_init(&shard->room_pool.lock, nullptr);
+  shard->room_pool.total_rooms = 0;
+  shard->next_worker = 0;
+  shard->waiting.store(0);
+  shard->metrics = metrics;
+
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &shard->wake_fd;
+  epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wake_fd, &ev);
 }
 
-void create_room(Room* room, pthread_t tid) {
-  room->id = tid;
-  room->total_players = 0;
-  sem_init(&room->start_round, 0, 0);
- 
-  room->players.clear();
-}
-
-void build_rooms(Room rooms[MAX_ROOMS]) {
-  for (int i = 0; i < MAX_ROOMS; i++) {
-    pthread_t tid;
-    
-    create_room(&rooms[i], tid); 
-    
-    if (pthread_create(&tid, nullptr, room_thread, &rooms[i]) != 0) {
-      perror("Failed to create room thread");
+// Workers are split into contiguous slices, one per shard. A server taking
+// over needs at least as many workers as the old one had, since rooms keep
+// their worker and with it their game log file.
+void build_shards(int shard_count, int min_workers) {
+  total_shards = shard_count;
+  total_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (total_workers < min_workers) total_workers = min_workers;
+  if (total_workers < total_shards) total_workers = total_shards;
+  workers = new Worker[total_workers];
+  shards = new Shard[total_shards];
+
+  total_metrics = total_shards + total_workers;
+  all_metrics = new Metrics*[total_metrics];
+  for (int i = 0; i < total_metrics; i++) {
+    all_metrics[i] = create_metrics();
+  }
+  thread_metrics = all_metrics[0];
+
+  for (int i = 0; i < total_shards; i++) {
+    Shard* shard = &shards[i];
+    init_shard(shard, i, all_metrics[i]);
+    int first = i * total_workers / total_shards;
+    shard->workers = &workers[first];
+    shard->total_workers = (i + 1) * total_workers / total_shards - first;
+  }
+  random_device entropy;
+
+  for (int i = 0; i < total_workers; i++) {
+    Worker* worker = &workers[i];
+    worker->shard = &shards[i * total_shards / total_workers];
+    pthread_mutex_init(&worker->lock, nullptr);
+    pthread_mutex_init(&worker->result_lock, nullptr);
+    worker->epoll_fd = epoll_create1(0);
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK);
+    worker->wake_pending = false;
+    worker->spectator_epoll_fd = epoll_create1(0);
+    worker->next_table = 0;
+    worker->broadcast.reserve(SHARED_BUFFER_SIZE);
+    worker->scratch.reserve(SHARED_BUFFER_SIZE);
+    worker->metrics = all_metrics[total_shards + i];
+    init_timer_wheel(&worker->wheel, timer_tick(clock_ns()));
+    open_worker_log(worker, i);
+    seed_rng(&worker->rng, ((uint64_t)entropy() << 32) | entropy());
+    if (worker->epoll_fd < 0 || worker->wake_fd < 0 || worker->spectator_epoll_fd < 0) {
+      perror("Failed to create worker event loop");
+      exit(EXIT_FAILURE);
+    }
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev);
+    ev.data.ptr = &worker->spectator_epoll_fd;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->spectator_epoll_fd, &ev);
+
+    if (pthread_create(&worker->id, nullptr, worker_thread, worker) != 0) {
+      perror("Failed to create worker thread");
       exit(EXIT_FAILURE);
     }
 
-    pthread_detach(tid);
+    pthread_detach(worker->id);
   }
+
+  cout << "Started " << total_shards << " shards with " << total_workers << " worker threads." << endl;
 }
 
-void get_free_room(Room rooms[MAX_ROOMS], int* room_index) {
-  for (int i = 0; i < MAX_ROOMS; i++) {
-    if (!is_room_full(&rooms[i])) {
-      *room_index = i;
-      return;
+void create_room(Room* room) {
+  room->total_players = 0;
+  room->worker = nullptr;
+  room->phase = ROOM_WAITING;
+  room->actions = 0;
+  room->send_calls = 0;
+  init_timer_node(&room->turn_timer, room);
+  room->table = 0;
+  room->match = 0;
+  room->bot_deferred = false;
+  room->spectators.clear();
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    room->spectator_points[i] = 0;
+  }
+}
+
+Room* acquire_room(RoomPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  if (pool->free_rooms.empty()) {
+    Room* chunk = new Room[ROOM_POOL_CHUNK];
+    for (int i = ROOM_POOL_CHUNK - 1; i >= 0; i--) {
+      create_room(&chunk[i]);
+      pool->free_rooms.push_back(&chunk[i]);
+    }
+    pool->chunks.push_back(chunk);
+    pool->total_rooms += ROOM_POOL_CHUNK;
+    cout << "Room pool grew to " << pool->total_rooms << " rooms." << endl;
+  }
+
+  Room* room = pool->free_rooms.back();
+  pool->free_rooms.pop_back();
+  pthread_mutex_unlock(&pool->lock);
+  return room;
+}
+
+void release_room(RoomPool* pool, Room* room) {
+  create_room(room);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->free_rooms.push_back(room);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+LobbyEntry* lobby_greet(Lobby* lobby, int socket_player) {
+  LobbyEntry* entry;
+  if (lobby->spare.empty()) {
+    entry = new LobbyEntry;
+  } else {
+    entry = lobby->spare.back();
+    lobby->spare.pop_back();
+  }
+
+  entry->socket_player = socket_player;
+  entry->joined_ns = clock_ns();
+  entry->greeted = false;
+  entry->in_len = 0;
+  memset(entry->name, 0, sizeof(entry->name));
+  entry->owner = 0;
+  entry->rating = RATING_DEFAULT;
+  entry->slot = 0;
+  entry->prev = nullptr;
+  entry->next = lobby->greeting;
+  if (lobby->greeting) lobby->greeting->prev = entry;
+  lobby->greeting = entry;
+  return entry;
+}
+
+// A rostered player waiting for its match is in no list, only in its slot.
+void lobby_unlink(Lobby* lobby, LobbyEntry* entry) {
+  if (entry->slot != 0) {
+    tournament.slots[entry->slot].entry = nullptr;
+    entry->slot = 0;
+    return;
+  }
+  if (!entry->greeted) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else lobby->greeting = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    return;
+  }
+
+  if (entry->prev) entry->prev->next = entry->next;
+  else lobby->head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else lobby->tail = entry->prev;
+
+  if (entry->bucket_prev) entry->bucket_prev->bucket_next = entry->bucket_next;
+  else lobby->bucket_heads[entry->bucket] = entry->bucket_next;
+  if (entry->bucket_next) entry->bucket_next->bucket_prev = entry->bucket_prev;
+  else lobby->bucket_tails[entry->bucket] = entry->bucket_prev;
+  lobby->waiting--;
+}
+
+int rating_bucket(int rating) {
+  int bucket = rating / RATING_BUCKET_WIDTH;
+  return bucket < 0 ? 0 : bucket >= RATING_BUCKETS ? RATING_BUCKETS - 1 : bucket;
+}
+
+// Moves an entry that has just greeted to the back of the queue and of
+// its rating bucket.
+void lobby_push(Lobby* lobby, LobbyEntry* entry) {
+  lobby_unlink(lobby, entry);
+  entry->greeted = true;
+  entry->prev = lobby->tail;
+  entry->next = nullptr;
+  if (lobby->tail) lobby->tail->next = entry;
+  else lobby->head = entry;
+  lobby->tail = entry;
+
+  entry->bucket = rating_bucket(entry->rating);
+  entry->bucket_prev = lobby->bucket_tails[entry->bucket];
+  entry->bucket_next = nullptr;
+  if (entry->bucket_prev) entry->bucket_prev->bucket_next = entry;
+  else lobby->bucket_heads[entry->bucket] = entry;
+  lobby->bucket_tails[entry->bucket] = entry;
+  lobby->waiting++;
+}
+
+// The opponent for a player of the given bucket: whoever has waited
+// longest within RATING_MATCH_SPAN buckets of it or, failing that, the
+// head of the queue once it has waited RATING_RELAX_MS and will take
+// anyone. Only a fixed number of buckets is looked at, however many wait.
+LobbyEntry* lobby_match(Lobby* lobby, int bucket, uint64_t now) {
+  LobbyEntry* best = nullptr;
+  for (int i = bucket - RATING_MATCH_SPAN; i <= bucket + RATING_MATCH_SPAN; i++) {
+    if (i < 0 || i >= RATING_BUCKETS) continue;
+    LobbyEntry* candidate = lobby->bucket_heads[i];
+    if (candidate && (best == nullptr || candidate->joined_ns < best->joined_ns)) best = candidate;
+  }
+  if (best == nullptr && lobby->head && now - lobby->head->joined_ns >= (uint64_t)RATING_RELAX_MS * 1000000) {
+    best = lobby->head;
+  }
+  return best;
+}
+
+// Entries may still be referenced by events later in the current epoll
+// batch, so they are only reused once lobby_recycle() runs after it.
+void lobby_retire(Lobby* lobby, LobbyEntry* entry) {
+  entry->socket_player = -1;
+  lobby->retired.push_back(entry);
+}
+
+void lobby_remove(Lobby* lobby, LobbyEntry* entry) {
+  lobby_unlink(lobby, entry);
+  lobby_retire(lobby, entry);
+}
+
+void lobby_recycle(Lobby* lobby) {
+  lobby->spare.insert(lobby->spare.end(), lobby->retired.begin(), lobby->retired.end());
+  lobby->retired.clear();
+}
+
+void update_events(Player* player) {
+  Worker* worker = player->room->worker;
+  bool want_write = player->out.size > 0;
+  if (worker == nullptr || want_write == player->want_write) return;
+
+  epoll_event ev;
+  ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+  ev.data.ptr = player;
+  epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, player->socket_player, &ev);
+  player->want_write = want_write;
+}
+
+// Surfaces as EOF on the next epoll pass, where the disconnect is handled.
+void cut_player(Player* player) {
+  ring_clear(&player->out);
+  shutdown(player->socket_player, SHUT_RDWR);
+}
+
+void send_queued(Player* player) {
+  while (player->out.size > 0) {
+    iovec iov[2];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ring_iov(&player->out, iov);
+    ssize_t sent = sendmsg(player->socket_player, &msg, MSG_NOSIGNAL);
+    player->room->send_calls++;
+    count_metric(COUNTER_SEND_CALLS);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) cut_player(player);
+      break;
     }
+    count_metric(COUNTER_BYTES_SENT, sent);
+    ring_consume(&player->out, sent);
+  }
+}
+
+void catch_up(Player* player);
+
+void flush_player(Player* player) {
+  send_queued(player);
+  if (player->behind_ns != 0 && player->out.size <= PLAYER_OUT_LOW_WATER) {
+    catch_up(player);
+    send_queued(player);
+  }
+  update_events(player);
+}
+
+// Buffers come from a per-worker free list and go back to it, so a worker
+// with spectators stops allocating once it has as many as it ever has
+// in flight.
+SharedBuffer* create_shared_buffer(Worker* worker, const string& frames) {
+  SharedBuffer* buffer;
+  if (worker->spare_buffers.empty()) {
+    buffer = new SharedBuffer;
+  } else {
+    buffer = worker->spare_buffers.back();
+    worker->spare_buffers.pop_back();
   }
-  *room_index = -1;
+  buffer->refs = 0;
+  buffer->size = frames.size();
+  memcpy(buffer->data, frames.data(), frames.size());
+  return buffer;
 }
 
-void send_message(int socket_fd, MessageType type, const string& text) {
-  Message msg;
-  msg.type = type;
-  strncpy(msg.text, text.c_str(), MESSAGE_SIZE - 1);
-  msg.text[MESSAGE_SIZE - 1] = '\0';
-  send(socket_fd, &msg, sizeof(Message), 0);
+void release_buffer(Worker* worker, SharedBuffer* buffer) {
+  if (--buffer->refs == 0) worker->spare_buffers.push_back(buffer);
 }
 
-void join_room(Room* room, int socket_player) {
-  Player player;
-  player.socket_player = socket_player;
-  player.points = 0;
-  player.envido_points = 0;
-  player.has_flor = false;
-  
-  room->players.push_back(player);
-  room->total_players++;
-  
-  send_message(socket_player, MSG_ROOM_JOIN, "Você entrou na sala!\n");
+SharedBuffer* queue_front(Spectator* spectator) {
+  return spectator->queue[spectator->queue_head];
 }
 
-void start_room_round(Room* room) {
-  sem_post(&room->start_round);
+SharedBuffer* queue_at(Spectator* spectator, int index) {
+  return spectator->queue[(spectator->queue_head + index) % SPECTATOR_QUEUE_SLOTS];
 }
 
-string get_random_card(vector<string>& used_cards) {
-  const string suits[] = {"C", "E", "P", "O"}; 
-  const string values[] = {"4", "5", "6", "7", "J", "Q", "K", "A", "2", "3"}; 
-  
-  string card;
-  do {
-    string value = values[rand() % 10];
-    string suit = suits[rand() % 4];
-    card = value + suit;
-  } while (find(used_cards.begin(), used_cards.end(), card) != used_cards.end());
-  
-  used_cards.push_back(card);
-  return card;
+bool queue_fits(Spectator* spectator, SharedBuffer* buffer) {
+  return spectator->queue_count < SPECTATOR_QUEUE_SLOTS &&
+         spectator->queued_bytes + buffer->size <= SPECTATOR_MAX_QUEUED_BYTES;
 }
 
-void deal_cards(Room* room) {
-  vector<string> used_cards;
-  
-  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-    room->players[i].hand.cards.clear();
-    room->players[i].hand.cards_already_played.clear();
-    
-    for (int j = 0; j < 3; j++) {
-      string card = get_random_card(used_cards);
-      room->players[i].hand.cards.push_back(card);
-    }
-  }
-}
-
-int calculate_envido(vector<string>& cards) {
-  map<char, vector<int>> suits_map;
-  
-  for (const string& card : cards) {
-    char suit = card[card.length() - 1];
-    int value = 0;
-    
-    if (card[0] == 'A') value = 1;
-    else if (card[0] >= '2' && card[0] <= '7') value = card[0] - '0';
-    else value = 0;
-    
-    suits_map[suit].push_back(value);
-  }
-  
-  int max_envido = 0;
-  for (auto& pair : suits_map) {
-    if (pair.second.size() >= 2) {
-      sort(pair.second.rbegin(), pair.second.rend());
-      int envido = 20 + pair.second[0] + pair.second[1];
-      max_envido = max(max_envido, envido);
-    } else if (pair.second.size() == 1) {
-      max_envido = max(max_envido, pair.second[0]);
-    }
-  }
-  
-  return max_envido;
-}
-
-bool check_flor(vector<string>& cards) {
-  if (cards.size() < 3) return false;
-  
-  char first_suit = cards[0][cards[0].length() - 1];
-  for (size_t i = 1; i < cards.size(); i++) {
-    if (cards[i][cards[i].length() - 1] != first_suit) {
+void enqueue_buffer(Spectator* spectator, SharedBuffer* buffer) {
+  buffer->refs++;
+  spectator->queue[(spectator->queue_head + spectator->queue_count) % SPECTATOR_QUEUE_SLOTS] = buffer;
+  spectator->queue_count++;
+  spectator->queued_bytes += buffer->size;
+}
+
+void drop_spectator(Spectator* spectator) {
+  Room* room = spectator->room;
+  Worker* worker = room->worker;
+  epoll_ctl(worker->spectator_epoll_fd, EPOLL_CTL_DEL, spectator->socket, nullptr);
+  close(spectator->socket);
+  for (int i = 0; i < spectator->queue_count; i++) {
+    release_buffer(worker, queue_at(spectator, i));
+  }
+  room->spectators.erase(find(room->spectators.begin(), room->spectators.end(), spectator));
+  delete spectator;
+}
+
+void update_spectator_events(Spectator* spectator) {
+  bool want_write = spectator->queue_count > 0;
+  if (want_write == spectator->want_write) return;
+
+  epoll_event ev;
+  ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+  ev.data.ptr = spectator;
+  epoll_ctl(spectator->room->worker->spectator_epoll_fd, EPOLL_CTL_MOD, spectator->socket, &ev);
+  spectator->want_write = want_write;
+}
+
+// Sends as much of the queue as the socket takes in one sendmsg per pass.
+// Returns false once the spectator is gone.
+bool flush_spectator(Spectator* spectator) {
+  Worker* worker = spectator->room->worker;
+  while (spectator->queue_count > 0) {
+    iovec iov[SPECTATOR_IOV];
+    int count = min(spectator->queue_count, SPECTATOR_IOV);
+    size_t offset = spectator->offset;
+    for (int i = 0; i < count; i++) {
+      SharedBuffer* buffer = queue_at(spectator, i);
+      iov[i].iov_base = buffer->data + offset;
+      iov[i].iov_len = buffer->size - offset;
+      offset = 0;
+    }
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t sent = sendmsg(spectator->socket, &msg, MSG_NOSIGNAL);
+    count_metric(COUNTER_SEND_CALLS);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
       return false;
     }
+    count_metric(COUNTER_BYTES_SENT, sent);
+
+    spectator->queued_bytes -= sent;
+    while (sent > 0) {
+      SharedBuffer* front = queue_front(spectator);
+      size_t left = front->size - spectator->offset;
+      if ((size_t)sent < left) {
+        spectator->offset += sent;
+        break;
+      }
+      sent -= left;
+      spectator->offset = 0;
+      spectator->queue_head = (spectator->queue_head + 1) % SPECTATOR_QUEUE_SLOTS;
+      spectator->queue_count--;
+      release_buffer(worker, front);
+    }
   }
+  update_spectator_events(spectator);
   return true;
 }
 
-void send_scoreboard(Room* room) {
-  string scoreboard = "\n=== PLACAR ===\n";
-  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-    scoreboard += "Jogador " + to_string(i) + ": " + to_string(room->players[i].points) + " pontos\n";
+// Frames for one spectator alone, such as the snapshot it starts from.
+void queue_private_frames(Spectator* spectator, const string& frames) {
+  enqueue_buffer(spectator, create_shared_buffer(spectator->room->worker, frames));
+}
+
+void queue_public_snapshot(Spectator* spectator) {
+  SnapshotPayload snapshot;
+  game_public_snapshot(&spectator->room->game, &snapshot);
+  string* frames = &spectator->room->worker->scratch;
+  frames->clear();
+  append_frame(frames, MSG_SNAPSHOT, &snapshot, sizeof(snapshot));
+  queue_private_frames(spectator, *frames);
+}
+
+// A spectator too far behind loses whatever it has queued and starts over
+// from a snapshot of the table as it is now. The buffer it is halfway
+// through is finished first so the stream stays framed. One that keeps
+// falling behind is dropped.
+void skip_ahead(Spectator* spectator) {
+  if (++spectator->skips > SPECTATOR_MAX_SKIPS) {
+    count_metric(COUNTER_SPECTATOR_DROPS);
+    drop_spectator(spectator);
+    return;
   }
-  scoreboard += "\n";
-  
-  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-    send_message(room->players[i].socket_player, MSG_SCOREBOARD, scoreboard);
+  count_metric(COUNTER_SPECTATOR_SKIPS);
+
+  int keep = spectator->offset > 0 ? 1 : 0;
+  while (spectator->queue_count > keep) {
+    SharedBuffer* buffer = queue_at(spectator, --spectator->queue_count);
+    spectator->queued_bytes -= buffer->size;
+    release_buffer(spectator->room->worker, buffer);
   }
+  queue_public_snapshot(spectator);
 }
 
-void send_hand(Player* player, const string played_cards[], int cards_played) {
-  string full_msg = "\n=== MESA ===\n";
-  if (cards_played == 0) {
-    full_msg += "(vazia)\n";
-  } else {
-    for (int i = 0; i < cards_played; i++) {
-      full_msg += "Jogador " + to_string(i) + ": " + played_cards[i] + "\n";
-    }
+// The snapshot skip_ahead() queues already covers the frames that would
+// not fit, so a skipping spectator never gets them.
+void queue_broadcast(Room* room, SharedBuffer* buffer) {
+  buffer->refs++;
+  for (size_t i = room->spectators.size(); i-- > 0;) {
+    Spectator* spectator = room->spectators[i];
+    if (queue_fits(spectator, buffer)) enqueue_buffer(spectator, buffer);
+    else skip_ahead(spectator);
+  }
+  release_buffer(room->worker, buffer);
+}
+
+// Spectators are only written to after the players, and never block.
+void flush_spectators(Room* room) {
+  for (size_t i = room->spectators.size(); i-- > 0;) {
+    Spectator* spectator = room->spectators[i];
+    if (spectator->want_write || spectator->queue_count == 0) continue;
+    if (!flush_spectator(spectator)) drop_spectator(spectator);
   }
-  full_msg += "\n=== SUAS CARTAS ===\n";
-  
-  for (size_t i = 0; i < player->hand.cards.size(); i++) {
-    bool played = find(player->hand.cards_already_played.begin(), 
-                      player->hand.cards_already_played.end(), i) != 
-                  player->hand.cards_already_played.end();
-    
-    if (!played) {
-      full_msg += to_string(i + 1) + ". " + player->hand.cards[i] + "\n";
+}
+
+// Spectators have nothing to say; anything they send is read and dropped.
+bool drain_spectator(Spectator* spectator) {
+  uint8_t buf[MAX_FRAME_SIZE];
+  while (true) {
+    ssize_t bytes = recv(spectator->socket, buf, sizeof(buf), 0);
+    count_metric(COUNTER_RECV_CALLS);
+    if (bytes == 0) return false;
+    if (bytes < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK;
     }
   }
-  full_msg += "\n";
+}
 
-  send_message(player->socket_player, MSG_HAND, full_msg);
+void service_spectators(Worker* worker) {
+  epoll_event events[WORKER_EVENTS];
+  int ready = epoll_wait(worker->spectator_epoll_fd, events, WORKER_EVENTS, 0);
+  for (int i = 0; i < ready; i++) {
+    Spectator* spectator = (Spectator*)events[i].data.ptr;
+    bool alive = !(events[i].events & (EPOLLHUP | EPOLLERR));
+    if (alive && (events[i].events & EPOLLIN)) alive = drain_spectator(spectator);
+    if (alive && (events[i].events & EPOLLOUT)) alive = flush_spectator(spectator);
+    if (!alive) drop_spectator(spectator);
+  }
 }
 
-int compare_cards(const string& card1, const string& card2) {
-  int rank1 = get_card_rank(card1);
-  int rank2 = get_card_rank(card2);
-  
-  if (rank1 > rank2) return 0;
-  if (rank2 > rank1) return 1;
-  return -1;
+// A player whose unsent frames pass PLAYER_OUT_HIGH_WATER is behind: new
+// frames are dropped instead of queued, so the room never waits on it and
+// its memory stays bounded. Once it has read its way down to
+// PLAYER_OUT_LOW_WATER it is caught up with a snapshot. One still behind
+// after PLAYER_MAX_BEHIND_MS is disconnected, which holds its seat for a
+// resume like any other drop.
+void fall_behind(Player* player) {
+  uint64_t now = clock_ns();
+  if (player->behind_ns == 0) {
+    count_metric(COUNTER_PLAYER_SKIPS);
+    player->behind_ns = now;
+  } else if (now - player->behind_ns >= (uint64_t)PLAYER_MAX_BEHIND_MS * 1000000) {
+    count_metric(COUNTER_PLAYER_DROPS);
+    player->behind_ns = 0;
+    cut_player(player);
+  }
 }
 
-void *room_thread(void* arg) {
-  Room* room = (Room*)arg;
-  srand(time(nullptr));
+// Frames are only queued here. Everything produced while handling one event
+// goes out together in flush_room(), one send() per socket.
+void send_message(Player* player, MessageType type, const void* payload, uint8_t length) {
+  if (player->socket_player < 0) return;
 
-  while (1) {
-    sem_wait(&room->start_round);
-    cout << "Starting game in room with " << room->total_players << " players." << endl;
+  uint32_t size = FRAME_HEADER_SIZE + length;
+  if (player->behind_ns != 0 || player->out.size + size > PLAYER_OUT_HIGH_WATER) {
+    fall_behind(player);
+    return;
+  }
+  uint8_t header[FRAME_HEADER_SIZE] = {length, (uint8_t)type};
+  ring_write(&player->out, header, FRAME_HEADER_SIZE);
+  ring_write(&player->out, payload, length);
+  count_message(type, size);
+}
 
-    for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-      room->players[i].points = 0;
+void flush_room(Room* room) {
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    Player* player = &room->players[i];
+    if (player->socket_player >= 0 && (player->out.size > 0 || player->behind_ns != 0)) {
+      flush_player(player);
     }
-    
-    int first_player = 0; 
-    while (true) {
-      deal_cards(room);
+  }
+  flush_spectators(room);
+}
 
-      for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-        room->players[i].envido_points = calculate_envido(room->players[i].hand.cards);
-        room->players[i].has_flor = check_flor(room->players[i].hand.cards);
-      }
-      
-      send_scoreboard(room);
-
-      string empty_table[TOTAL_PER_ROOM];
-      for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-        send_hand(&room->players[i], empty_table, 0);
-        if (room->players[i].has_flor) {
-          send_message(room->players[i].socket_player, MSG_TEXT, "VOCÊ TEM FLOR!\n");
-        }
-      }
-      
-      TrucoState truco_state = {1, false, false, false, -1};
-      EnvidoState envido_state = {false, false, false, 0, -1};
-      
-      int rounds_won[TOTAL_PER_ROOM] = {0, 0};
-      int current_player = first_player;
-      bool first_round = true;
-      bool hand_finished = false;
-
-      for (int round = 0; round < 3 && !hand_finished; round++) {
-        string played_cards[TOTAL_PER_ROOM];
-        int card_indices[TOTAL_PER_ROOM];
-        int cards_played = 0;
-        
-        for (int turn = 0; turn < TOTAL_PER_ROOM && !hand_finished; turn++) {
-          send_hand(&room->players[current_player], played_cards, cards_played);
-          
-          send_message(room->players[current_player].socket_player, MSG_YOUR_TURN, 
-                      "Sua vez! Digite:\n- Número da carta (1-3)\n- 'T' para Truco\n- 'E' para Envido (só 1ª rodada)\n");
-          
-          Message response;
-          recv(room->players[current_player].socket_player, &response, sizeof(Message), 0);
-          
-          string input = response.text;
-
-          if (first_round && (input == "E" || input == "e")) {
-            int opponent = (current_player == 0) ? 1 : 0;
-            int new_envido_value = 2;
-            string envido_name = "ENVIDO";
-            
-            if (!envido_state.envido_called) {
-              envido_state.envido_called = true;
-              new_envido_value = 2;
-            } else if (!envido_state.real_envido_called) {
-              envido_state.real_envido_called = true;
-              new_envido_value = envido_state.envido_value + 3; 
-              envido_name = "REAL ENVIDO";
-            } else if (!envido_state.falta_envido_called) {
-              envido_state.falta_envido_called = true;
-              new_envido_value = WIN_SCORE - room->players[opponent].points;
-              envido_name = "FALTA ENVIDO";
-            } else {
-              send_message(room->players[current_player].socket_player, MSG_TEXT, 
-                          "Envido já está no máximo! Jogue uma carta.\n");
-              turn--;
-              continue;
-            }
-
-            string envido_msg = "💎 Jogador " + to_string(current_player) + " cantou " + envido_name + "!\n";
-            for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-              send_message(room->players[i].socket_player, MSG_TEXT, envido_msg);
-            }
-
-            send_message(room->players[opponent].socket_player, MSG_YOUR_TURN, 
-                        "Aceitar? Digite:\n- 'S' para aceitar\n- 'N' para correr\n- 'E' para aumentar\n");
-            
-            Message envido_response;
-            recv(room->players[opponent].socket_player, &envido_response, sizeof(Message), 0);
-            string resp = envido_response.text;
-            
-            if (resp == "N" || resp == "n") {
-              room->players[current_player].points += 1;
-              
-              string run_msg = "Jogador " + to_string(opponent) + " não quis! Jogador " + 
-                             to_string(current_player) + " ganha 1 ponto.\n";
-              for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-                send_message(room->players[i].socket_player, MSG_TEXT, run_msg);
-              }
-              
-              send_scoreboard(room);
-            } else if (resp == "E" || resp == "e") {
-              send_message(room->players[opponent].socket_player, MSG_TEXT, 
-                          "Você aumentou o Envido! Voltando...\n");
-              turn--;
-              current_player = opponent;
-              continue;
-            } else {
-              envido_state.envido_value = new_envido_value;
-              
-              int envido_p0 = room->players[0].envido_points;
-              int envido_p1 = room->players[1].envido_points;
-              
-              string compare_msg = "🔍 Comparando Envido:\n";
-              compare_msg += "Jogador 0: " + to_string(envido_p0) + " pontos\n";
-              compare_msg += "Jogador 1: " + to_string(envido_p1) + " pontos\n";
-              
-              int envido_winner;
-              if (envido_p0 > envido_p1) {
-                envido_winner = 0;
-              } else if (envido_p1 > envido_p0) {
-                envido_winner = 1;
-              } else {
-                envido_winner = first_player;
-                compare_msg += "(Empate - mão ganha)\n";
-              }
-              
-              room->players[envido_winner].points += envido_state.envido_value;
-              compare_msg += "Jogador " + to_string(envido_winner) + " venceu e ganhou " + 
-                           to_string(envido_state.envido_value) + " pontos!\n";
-              
-              for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-                send_message(room->players[i].socket_player, MSG_TEXT, compare_msg);
-              }
-              
-              send_scoreboard(room);
-
-              if (room->players[envido_winner].points >= WIN_SCORE) {
-                string winner_msg = "\n🏆 JOGADOR " + to_string(envido_winner) + " VENCEU O JOGO COM ENVIDO! 🏆\n";
-                for (int j = 0; j < TOTAL_PER_ROOM; j++) {
-                  send_message(room->players[j].socket_player, MSG_WINNER, winner_msg);
-                }
-                
-                for (int j = 0; j < TOTAL_PER_ROOM; j++) {
-                  close(room->players[j].socket_player);
-                }
-                
-                room->total_players = 0;
-                room->players.clear();
-                goto game_over;
-              }
-            }
-            
-            turn--;
-            continue;
-          }
-
-          if (input == "T" || input == "t") {
-            int opponent = (current_player == 0) ? 1 : 0;
-            int new_value = truco_state.hand_value;
-            string raise_name;
-
-            if (!truco_state.truco_called) {
-              new_value = 2;
-              raise_name = "TRUCO";
-              truco_state.truco_called = true;
-            } else if (!truco_state.retruco_called) {
-              new_value = 3;
-              raise_name = "RETRUCO";
-              truco_state.retruco_called = true;
-            } else if (!truco_state.vale4_called) {
-              new_value = 4;
-              raise_name = "VALE 4";
-              truco_state.vale4_called = true;
-            } else {
-              send_message(room->players[current_player].socket_player, MSG_TEXT, 
-                          "Já está no máximo (Vale 4)! Jogue uma carta.\n");
-              turn--;
-              continue;
-            }
-
-            string truco_msg = "🔥 Jogador " + to_string(current_player) + " pediu " + raise_name + 
-                             " (vale " + to_string(new_value) + " pontos)!\n";
-            for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-              send_message(room->players[i].socket_player, MSG_TEXT, truco_msg);
-            }
-            
-            send_message(room->players[opponent].socket_player, MSG_YOUR_TURN, 
-                        "Aceitar? Digite:\n- 'S' para aceitar\n- 'N' para correr\n- 'T' para aumentar\n");
-            
-            Message truco_response;
-            recv(room->players[opponent].socket_player, &truco_response, sizeof(Message), 0);
-            string resp = truco_response.text;
-            
-            if (resp == "N" || resp == "n") {
-              room->players[current_player].points += truco_state.hand_value;
-              
-              string run_msg = "Jogador " + to_string(opponent) + " correu! Jogador " + 
-                             to_string(current_player) + " ganha " + 
-                             to_string(truco_state.hand_value) + " ponto(s)!\n";
-              for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-                send_message(room->players[i].socket_player, MSG_TEXT, run_msg);
-              }
-              
-              hand_finished = true;
-              break;
-            } else if (resp == "T" || resp == "t") {
-              send_message(room->players[opponent].socket_player, MSG_TEXT, 
-                          "Você aumentou! Voltando para o adversário...\n");
-              turn--;
-              current_player = opponent;
-              continue;
-            } else {
-              truco_state.hand_value = new_value;
-              truco_state.last_raiser = current_player;
-              
-              string accept_msg = "Jogador " + to_string(opponent) + " aceitou! Mão vale " + 
-                                to_string(new_value) + " ponto(s).\n";
-              for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-                send_message(room->players[i].socket_player, MSG_TEXT, accept_msg);
-              }
-            }
-            
-            turn--;
-            continue;
-          }
-
-          int card_choice = atoi(input.c_str()) - 1;
-          
-          if (card_choice < 0 || card_choice >= 3) {
-            send_message(room->players[current_player].socket_player, MSG_TEXT, 
-                        "Carta inválida! Escolha 1, 2 ou 3.\n");
-            turn--;
-            continue;
-          }
-
-          if (find(room->players[current_player].hand.cards_already_played.begin(),
-                  room->players[current_player].hand.cards_already_played.end(), 
-                  card_choice) != room->players[current_player].hand.cards_already_played.end()) {
-            send_message(room->players[current_player].socket_player, MSG_TEXT, 
-                        "Você já jogou essa carta!\n");
-            turn--;
-            continue;
-          }
-          
-          room->players[current_player].hand.cards_already_played.push_back(card_choice);
-          played_cards[current_player] = room->players[current_player].hand.cards[card_choice];
-          card_indices[current_player] = card_choice;
-          cards_played++;
-
-          for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-            send_hand(&room->players[i], played_cards, cards_played);
-          }
-          
-          current_player = (current_player == 0) ? 1 : 0;
-        }
-        
-        first_round = false;
-
-        int round_winner = compare_cards(played_cards[0], played_cards[1]);
-        
-        if (round_winner != -1) {
-          rounds_won[round_winner]++;
-          current_player = round_winner;
-          
-          string msg = "Jogador " + to_string(round_winner) + " venceu a rodada!\n";
-          for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-            send_message(room->players[i].socket_player, MSG_TEXT, msg);
-          }
-
-          if (rounds_won[round_winner] == 2) {
-            room->players[round_winner].points += truco_state.hand_value;
-            
-            string winner_msg = "Jogador " + to_string(round_winner) + 
-                              " venceu a mão e ganhou " + to_string(truco_state.hand_value) + " ponto(s)!\n";
-            for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-              send_message(room->players[i].socket_player, MSG_TEXT, winner_msg);
-            }
-            break;
-          }
-        } else {
-          string msg = "Rodada empatada!\n";
-          for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-            send_message(room->players[i].socket_player, MSG_TEXT, msg);
-          }
-        }
-      }
+template <typename T>
+void send_message(Player* player, MessageType type, const T& payload) {
+  send_message(player, type, &payload, sizeof(T));
+}
 
-      if (rounds_won[0] == rounds_won[1]) {
-        room->players[first_player].points += truco_state.hand_value;
-        
-        string msg = "Empate total! Jogador " + to_string(first_player) + 
-                   " (que começou) venceu a mão!\n";
-        for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-          send_message(room->players[i].socket_player, MSG_TEXT, msg);
-        }
-      }
-      
-      send_scoreboard(room);
-      for (int i = 0; i < TOTAL_PER_ROOM; i++) {
-        if (room->players[i].points >= WIN_SCORE) {
-          string winner_msg = "\n🏆 JOGADOR " + to_string(i) + " VENCEU O JOGO! 🏆\n";
-          for (int j = 0; j < TOTAL_PER_ROOM; j++) {
-            send_message(room->players[j].socket_player, MSG_WINNER, winner_msg);
-          }
-
-          for (int j = 0; j < TOTAL_PER_ROOM; j++) {
-            close(room->players[j].socket_player);
-          }
-          
-          room->total_players = 0;
-          room->players.clear();
-          goto game_over;
-        }
-      }
+void send_notice(Player* player, NoticeCode code) {
+  NoticePayload notice = {(uint8_t)code};
+  send_message(player, MSG_NOTICE, notice);
+}
+
+// The room's one timer is the deadline of the turn in progress while it
+// plays, and the limit on flushing its last frames while it closes.
+void arm_timer(Room* room, TimerNode* node, uint64_t delay_ms) {
+  TimerWheel* wheel = &room->worker->wheel;
+  uint64_t ticks = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  timer_schedule(wheel, node, timer_tick(clock_ns()) + ticks);
+}
+
+void arm_room_timer(Room* room, uint64_t delay_ms) {
+  arm_timer(room, &room->turn_timer, delay_ms);
+}
+
+// A new prompt restarts the clock; one repeated for a RESYNC does not, or
+// resyncing would be a way to stall forever.
+void prompt_player(Room* room, Player* player) {
+  if (player->prompted_ns != 0) return;
+
+  player->prompted_ns = clock_ns();
+  if (player->bot || turn_timeout_ms <= 0) timer_cancel(&room->worker->wheel, &room->turn_timer);
+  else arm_room_timer(room, turn_timeout_ms);
+}
 
-      first_player = (first_player == 0) ? 1 : 0;
+// A truco counts once per hand: for the caller when it is refused, or for
+// whoever wins a hand played for it.
+void tally_event(GameTally* tally, const GameEvent* event) {
+  if (event->opcode == MSG_ENVIDO_RESULT) {
+    const EnvidoResultPayload* result = (const EnvidoResultPayload*)event->payload;
+    if (!result->accepted) return;
+    tally->envidos_won[result->winner]++;
+    tally->envidos_lost[opponent_of(result->winner)]++;
+  } else if (event->opcode == MSG_TRUCO_RESULT) {
+    const TrucoResultPayload* result = (const TrucoResultPayload*)event->payload;
+    tally->truco_accepted = result->accepted;
+    if (result->accepted) return;
+    tally->trucos_won[opponent_of(result->seat)]++;
+    tally->trucos_lost[result->seat]++;
+  } else if (event->opcode == MSG_HAND_RESULT) {
+    const HandResultPayload* result = (const HandResultPayload*)event->payload;
+    if (tally->truco_accepted) {
+      tally->trucos_won[result->winner]++;
+      tally->trucos_lost[opponent_of(result->winner)]++;
     }
-    
-    game_over:
-    cout << "Game finished in room." << endl;
+    tally->truco_accepted = 0;
   }
-  
-  return nullptr;
 }
 
-void run_server() {
-  server_fd = init_main_socket();
-  Room rooms[MAX_ROOMS];
+// Handed to the rating thread after the pass, with the log records.
+void record_result(Room* room, int winner) {
+  if (!ratings_open || (!rating_named(room->players[0].name) && !rating_named(room->players[1].name))) return;
 
-  build_rooms(rooms);
+  GameResult result;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    memcpy(result.names[i], room->players[i].name, PLAYER_NAME_SIZE);
+    result.owners[i] = room->players[i].owner;
+  }
+  result.winner = winner;
+  result.tally = room->tally;
+  room->worker->results.push_back(result);
+}
 
-  while (true) {
-    if ((new_socket = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen)) < 0) {
-      perror("Accept failed");
-      exit(EXIT_FAILURE);
-    }
-  
-    int first_room_available = -1;
-    get_free_room(rooms, &first_room_available);
+// Makes a playing room visible to spectators.
+// A room handed over keeps its id, and new ids carry on after it.
+void open_table(Room* room) {
+  Worker* worker = room->worker;
+  if (room->table == 0) {
+    worker->next_table = (worker->next_table + 1) & TABLE_SEQUENCE_MASK;
+    if (worker->next_table == 0) worker->next_table = 1;
+    room->table = (uint32_t)(worker - workers + 1) << 24 | worker->next_table;
+  } else if ((room->table & TABLE_SEQUENCE_MASK) > worker->next_table) {
+    worker->next_table = room->table & TABLE_SEQUENCE_MASK;
+  }
+  worker->tables[room->table] = room;
 
-    if (first_room_available == -1) {
-      send(new_socket, NOT_AVAILABLE_MESSAGE, strlen(NOT_AVAILABLE_MESSAGE), 0);
-      close(new_socket);
-      continue;
-    }
-    
-    Room* room = &rooms[first_room_available];
-    join_room(room, new_socket);
+  uint32_t none = 0;
+  featured_table.compare_exchange_strong(none, room->table);
+}
 
-    if (is_room_full(room)) {
-      start_room_round(room);
-    }
+// A featured table that is over passes the feature to another table of
+// its worker, if there is one, or to the next table to start anywhere.
+void end_table(Room* room) {
+  Worker* worker = room->worker;
+  if (room->table == 0 || worker->tables.erase(room->table) == 0) return;
+
+  uint32_t table = room->table;
+  if (!featured_table.compare_exchange_strong(table, 0) || worker->tables.empty()) return;
+  uint32_t none = 0;
+  featured_table.compare_exchange_strong(none, worker->tables.begin()->first);
+}
+
+void close_table(Room* room) {
+  end_table(room);
+  while (!room->spectators.empty()) {
+    drop_spectator(room->spectators.back());
   }
+}
 
-  close(server_fd);
+// Score frames are addressed to each seat, so spectators get their own in
+// the same place, counted from what they were last told.
+void sync_spectator_score(Room* room, string* broadcast) {
+  Game* game = &room->game;
+  ScorePayload score;
+  bool changed = false;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    score.delta[i] = game->players[i].points - room->spectator_points[i];
+    room->spectator_points[i] = game->players[i].points;
+    changed |= score.delta[i] != 0;
+  }
+  if (changed && !room->spectators.empty()) append_frame(broadcast, MSG_SCORE, &score, sizeof(score));
 }
 
-int main() {
-  run_server();
-  return 0;
-}
\ No newline at end of file
+// Queues the events the last engine call produced. A game that is over
+// only has its last frames left to flush before the room closes. Public
+// frames are also gathered into one buffer shared by every spectator.
+void deliver_events(Room* room) {
+  Game* game = &room->game;
+  string* broadcast = &room->worker->broadcast;
+  for (int i = 0; i < game->event_count; i++) {
+    GameEvent* event = &game->events[i];
+    if (event->opcode == MSG_YOUR_TURN) {
+      prompt_player(room, &room->players[event->seat]);
+    } else if (event->opcode == MSG_DEAL) {
+      room->players[event->seat].queued_count = 0;
+    } else if (event->opcode == MSG_WINNER) {
+      log_event(room, LOG_GAME_END, event->payload[0], game->players[0].points, game->players[1].points,
+                game->hands);
+      record_result(room, event->payload[0]);
+      if (room->match != 0) {
+        send_notice(&room->players[event->payload[0]],
+                    room->match == 1 ? NOTICE_TOURNAMENT_WON : NOTICE_TOURNAMENT_ADVANCED);
+      }
+    } else {
+      tally_event(&room->tally, event);
+    }
+    for (int seat = 0; seat < TOTAL_PER_ROOM; seat++) {
+      if (event->seat == ALL_SEATS || event->seat == seat) {
+        send_message(&room->players[seat], (MessageType)event->opcode, event->payload, event->length);
+      }
+    }
+    if (event->opcode == MSG_SCORE) {
+      sync_spectator_score(room, broadcast);
+    } else if (event->seat == ALL_SEATS && !room->spectators.empty()) {
+      append_frame(broadcast, event->opcode, event->payload, event->length);
+    }
+  }
+  game->event_count = 0;
+
+  sync_spectator_score(room, broadcast);
+  if (!broadcast->empty()) {
+    queue_broadcast(room, create_shared_buffer(room->worker, *broadcast));
+    broadcast->clear();
+  }
+
+  if (game->phase == GAME_OVER && room->phase == ROOM_PLAYING) {
+    room->phase = ROOM_CLOSING;
+    end_table(room);
+    arm_room_timer(room, CLOSE_LINGER_MS);
+  }
+}
+
+// The frames a player missed while behind are replaced by a snapshot and,
+// if it is their move, the prompt again. A game already over has nothing
+// left to catch up with.
+void catch_up(Player* player) {
+  Room* room = player->room;
+  player->behind_ns = 0;
+  if (room->phase != ROOM_PLAYING) return;
+
+  GameAction resync = {MSG_RESYNC, NO_CARD};
+  game_act(&room->game, player->seat, resync);
+  deliver_events(room);
+}
+
+// A null entry seats a bot.
+void join_room(Room* room, const LobbyEntry* entry) {
+  Player* player = &room->players[room->total_players];
+  player->socket_player = entry ? entry->socket_player : -1;
+  player->bot = entry == nullptr;
+  if (entry) memcpy(player->name, entry->name, PLAYER_NAME_SIZE);
+  else memset(player->name, 0, PLAYER_NAME_SIZE);
+  player->owner = entry ? entry->owner : 0;
+  player->rating = entry ? entry->rating : RATING_DEFAULT;
+  player->prompted_ns = 0;
+  player->timeouts = 0;
+  player->secret = 0;
+  player->away_ns = 0;
+  init_timer_node(&player->grace_timer, room);
+  player->room = room;
+  player->seat = room->total_players;
+  player->in_start = 0;
+  player->in_len = 0;
+  player->queued_count = 0;
+  ring_clear(&player->out);
+  player->behind_ns = 0;
+  player->want_write = false;
+
+  room->total_players++;
+}
+
+uint64_t read_le(const uint8_t* bytes, int count) {
+  uint64_t value = 0;
+  for (int i = count - 1; i >= 0; i--) {
+    value = value << 8 | bytes[i];
+  }
+  return value;
+}
+
+// A session token is the table id, the seat and the seat's secret, little
+// endian. The table id routes a reconnect to the right worker.
+void write_token(uint8_t* token, uint32_t table, int seat, uint64_t secret) {
+  for (int i = 0; i < 4; i++) {
+    token[i] = table >> (8 * i);
+  }
+  token[4] = seat;
+  for (int i = 0; i < 8; i++) {
+    token[5 + i] = secret >> (8 * i);
+  }
+}
+
+TableRequest read_token(int socket, const uint8_t* token) {
+  TableRequest request = {socket, (uint32_t)read_le(token, 4), token[4], read_le(token + 5, 8)};
+  return request;
+}
+
+void send_room_join(Room* room, Player* player) {
+  RoomJoinPayload join;
+  join.version = PROTOCOL_VERSION;
+  join.seat = player->seat;
+  write_token(join.token, room->table, player->seat, player->secret);
+  send_message(player, MSG_ROOM_JOIN, join);
+}
+
+void assign_room(Room* room, Worker* worker) {
+  room->worker = worker;
+
+  pthread_mutex_lock(&worker->lock);
+  worker->incoming.push_back(room);
+  pthread_mutex_unlock(&worker->lock);
+  worker->wake_pending = true;
+}
+
+void start_room_round(Shard* shard, Room* room) {
+  Worker* worker = &shard->workers[shard->next_worker];
+  shard->next_worker = (shard->next_worker + 1) % shard->total_workers;
+  assign_room(room, worker);
+}
+
+void wake_workers(Shard* shard) {
+  for (int i = 0; i < shard->total_workers; i++) {
+    Worker* worker = &shard->workers[i];
+    if (!worker->wake_pending) continue;
+
+    uint64_t one = 1;
+    if (write(worker->wake_fd, &one, sizeof(one)) < 0) {
+      perror("Failed to wake worker");
+    }
+    worker->wake_pending = false;
+  }
+}
+
+// Whether a queued move answers the prompt the game is waiting on.
+bool answers_prompt(const Game* game, const GameAction& action) {
+  if (game->phase == GAME_AWAIT_PLAY) {
+    return action.type == MSG_PLAY_CARD || action.type == MSG_CALL_TRUCO || action.type == MSG_CALL_ENVIDO;
+  }
+  return action.type == MSG_ACCEPT || action.type == MSG_REJECT;
+}
+
+// Queued moves are made in order; one that does not answer the current
+// prompt waits, and everything behind it with it.
+bool take_queued(const Game* game, Player* player, GameAction* action) {
+  if (player->queued_count == 0 || !answers_prompt(game, player->queued[0])) return false;
+
+  *action = player->queued[0];
+  player->queued_count--;
+  memmove(player->queued, player->queued + 1, player->queued_count * sizeof(GameAction));
+  return true;
+}
+
+void defer_bot(Room* room) {
+  if (room->bot_deferred) return;
+  room->bot_deferred = true;
+  room->worker->deferred_bots.push_back(room);
+  count_metric(COUNTER_BOTS_DEFERRED);
+}
+
+// Bots and queued moves answer inline, so a human never waits on a bot
+// for longer than the decision budget, and a move sent early is made in
+// the same pass as the prompt it answers. Once the worker's bots have used
+// up this pass's share, the bot waits for the next pass.
+void play_ready(Room* room) {
+  Game* game = &room->game;
+  Worker* worker = room->worker;
+  int seat;
+  while ((seat = game_expected_seat(game)) >= 0) {
+    Player* player = &room->players[seat];
+    GameAction action;
+    if (player->bot) {
+      if (worker->bot_pass_ns >= BOT_PASS_BUDGET_NS) {
+        defer_bot(room);
+        return;
+      }
+      uint64_t start = clock_ns();
+      action = monte_carlo_decide(game, seat, &worker->rng, bot_budget_ns);
+      uint64_t spent = clock_ns() - start;
+      worker->bot_pass_ns += spent;
+      record_metric(HISTOGRAM_BOT_NS, spent);
+    } else if (take_queued(game, player, &action)) {
+      player->timeouts = 0;
+    } else {
+      return;
+    }
+
+    player->prompted_ns = 0;
+    log_action(room, seat, action);
+    game_act(game, seat, action);
+    deliver_events(room);
+  }
+}
+
+// Checks what can be checked before the player's turn: the opcode, and
+// that a card is still in hand and not queued already.
+void queue_action(Room* room, Player* player, const GameAction& action) {
+  NoticeCode notice = NOTICE_ACTION_QUEUED;
+  if (action.type == MSG_PLAY_CARD) {
+    const Hand* hand = &room->game.players[player->seat].hand;
+    if (action.slot >= HAND_SIZE) notice = NOTICE_INVALID_CARD;
+    else if (hand->played[action.slot]) notice = NOTICE_CARD_ALREADY_PLAYED;
+    for (int i = 0; i < player->queued_count; i++) {
+      if (player->queued[i].type == MSG_PLAY_CARD && player->queued[i].slot == action.slot) {
+        notice = NOTICE_CARD_ALREADY_PLAYED;
+      }
+    }
+  } else if (action.type != MSG_CALL_TRUCO && action.type != MSG_CALL_ENVIDO && action.type != MSG_ACCEPT &&
+             action.type != MSG_REJECT) {
+    notice = NOTICE_NOT_YOUR_TURN;
+  }
+  if (notice == NOTICE_ACTION_QUEUED && player->queued_count == PLAYER_MAX_QUEUED) notice = NOTICE_NOT_YOUR_TURN;
+
+  if (notice == NOTICE_ACTION_QUEUED) player->queued[player->queued_count++] = action;
+  send_notice(player, notice);
+}
+
+void start_game(Room* room) {
+  room->seed = next_random(&room->worker->rng);
+  room->phase = ROOM_PLAYING;
+  memset(&room->tally, 0, sizeof(room->tally));
+  room->log_id = log_event(room, LOG_GAME_START, 0, 0, 0, room->seed);
+  count_metric(COUNTER_ROOMS_STARTED);
+  open_table(room);
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    Player* player = &room->players[i];
+    if (!player->bot) player->secret = next_random(&room->worker->rng) | 1;
+    send_room_join(room, player);
+  }
+
+  cout << "Starting game in room with " << room->total_players << " players (seed "
+       << room->seed << ", table " << room->table << ")." << endl;
+
+  game_start(&room->game, room->seed);
+  deliver_events(room);
+  play_ready(room);
+}
+
+// Enough of the game to tell whether an action was taken: every accepted
+// action moves at least one of these, a refused one moves none.
+typedef struct {
+  int expected;
+  int phase;
+  int hands;
+  int round;
+  int cards_played;
+} GameProgress;
+
+GameProgress game_progress(const Game* game) {
+  GameProgress progress = {game_expected_seat(game), game->phase, game->hands, game->round, game->cards_played};
+  return progress;
+}
+
+bool game_moved(const GameProgress& before, const GameProgress& after) {
+  return before.expected != after.expected || before.phase != after.phase || before.hands != after.hands ||
+         before.round != after.round || before.cards_played != after.cards_played;
+}
+
+void handle_input(Room* room, int seat, const Frame& frame) {
+  room->actions++;
+  count_metric(COUNTER_ACTIONS);
+
+  // The shard checked the greeting before the player got a seat.
+  if (frame.opcode == MSG_HELLO) return;
+
+  Player* player = &room->players[seat];
+  const PlayCardPayload* play = frame_payload<PlayCardPayload>(frame);
+  GameAction action = {frame.opcode, play ? play->slot : (uint8_t)NO_CARD};
+  int expected = game_expected_seat(&room->game);
+  if (expected >= 0 && expected != seat && action.type != MSG_RESYNC) {
+    queue_action(room, player, action);
+    return;
+  }
+
+  if (action.type != MSG_RESYNC) log_action(room, seat, action);
+  GameProgress before = game_progress(&room->game);
+  game_act(&room->game, seat, action);
+
+  // Only an action the game took stops the clock. A refused one is prompted
+  // again under the deadline that was already running.
+  if (player->prompted_ns != 0 && seat == expected && game_moved(before, game_progress(&room->game))) {
+    record_metric(HISTOGRAM_THINK_NS, clock_ns() - player->prompted_ns);
+    player->prompted_ns = 0;
+    player->timeouts = 0;
+  }
+  deliver_events(room);
+  play_ready(room);
+}
+
+void drop_player(Player* player) {
+  epoll_ctl(player->room->worker->epoll_fd, EPOLL_CTL_DEL, player->socket_player, nullptr);
+  close(player->socket_player);
+  player->socket_player = -1;
+  player->queued_count = 0;
+  ring_clear(&player->out);
+  player->behind_ns = 0;
+}
+
+void forfeit_seat(Room* room, int seat) {
+  log_event(room, LOG_FORFEIT, seat, WIN_BY_DISCONNECT, 0, 0);
+  game_forfeit(&room->game, seat);
+  deliver_events(room);
+}
+
+// The game goes on without the player: turns that come up for them are
+// played by the server once the turn timeout passes, as for anyone who
+// does not answer.
+void hold_seat(Room* room, Player* player) {
+  count_metric(COUNTER_SEATS_HELD);
+  player->away_ns = clock_ns();
+  arm_timer(room, &player->grace_timer, resume_grace_ms);
+  send_notice(&room->players[opponent_of(player->seat)], NOTICE_OPPONENT_AWAY);
+}
+
+void handle_disconnect(Room* room, int seat) {
+  count_metric(COUNTER_DISCONNECTS);
+  drop_player(&room->players[seat]);
+  if (room->phase != ROOM_PLAYING) return;
+
+  if (resume_grace_ms > 0) hold_seat(room, &room->players[seat]);
+  else forfeit_seat(room, seat);
+}
+
+// A player who did not come back in time loses the game.
+void expire_seat(Room* room, TimerNode* node) {
+  for (int seat = 0; seat < TOTAL_PER_ROOM; seat++) {
+    if (node == &room->players[seat].grace_timer) forfeit_seat(room, seat);
+  }
+}
+
+// The player the game waits on let the deadline pass: the server plays for
+// them, or ends the game once they have missed TURN_TIMEOUT_LIMIT turns.
+void expire_turn(Room* room) {
+  Game* game = &room->game;
+  int seat = game_expected_seat(game);
+  if (seat < 0 || room->players[seat].bot) return;
+
+  Player* player = &room->players[seat];
+  player->prompted_ns = 0;
+  count_metric(COUNTER_TURN_TIMEOUTS);
+  if (++player->timeouts >= TURN_TIMEOUT_LIMIT) {
+    count_metric(COUNTER_TIMEOUT_FORFEITS);
+    log_event(room, LOG_FORFEIT, seat, WIN_BY_TIMEOUT, 0, 0);
+    game_forfeit(game, seat, WIN_BY_TIMEOUT);
+    deliver_events(room);
+    return;
+  }
+
+  send_notice(player, NOTICE_TURN_TIMEOUT);
+  GameAction action = timeout_policy(game, seat, &room->worker->rng);
+  log_action(room, seat, action);
+  game_act(game, seat, action);
+  deliver_events(room);
+  play_ready(room);
+}
+
+bool read_player(Player* player) {
+  Room* room = player->room;
+
+  while (room->phase != ROOM_CLOSING) {
+    // Only a partial frame is ever left over, so there is always room for
+    // a whole one once it is moved to the front.
+    if (sizeof(player->in_buf) - player->in_start - player->in_len < MAX_FRAME_SIZE) {
+      memmove(player->in_buf, player->in_buf + player->in_start, player->in_len);
+      player->in_start = 0;
+    }
+    uint8_t* end = player->in_buf + player->in_start + player->in_len;
+    ssize_t bytes = recv(player->socket_player, end, player->in_buf + sizeof(player->in_buf) - end, 0);
+    count_metric(COUNTER_RECV_CALLS);
+    if (bytes == 0) return false;
+    if (bytes < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    player->in_len += bytes;
+    count_metric(COUNTER_BYTES_RECEIVED, bytes);
+
+    // Frames are handled where they were received; the payload is never
+    // copied out of in_buf.
+    Frame frame;
+    size_t frame_size;
+    while (room->phase != ROOM_CLOSING &&
+           (frame_size = parse_frame(player->in_buf + player->in_start, player->in_len, &frame)) > 0) {
+      uint64_t start = clock_ns();
+      handle_input(room, player->seat, frame);
+      record_metric(HISTOGRAM_TURN_NS, clock_ns() - start);
+      player->in_start += frame_size;
+      player->in_len -= frame_size;
+    }
+    if (player->in_len == 0) player->in_start = 0;
+  }
+
+  return true;
+}
+
+bool room_drained(Room* room) {
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    if (room->players[i].socket_player >= 0 && room->players[i].out.size > 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void enter_tournament(int socket, int match, const char* name, uint64_t owner, int rating) {
+  TournamentArrival arrival = {socket, match, {}, owner, rating};
+  memcpy(arrival.name, name, PLAYER_NAME_SIZE);
+  pthread_mutex_lock(&tournament.lock);
+  tournament.inbox.push_back(arrival);
+  pthread_mutex_unlock(&tournament.lock);
+
+  uint64_t one = 1;
+  if (write(shards[0].wake_fd, &one, sizeof(one)) < 0) perror("Failed to wake shard");
+}
+
+// The winner of a bracket match keeps its connection for the next one,
+// unless the game was the final or its frames could not all be sent.
+void return_winner(Room* room) {
+  Player* winner = &room->players[room->game.winner];
+  int socket = -1;
+  if (room->match != 1 && winner->socket_player >= 0 && winner->out.size == 0) {
+    socket = winner->socket_player;
+    epoll_ctl(room->worker->epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+    winner->socket_player = -1;
+  }
+  enter_tournament(socket, room->match, winner->name, winner->owner, winner->rating);
+}
+
+void close_room(Room* room) {
+  timer_cancel(&room->worker->wheel, &room->turn_timer);
+  close_table(room);
+  if (room->match != 0) return_winner(room);
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    timer_cancel(&room->worker->wheel, &room->players[i].grace_timer);
+    if (room->players[i].socket_player >= 0) {
+      close(room->players[i].socket_player);
+      room->players[i].socket_player = -1;
+    }
+  }
+
+  count_metric(COUNTER_ROOMS_CLOSED);
+  cout << "Game finished in room (" << room->actions << " actions, " << room->send_calls
+       << " send calls)." << endl;
+  release_room(&room->worker->shard->room_pool, room);
+}
+
+// Spectators handed over with a room come with whatever the old server
+// still owed them; a game still under way adds a snapshot of the table.
+void resume_spectators(Room* room) {
+  for (size_t i = room->spectators.size(); i-- > 0;) {
+    Spectator* spectator = room->spectators[i];
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = spectator;
+    epoll_ctl(room->worker->spectator_epoll_fd, EPOLL_CTL_ADD, spectator->socket, &ev);
+    if (room->phase == ROOM_PLAYING) queue_public_snapshot(spectator);
+    if (!flush_spectator(spectator)) drop_spectator(spectator);
+  }
+}
+
+// A room handed over by the previous server picks its deadlines up where
+// they stood. prompted_ns and away_ns are CLOCK_MONOTONIC, which both
+// processes share. Its table keeps its id, and its spectators carry on
+// from a fresh snapshot.
+void resume_room(Room* room) {
+  resume_spectators(room);
+  if (room->phase == ROOM_CLOSING) {
+    arm_room_timer(room, CLOSE_LINGER_MS);
+    return;
+  }
+  open_table(room);
+
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    Player* player = &room->players[i];
+    if (player->away_ns == 0) continue;
+    uint64_t away_ms = (clock_ns() - player->away_ns) / 1000000;
+    arm_timer(room, &player->grace_timer, away_ms < (uint64_t)resume_grace_ms ? resume_grace_ms - away_ms : 0);
+  }
+
+  // A bot is only ever left to move when it was deferred.
+  int seat = game_expected_seat(&room->game);
+  if (seat >= 0 && room->players[seat].bot) defer_bot(room);
+  if (turn_timeout_ms <= 0 || seat < 0 || room->players[seat].bot) return;
+
+  uint64_t prompted_ns = room->players[seat].prompted_ns;
+  uint64_t waited_ms = prompted_ns ? (clock_ns() - prompted_ns) / 1000000 : 0;
+  arm_room_timer(room, waited_ms < (uint64_t)turn_timeout_ms ? turn_timeout_ms - waited_ms : 0);
+}
+
+// Best effort: the socket is closed right after either way.
+void refuse_connection(int socket, NoticeCode code) {
+  string frames;
+  NoticePayload notice = {(uint8_t)code};
+  append_frame(&frames, MSG_NOTICE, &notice, sizeof(notice));
+  send(socket, frames.data(), frames.size(), MSG_NOSIGNAL);
+  close(socket);
+}
+
+void attach_spectator(Worker* worker, const TableRequest& request) {
+  unordered_map<uint32_t, Room*>::iterator found = worker->tables.find(request.table);
+  if (found == worker->tables.end()) {
+    refuse_connection(request.socket, NOTICE_NO_TABLE);
+    return;
+  }
+
+  Room* room = found->second;
+  Spectator* spectator = new Spectator;
+  spectator->socket = request.socket;
+  spectator->room = room;
+  spectator->offset = 0;
+  spectator->queue_head = 0;
+  spectator->queue_count = 0;
+  spectator->queued_bytes = 0;
+  spectator->skips = 0;
+  spectator->want_write = false;
+  room->spectators.push_back(spectator);
+  count_metric(COUNTER_SPECTATORS);
+
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = spectator;
+  epoll_ctl(worker->spectator_epoll_fd, EPOLL_CTL_ADD, spectator->socket, &ev);
+
+  string* frames = &worker->scratch;
+  frames->clear();
+  RoomJoinPayload join = {PROTOCOL_VERSION, NO_SEAT};
+  append_frame(frames, MSG_ROOM_JOIN, &join, sizeof(join));
+  queue_private_frames(spectator, *frames);
+  queue_public_snapshot(spectator);
+  if (!flush_spectator(spectator)) drop_spectator(spectator);
+}
+
+// Rebinds a seat held for a dropped player to the new connection, which
+// starts over from ROOM_JOIN and a snapshot, like the first time.
+void resume_player(Worker* worker, const TableRequest& request) {
+  unordered_map<uint32_t, Room*>::iterator found = worker->tables.find(request.table);
+  Room* room = found == worker->tables.end() ? nullptr : found->second;
+  Player* player = room && request.seat < TOTAL_PER_ROOM ? &room->players[request.seat] : nullptr;
+  if (player == nullptr || player->bot || player->secret != request.secret) {
+    count_metric(COUNTER_REJECTS);
+    refuse_connection(request.socket, NOTICE_SESSION_EXPIRED);
+    return;
+  }
+
+  // The old connection may be dead without the server having noticed yet.
+  if (player->socket_player >= 0) drop_player(player);
+  timer_cancel(&worker->wheel, &player->grace_timer);
+  bool was_away = player->away_ns != 0;
+  player->away_ns = 0;
+  player->socket_player = request.socket;
+  player->in_start = 0;
+  player->in_len = 0;
+  player->want_write = false;
+  count_metric(COUNTER_SEATS_RESUMED);
+
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = player;
+  epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, player->socket_player, &ev);
+
+  send_room_join(room, player);
+  if (was_away) send_notice(&room->players[opponent_of(player->seat)], NOTICE_OPPONENT_BACK);
+  GameAction resync = {MSG_RESYNC, NO_CARD};
+  game_act(&room->game, player->seat, resync);
+  deliver_events(room);
+  flush_room(room);
+}
+
+void accept_rooms(Worker* worker) {
+  uint64_t count;
+  if (read(worker->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    perror("Failed to read worker wakeup");
+  }
+
+  // The lists trade places with the worker's empty ones, so their capacity
+  // is kept on both sides.
+  vector<Room*>* rooms = &worker->accepted;
+  vector<TableRequest>* requests = &worker->accepted_requests;
+  pthread_mutex_lock(&worker->lock);
+  rooms->swap(worker->incoming);
+  requests->swap(worker->incoming_requests);
+  pthread_mutex_unlock(&worker->lock);
+
+  for (Room* room : *rooms) {
+    for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+      Player* player = &room->players[i];
+      player->want_write = false;
+      if (player->bot || player->socket_player < 0) continue;
+
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = player;
+      epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, player->socket_player, &ev);
+    }
+    if (room->phase == ROOM_WAITING) start_game(room);
+    else resume_room(room);
+    flush_room(room);
+  }
+
+  for (const TableRequest& request : *requests) {
+    if (request.seat == NO_SEAT) attach_spectator(worker, request);
+    else resume_player(worker, request);
+  }
+  rooms->clear();
+  requests->clear();
+}
+
+// Called between epoll passes, when the thread holds no half-done work. A
+// thread that wakes up again after a failed handoff carries on as before.
+void park_thread(const atomic<bool>* pending) {
+  pthread_mutex_lock(&handoff_lock);
+  parked_threads++;
+  pthread_cond_broadcast(&handoff_cond);
+  while (pending->load(memory_order_acquire)) {
+    pthread_cond_wait(&handoff_cond, &handoff_lock);
+  }
+  parked_threads--;
+  pthread_mutex_unlock(&handoff_lock);
+}
+
+// Rooms are released only after the whole batch so that later events in it
+// never see a room the acceptor may already be refilling.
+void retire_room(Room* room, vector<Room*>* closed_rooms) {
+  room->phase = ROOM_CLOSED;
+  closed_rooms->push_back(room);
+  if (room->bot_deferred) {
+    vector<Room*>* deferred = &room->worker->deferred_bots;
+    deferred->erase(find(deferred->begin(), deferred->end(), room));
+    room->bot_deferred = false;
+  }
+}
+
+// Bots deferred from the last pass move first in this one's share.
+void play_deferred_bots(Worker* worker, vector<Room*>* closed_rooms) {
+  vector<Room*>* rooms = &worker->ready_bots;
+  rooms->swap(worker->deferred_bots);
+  for (Room* room : *rooms) {
+    room->bot_deferred = false;
+    play_ready(room);
+    flush_room(room);
+    if (room->phase == ROOM_CLOSING && room_drained(room)) retire_room(room, closed_rooms);
+  }
+  rooms->clear();
+}
+
+void* worker_thread(void* arg) {
+  Worker* worker = (Worker*)arg;
+  thread_metrics = worker->metrics;
+  epoll_event events[WORKER_EVENTS];
+  vector<Room*> closed_rooms;
+
+  while (1) {
+    bool woken = false;
+    int timeout = !worker->deferred_bots.empty() ? 0 : worker->wheel.pending ? TIMER_TICK_MS : -1;
+    int ready = epoll_wait(worker->epoll_fd, events, WORKER_EVENTS, timeout);
+    count_metric(COUNTER_EPOLL_WAITS);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait failed");
+      exit(EXIT_FAILURE);
+    }
+    worker->bot_pass_ns = 0;
+    play_deferred_bots(worker, &closed_rooms);
+
+    for (int i = 0; i < ready; i++) {
+      // New work is taken after the batch: a resumed player may take over a
+      // Player whose old socket still has events further down it.
+      if (events[i].data.ptr == nullptr) {
+        woken = true;
+        continue;
+      }
+      if (events[i].data.ptr == &worker->spectator_epoll_fd) {
+        service_spectators(worker);
+        continue;
+      }
+
+      Player* player = (Player*)events[i].data.ptr;
+      Room* room = player->room;
+      if (room->phase == ROOM_CLOSED || player->socket_player < 0) continue;
+
+      bool alive = true;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        alive = read_player(player);
+      }
+      // A closing room no longer reads, so a peer that died meanwhile is
+      // only noticed here; keepalive probes surface as EPOLLERR too.
+      if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+        alive = false;
+      }
+      if (alive && (events[i].events & EPOLLOUT)) {
+        flush_player(player);
+      }
+      if (!alive) {
+        handle_disconnect(room, player->seat);
+      }
+      flush_room(room);
+
+      if (room->phase == ROOM_CLOSING && room_drained(room)) {
+        retire_room(room, &closed_rooms);
+      }
+    }
+
+    // A room still closing when its timer fires has a peer that stopped
+    // reading; it is closed with whatever frames are left unsent.
+    timer_advance(&worker->wheel, timer_tick(clock_ns()), [&](TimerNode* node) {
+      Room* room = (Room*)node->owner;
+      if (room->phase == ROOM_PLAYING) {
+        if (node == &room->turn_timer) expire_turn(room);
+        else expire_seat(room, node);
+        flush_room(room);
+        if (room->phase != ROOM_CLOSING || !room_drained(room)) return;
+      } else if (room->phase != ROOM_CLOSING || node != &room->turn_timer) {
+        return;
+      }
+      retire_room(room, &closed_rooms);
+    });
+    if (woken) accept_rooms(worker);
+    queue_log_batch(worker);
+    queue_results(worker);
+
+    for (Room* room : closed_rooms) {
+      close_room(room);
+    }
+    closed_rooms.clear();
+
+    if (workers_parking.load(memory_order_acquire)) park_thread(&workers_parking);
+  }
+
+  return nullptr;
+}
+
+LobbyEntry* add_greeting(Shard* shard, int socket_player) {
+  epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.ptr = lobby_greet(&shard->lobby, socket_player);
+  epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, socket_player, &ev);
+  return (LobbyEntry*)ev.data.ptr;
+}
+
+// Only hangups are watched while waiting; anything the player types stays
+// in the socket buffer until the game starts.
+void wait_for_opponent(Shard* shard, LobbyEntry* entry) {
+  lobby_push(&shard->lobby, entry);
+  epoll_event ev;
+  ev.events = EPOLLRDHUP;
+  ev.data.ptr = entry;
+  epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, entry->socket_player, &ev);
+}
+
+// Both entries stay readable until lobby_recycle(), so their players are
+// seated before they are removed. match is the bracket match the room
+// plays, or 0.
+void pair_players(Shard* shard, LobbyEntry* first, LobbyEntry* second, int match) {
+  epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, first->socket_player, nullptr);
+  epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, second->socket_player, nullptr);
+
+  Room* room = acquire_room(&shard->room_pool);
+  room->match = match;
+  join_room(room, first);
+  join_room(room, second);
+  lobby_remove(&shard->lobby, first);
+  lobby_remove(&shard->lobby, second);
+  start_room_round(shard, room);
+}
+
+void match_player(Shard* shard, LobbyEntry* entry) {
+  LobbyEntry* waiting = lobby_match(&shard->lobby, rating_bucket(entry->rating), clock_ns());
+  if (waiting == nullptr) {
+    wait_for_opponent(shard, entry);
+    return;
+  }
+  pair_players(shard, waiting, entry, 0);
+}
+
+// Once the head of the queue has waited RATING_RELAX_MS with nobody near
+// its rating, it takes whoever is next in line, as lobby_match() would
+// give it the next arrival.
+void pair_relaxed(Shard* shard) {
+  Lobby* lobby = &shard->lobby;
+  uint64_t now = clock_ns();
+  while (lobby->head && lobby->head->next &&
+         now - lobby->head->joined_ns >= (uint64_t)RATING_RELAX_MS * 1000000) {
+    pair_players(shard, lobby->head, lobby->head->next, 0);
+  }
+}
+
+// Pairs everyone who has waited bot_wait_ms with a bot. The lobby is FIFO,
+// so only its head ever needs checking.
+void seat_bots(Shard* shard) {
+  Lobby* lobby = &shard->lobby;
+  uint64_t now = clock_ns();
+  while (lobby->head && now - lobby->head->joined_ns >= (uint64_t)bot_wait_ms * 1000000) {
+    LobbyEntry* waiting = lobby->head;
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, waiting->socket_player, nullptr);
+
+    Room* room = acquire_room(&shard->room_pool);
+    join_room(room, waiting);
+    join_room(room, nullptr);
+    lobby_remove(lobby, waiting);
+    count_metric(COUNTER_BOT_ROOMS);
+    start_room_round(shard, room);
+  }
+}
+
+uint64_t due_in_ms(uint64_t since_ns, int delay_ms, uint64_t now) {
+  uint64_t due = since_ns + (uint64_t)delay_ms * 1000000;
+  return due <= now ? 0 : (due - now + 999999) / 1000000;
+}
+
+string roster_key(const char* name) {
+  return string(name, strnlen(name, PLAYER_NAME_SIZE));
+}
+
+// Round 1 is the first; the final is round tournament.rounds.
+int match_round(int match) {
+  return tournament.rounds - (31 - __builtin_clz(match));
+}
+
+// Like wait_for_opponent(), but in the player's bracket slot rather than
+// the lobby, which must be empty.
+void wait_for_match(Shard* shard, LobbyEntry* entry, int slot) {
+  lobby_unlink(&shard->lobby, entry);
+  entry->greeted = true;
+  entry->slot = slot;
+  tournament.slots[slot].entry = entry;
+  epoll_event ev;
+  ev.events = EPOLLRDHUP;
+  ev.data.ptr = entry;
+  epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, entry->socket_player, &ev);
+}
+
+void finish_tournament(Shard* shard) {
+  TournamentSlot* champion = &tournament.slots[1];
+  tournament.running.store(false, memory_order_release);
+  double seconds = (clock_ns() - tournament.started_ns) / 1e9;
+  if (champion->state == SLOT_FILLED) {
+    cout << "Tournament won by " << roster_key(champion->name) << " after " << seconds << " s." << endl;
+  } else {
+    cout << "Tournament ended without a winner after " << seconds << " s." << endl;
+  }
+
+  LobbyEntry* entry = champion->entry;
+  if (entry) {
+    int socket = entry->socket_player;
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+    lobby_remove(&shard->lobby, entry);
+    refuse_connection(socket, NOTICE_TOURNAMENT_WON);
+  }
+  tournament.current.clear();
+  tournament.due.clear();
+}
+
+void report_match(int match, const string& result) {
+  cout << "Tournament round " << match_round(match) << ": " << result << "; " << tournament.current.size()
+       << " players left, " << tournament.playing << " matches playing." << endl;
+}
+
+// Fills slot match from its child slot, or with a bye if child is 0. A
+// winner already waiting moves up with it.
+void decide_match(Shard* shard, int match, int child) {
+  TournamentSlot* slot = &tournament.slots[match];
+  if (child == 0) {
+    slot->state = SLOT_BYE;
+    tournament.current.erase(roster_key(tournament.slots[2 * match].name));
+    tournament.current.erase(roster_key(tournament.slots[2 * match + 1].name));
+  } else {
+    TournamentSlot* winner = &tournament.slots[child];
+    TournamentSlot* loser = &tournament.slots[child ^ 1];
+    slot->state = SLOT_FILLED;
+    memcpy(slot->name, winner->name, PLAYER_NAME_SIZE);
+    slot->owner = winner->owner;
+    if (loser->state == SLOT_FILLED) tournament.current.erase(roster_key(loser->name));
+    tournament.current[roster_key(winner->name)] = match;
+    if (winner->entry) {
+      slot->entry = winner->entry;
+      slot->entry->slot = match;
+      winner->entry = nullptr;
+    }
+  }
+  if (match == 1) finish_tournament(shard);
+}
+
+// Starts, forfeits or passes on whatever match can be settled, then looks
+// at the match its winner plays next.
+void settle_match(Shard* shard, int match) {
+  TournamentSlot* slot = &tournament.slots[match];
+  TournamentSlot* first = &tournament.slots[2 * match];
+  TournamentSlot* second = &tournament.slots[2 * match + 1];
+  if (slot->state != SLOT_OPEN || slot->playing || first->state == SLOT_OPEN || second->state == SLOT_OPEN) {
+    return;
+  }
+
+  if (first->state == SLOT_BYE || second->state == SLOT_BYE) {
+    decide_match(shard, match, first->state == SLOT_BYE ? (second->state == SLOT_BYE ? 0 : 2 * match + 1) : 2 * match);
+  } else if (first->entry && second->entry) {
+    slot->playing = true;
+    tournament.playing++;
+    pair_players(shard, first->entry, second->entry, match);
+    return;
+  } else if (slot->ready_ns == 0) {
+    slot->ready_ns = clock_ns();
+    tournament.due.push_back(match);
+    return;
+  } else if (clock_ns() - slot->ready_ns >= (uint64_t)TOURNAMENT_NO_SHOW_MS * 1000000) {
+    int child = first->entry ? 2 * match : second->entry ? 2 * match + 1 : 0;
+    string result = child == 0 ? "neither " + roster_key(first->name) + " nor " + roster_key(second->name) + " showed up"
+                               : roster_key(tournament.slots[child].name) + " advances, " +
+                                     roster_key(tournament.slots[child ^ 1].name) + " did not show up";
+    decide_match(shard, match, child);
+    report_match(match, result);
+  } else {
+    return;
+  }
+  if (match > 1) settle_match(shard, match / 2);
+}
+
+// A new connection from a rostered player waits in its slot; one already
+// knocked out, or arriving after the final, goes to the lobby. The first
+// connection under a rostered name binds the slot to its secret, so the
+// name is refused with any other one, and while the player is connected
+// or playing its match a second connection is refused rather than taking
+// its place.
+void seat_rostered(Shard* shard, LobbyEntry* entry) {
+  unordered_map<string, int>::const_iterator it = tournament.current.find(roster_key(entry->name));
+  if (!tournament.running.load(memory_order_relaxed) || it == tournament.current.end()) {
+    match_player(shard, entry);
+    return;
+  }
+  int slot = it->second;
+  TournamentSlot* seat = &tournament.slots[slot];
+  if (seat->entry || tournament.slots[slot / 2].playing || (seat->owner != 0 && seat->owner != entry->owner)) {
+    int socket = entry->socket_player;
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+    lobby_remove(&shard->lobby, entry);
+    count_metric(COUNTER_REJECTS);
+    refuse_connection(socket, NOTICE_NAME_TAKEN);
+    return;
+  }
+  seat->owner = entry->owner;
+  wait_for_match(shard, entry, slot);
+  settle_match(shard, slot / 2);
+}
+
+void finish_match(Shard* shard, const TournamentArrival& arrival) {
+  int match = arrival.match;
+  TournamentSlot* slot = &tournament.slots[match];
+  slot->playing = false;
+  tournament.playing--;
+  int child = memcmp(tournament.slots[2 * match].name, arrival.name, PLAYER_NAME_SIZE) == 0 ? 2 * match : 2 * match + 1;
+  string result = roster_key(arrival.name) + " beat " + roster_key(tournament.slots[child ^ 1].name);
+  decide_match(shard, match, child);
+  if (match > 1) report_match(match, result);
+
+  if (arrival.socket >= 0) {
+    LobbyEntry* entry = add_greeting(shard, arrival.socket);
+    memcpy(entry->name, arrival.name, PLAYER_NAME_SIZE);
+    entry->owner = arrival.owner;
+    entry->rating = arrival.rating;
+    wait_for_match(shard, entry, match);
+  }
+  if (match > 1) settle_match(shard, match / 2);
+}
+
+void accept_tournament(Shard* shard) {
+  vector<TournamentArrival>* arrivals = &tournament.accepted;
+  pthread_mutex_lock(&tournament.lock);
+  arrivals->swap(tournament.inbox);
+  pthread_mutex_unlock(&tournament.lock);
+
+  for (const TournamentArrival& arrival : *arrivals) {
+    if (arrival.match != 0) {
+      finish_match(shard, arrival);
+      continue;
+    }
+    LobbyEntry* entry = add_greeting(shard, arrival.socket);
+    memcpy(entry->name, arrival.name, PLAYER_NAME_SIZE);
+    entry->owner = arrival.owner;
+    entry->rating = arrival.rating;
+    seat_rostered(shard, entry);
+  }
+  arrivals->clear();
+}
+
+// Matches join the queue as they become ready, so it is in deadline order;
+// ones that started or were settled meanwhile are skipped.
+void expire_no_shows(Shard* shard) {
+  uint64_t now = clock_ns();
+  while (!tournament.due.empty()) {
+    int match = tournament.due.front();
+    TournamentSlot* slot = &tournament.slots[match];
+    if (slot->state == SLOT_OPEN && !slot->playing &&
+        now - slot->ready_ns < (uint64_t)TOURNAMENT_NO_SHOW_MS * 1000000) {
+      break;
+    }
+    tournament.due.pop_front();
+    settle_match(shard, match);
+  }
+}
+
+uint64_t tournament_timeout(uint64_t now) {
+  while (!tournament.due.empty()) {
+    const TournamentSlot* slot = &tournament.slots[tournament.due.front()];
+    if (slot->state == SLOT_OPEN && !slot->playing) return due_in_ms(slot->ready_ns, TOURNAMENT_NO_SHOW_MS, now);
+    tournament.due.pop_front();
+  }
+  return UINT64_MAX;
+}
+
+// Seeds go where the standard bracket puts them, so the top seeds meet
+// last and get the byes when the roster is short of a power of two.
+void init_tournament() {
+  if (roster_path[0] == '\0' || tournament.running.load(memory_order_relaxed)) return;
+
+  ifstream in(roster_path);
+  if (!in) {
+    perror((string("Failed to open roster ") + roster_path).c_str());
+    exit(EXIT_FAILURE);
+  }
+  vector<string> names;
+  string line;
+  while (getline(in, line)) {
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    line.erase(0, line.find_first_not_of(" \t"));
+    if (line.empty()) continue;
+    if (line.size() > PLAYER_NAME_SIZE || !tournament.roster.insert(line).second) {
+      cerr << "Roster name too long or repeated: " << line << endl;
+      exit(EXIT_FAILURE);
+    }
+    names.push_back(line);
+  }
+  if (names.size() < 2) {
+    cerr << "A tournament needs at least two players." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  vector<int> order(1, 0);
+  while (order.size() < names.size()) {
+    vector<int> next;
+    for (int seed : order) {
+      next.push_back(seed);
+      next.push_back(order.size() * 2 - 1 - seed);
+    }
+    order.swap(next);
+  }
+  tournament.size = order.size();
+  tournament.rounds = 31 - __builtin_clz(tournament.size);
+  tournament.players = names.size();
+  tournament.playing = 0;
+  tournament.slots.assign(2 * tournament.size, TournamentSlot());
+  for (int i = 0; i < tournament.size; i++) {
+    TournamentSlot* leaf = &tournament.slots[tournament.size + i];
+    if (order[i] >= (int)names.size()) {
+      leaf->state = SLOT_BYE;
+      continue;
+    }
+    leaf->state = SLOT_FILLED;
+    memcpy(leaf->name, names[order[i]].data(), min(names[order[i]].size(), (size_t)PLAYER_NAME_SIZE));
+    tournament.current[names[order[i]]] = tournament.size + i;
+  }
+  pthread_mutex_init(&tournament.lock, nullptr);
+  tournament.started_ns = clock_ns();
+  tournament.running.store(true);
+
+  cout << "Tournament of " << tournament.players << " players over " << tournament.rounds << " rounds." << endl;
+  for (int match = tournament.size - 1; match >= 1; match--) {
+    settle_match(&shards[0], match);
+  }
+}
+
+// How long a shard may sleep before its oldest waiting player is due a
+// bot or will take anyone, or, on shard 0, a tournament match is due to be
+// forfeited; -1 when nothing is.
+int lobby_timeout(Shard* shard) {
+  const Lobby* lobby = &shard->lobby;
+  uint64_t now = clock_ns();
+  uint64_t timeout = UINT64_MAX;
+  if (lobby->head && bot_wait_ms >= 0) timeout = due_in_ms(lobby->head->joined_ns, bot_wait_ms, now);
+  if (lobby->head && lobby->head->next) {
+    timeout = min(timeout, due_in_ms(lobby->head->joined_ns, RATING_RELAX_MS, now));
+  }
+  if (shard->index == 0) timeout = min(timeout, tournament_timeout(now));
+  return timeout == UINT64_MAX ? -1 : (int)timeout;
+}
+
+// Runs on shard 0. Other shards publish their lobby size after every pass,
+// and their pools are read under the pool's own lock.
+void dump_stats() {
+  signalfd_siginfo info;
+  while (read(stats_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+  }
+
+  string tmp_path = string(stats_path) + ".tmp";
+  FILE* out = fopen(tmp_path.c_str(), "w");
+  if (out == nullptr) {
+    perror("Failed to write stats");
+    return;
+  }
+
+  uint64_t started = sum_counter(all_metrics, total_metrics, COUNTER_ROOMS_STARTED) +
+                     sum_counter(all_metrics, total_metrics, COUNTER_ROOMS_RESUMED);
+  uint64_t closed = sum_counter(all_metrics, total_metrics, COUNTER_ROOMS_CLOSED);
+  size_t pooled_rooms = 0;
+  int waiting = 0;
+  for (int i = 0; i < total_shards; i++) {
+    RoomPool* pool = &shards[i].room_pool;
+    pthread_mutex_lock(&pool->lock);
+    pooled_rooms += pool->total_rooms;
+    pthread_mutex_unlock(&pool->lock);
+    waiting += shards[i].waiting.load(memory_order_relaxed);
+  }
+
+  fprintf(out, "active_rooms %llu\n", (unsigned long long)(started >= closed ? started - closed : 0));
+  fprintf(out, "pooled_rooms %zu\n", pooled_rooms);
+  fprintf(out, "waiting_players %d\n", waiting);
+  fprintf(out, "shards %d\n", total_shards);
+  fprintf(out, "workers %d\n", total_workers);
+  if (tournament.running.load(memory_order_relaxed)) {
+    fprintf(out, "tournament_players_left %zu\n", tournament.current.size());
+    fprintf(out, "tournament_matches_playing %d\n", tournament.playing);
+  }
+  if (ratings_open) fprintf(out, "rated_players %llu\n", (unsigned long long)rating_count(&ratings));
+  write_metrics(out, all_metrics, total_metrics);
+  fclose(out);
+
+  if (rename(tmp_path.c_str(), stats_path) < 0) perror("Failed to write stats");
+}
+
+// Finds peers that vanished without a FIN, whether they sit in the lobby or
+// in a game. Idle sockets are probed by keepalive; ones with unacked data
+// give up after the same total through TCP_USER_TIMEOUT.
+void enable_keepalive(int socket_player) {
+  const int on = 1, idle = KEEPALIVE_IDLE_S, interval = KEEPALIVE_INTERVAL_S, probes = KEEPALIVE_PROBES;
+  const unsigned int user_timeout = (KEEPALIVE_IDLE_S + KEEPALIVE_INTERVAL_S * KEEPALIVE_PROBES) * 1000;
+  setsockopt(socket_player, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+  setsockopt(socket_player, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(socket_player, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+  setsockopt(socket_player, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+  setsockopt(socket_player, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+}
+
+void accept_players(Shard* shard) {
+  while (true) {
+    int new_socket = accept4(shard->server_fd, nullptr, nullptr, SOCK_NONBLOCK);
+    count_metric(COUNTER_ACCEPT_CALLS);
+    if (new_socket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        count_metric(COUNTER_ACCEPT_ERRORS);
+        perror("Accept failed");
+      }
+      return;
+    }
+
+    count_metric(COUNTER_ACCEPTS);
+    enable_keepalive(new_socket);
+    add_greeting(shard, new_socket);
+  }
+}
+
+// The table id says which worker owns the room; that worker checks it is
+// still there.
+void route_to_table(const TableRequest& request) {
+  bool spectator = request.seat == NO_SEAT;
+  uint32_t table = request.table;
+  if (spectator && table == FEATURED_TABLE) table = featured_table.load(memory_order_relaxed);
+  uint32_t index = (table >> 24) - 1;
+  if (table == FEATURED_TABLE || index >= (uint32_t)total_workers) {
+    if (!spectator) count_metric(COUNTER_REJECTS);
+    refuse_connection(request.socket, spectator ? NOTICE_NO_TABLE : NOTICE_SESSION_EXPIRED);
+    return;
+  }
+
+  Worker* worker = &workers[index];
+  pthread_mutex_lock(&worker->lock);
+  worker->incoming_requests.push_back(request);
+  worker->incoming_requests.back().table = table;
+  pthread_mutex_unlock(&worker->lock);
+
+  uint64_t one = 1;
+  if (write(worker->wake_fd, &one, sizeof(one)) < 0) perror("Failed to wake worker");
+}
+
+// A name is whoever holds its secret. A HELLO without one is issued a new
+// secret in MSG_IDENTITY, which is only any use for a name nobody owns yet;
+// an owned name needs the secret it was claimed with.
+bool identify_player(LobbyEntry* entry, const uint8_t* secret) {
+  uint64_t claimed = ratings_open ? rating_name_owner(&ratings, entry->name) : 0;
+  uint8_t issued[PLAYER_SECRET_SIZE];
+  uint8_t none[PLAYER_SECRET_SIZE] = {};
+  if (memcmp(secret, none, PLAYER_SECRET_SIZE) == 0) {
+    if (claimed != 0 || getrandom(issued, sizeof(issued), 0) != sizeof(issued)) return false;
+    // Best effort, like refuse_connection(): a client that misses it can
+    // still play under the name, but cannot claim it again later.
+    IdentityPayload identity;
+    memcpy(identity.secret, issued, PLAYER_SECRET_SIZE);
+    string frames;
+    append_frame(&frames, MSG_IDENTITY, &identity, sizeof(identity));
+    send(entry->socket_player, frames.data(), frames.size(), MSG_NOSIGNAL);
+    secret = issued;
+  }
+  entry->owner = rating_owner(secret);
+  return claimed == 0 || claimed == entry->owner;
+}
+
+// A new connection says HELLO to be matched or RESUME to take a held seat
+// back. Only the first frame is read, so whatever the player sends after
+// it is left in the socket for the worker.
+void read_greeting(Shard* shard, LobbyEntry* entry) {
+  int socket = entry->socket_player;
+  size_t wanted = entry->in_len < FRAME_HEADER_SIZE ? FRAME_HEADER_SIZE : FRAME_HEADER_SIZE + entry->in_buf[0];
+  ssize_t bytes = recv(socket, entry->in_buf + entry->in_len, wanted - entry->in_len, 0);
+  count_metric(COUNTER_RECV_CALLS);
+  if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+  if (bytes <= 0) {
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+    close(socket);
+    lobby_remove(&shard->lobby, entry);
+    return;
+  }
+  entry->in_len += bytes;
+  count_metric(COUNTER_BYTES_RECEIVED, bytes);
+
+  Frame frame;
+  if (parse_frame(entry->in_buf, entry->in_len, &frame) == 0) return;
+  if (frame.opcode == MSG_HELLO) {
+    const HelloPayload* hello = frame_payload<HelloPayload>(frame);
+    if (hello && hello->version == PROTOCOL_VERSION) {
+      memcpy(entry->name, hello->name, PLAYER_NAME_SIZE);
+      if (rating_named(entry->name) && !identify_player(entry, hello->secret)) {
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+        lobby_remove(&shard->lobby, entry);
+        count_metric(COUNTER_REJECTS);
+        refuse_connection(socket, NOTICE_NAME_TAKEN);
+        return;
+      }
+      entry->rating = lookup_rating(entry->name);
+      if (tournament.running.load(memory_order_acquire) && tournament.roster.count(roster_key(entry->name))) {
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+        lobby_remove(&shard->lobby, entry);
+        enter_tournament(socket, 0, entry->name, entry->owner, entry->rating);
+        return;
+      }
+      match_player(shard, entry);
+      return;
+    }
+  }
+
+  const ResumePayload* resume = frame.opcode == MSG_RESUME ? frame_payload<ResumePayload>(frame) : nullptr;
+  epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+  lobby_remove(&shard->lobby, entry);
+  if (resume && resume->version == PROTOCOL_VERSION) {
+    route_to_table(read_token(socket, resume->token));
+    return;
+  }
+  count_metric(COUNTER_REJECTS);
+  refuse_connection(socket, NOTICE_BAD_VERSION);
+}
+
+void forget_pending_spectator(PendingSpectator* pending) {
+  epoll_ctl(spectator_epoll_fd, EPOLL_CTL_DEL, pending->socket, nullptr);
+  pending_spectators.erase(find(pending_spectators.begin(), pending_spectators.end(), pending));
+  delete pending;
+}
+
+// Runs on shard 0. Past SPECTATOR_MAX_PENDING, a new spectator pushes out
+// the one that has waited longest without naming a table.
+void accept_spectators() {
+  while (true) {
+    int new_socket = accept4(spectator_fd, nullptr, nullptr, SOCK_NONBLOCK);
+    count_metric(COUNTER_ACCEPT_CALLS);
+    if (new_socket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        count_metric(COUNTER_ACCEPT_ERRORS);
+        perror("Accept failed");
+      }
+      return;
+    }
+
+    count_metric(COUNTER_ACCEPTS);
+    if (pending_spectators.size() >= SPECTATOR_MAX_PENDING) {
+      int oldest = pending_spectators.front()->socket;
+      forget_pending_spectator(pending_spectators.front());
+      close(oldest);
+    }
+    enable_keepalive(new_socket);
+
+    PendingSpectator* pending = new PendingSpectator;
+    pending->socket = new_socket;
+    pending->len = 0;
+    pending_spectators.push_back(pending);
+
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = pending;
+    epoll_ctl(spectator_epoll_fd, EPOLL_CTL_ADD, new_socket, &ev);
+  }
+}
+
+void read_pending_spectators() {
+  epoll_event events[WORKER_EVENTS];
+  int ready = epoll_wait(spectator_epoll_fd, events, WORKER_EVENTS, 0);
+  for (int i = 0; i < ready; i++) {
+    PendingSpectator* pending = (PendingSpectator*)events[i].data.ptr;
+    int socket = pending->socket;
+    ssize_t bytes = recv(socket, pending->buf + pending->len, sizeof(pending->buf) - pending->len, 0);
+    count_metric(COUNTER_RECV_CALLS);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+    if (bytes <= 0) {
+      forget_pending_spectator(pending);
+      close(socket);
+      continue;
+    }
+    pending->len += bytes;
+    count_metric(COUNTER_BYTES_RECEIVED, bytes);
+
+    Frame frame;
+    if (parse_frame(pending->buf, pending->len, &frame) == 0) continue;
+    const SpectatePayload* spectate = frame.opcode == MSG_SPECTATE ? frame_payload<SpectatePayload>(frame) : nullptr;
+    bool valid = spectate && spectate->version == PROTOCOL_VERSION;
+    TableRequest request = {socket, valid ? (uint32_t)read_le(spectate->table, 4) : 0, NO_SEAT, 0};
+    forget_pending_spectator(pending);
+    if (!valid) {
+      count_metric(COUNTER_REJECTS);
+      refuse_connection(socket, NOTICE_BAD_VERSION);
+      continue;
+    }
+    route_to_table(request);
+  }
+}
+
+// SIGUSR1 is blocked before any worker starts, so it is only ever seen
+// by the acceptor, through a signalfd in its epoll set.
+void init_stats_signal() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+  stats_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK);
+  if (stats_signal_fd < 0) {
+    perror("Failed to create stats signalfd");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void init_handoff_listener() {
+  sockaddr_un address;
+  handoff_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+  if (handoff_fd < 0 || handoff_address(handoff_path, &address) < 0) {
+    perror("Failed to create handoff socket");
+    exit(EXIT_FAILURE);
+  }
+
+  unlink(handoff_path);
+  if (bind(handoff_fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(handoff_fd, 1) < 0) {
+    perror("Failed to listen for handoffs");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void wait_for_parked(int threads) {
+  pthread_mutex_lock(&handoff_lock);
+  while (parked_threads < threads) {
+    pthread_cond_wait(&handoff_cond, &handoff_lock);
+  }
+  pthread_mutex_unlock(&handoff_lock);
+}
+
+// Runs on shard 0, which is the only thread left running once it returns.
+// The shards park first: until then they may still pair players into a
+// worker's queue, and a worker that has parked would never start those
+// rooms. Whatever a worker had not taken yet when it parked is sent by
+// hand_off().
+void park_threads() {
+  uint64_t one = 1;
+  handoff_pending.store(true, memory_order_release);
+  for (int i = 1; i < total_shards; i++) {
+    if (write(shards[i].wake_fd, &one, sizeof(one)) < 0) perror("Failed to wake shard");
+  }
+  wait_for_parked(total_shards - 1);
+
+  workers_parking.store(true, memory_order_release);
+  for (int i = 0; i < total_workers; i++) {
+    if (write(workers[i].wake_fd, &one, sizeof(one)) < 0) perror("Failed to wake worker");
+  }
+  wait_for_parked(total_workers + total_shards - 1);
+}
+
+void resume_threads() {
+  pthread_mutex_lock(&handoff_lock);
+  handoff_pending.store(false, memory_order_release);
+  workers_parking.store(false, memory_order_release);
+  pthread_cond_broadcast(&handoff_cond);
+  pthread_mutex_unlock(&handoff_lock);
+}
+
+bool send_room(int conn, Room* room) {
+  RoomState state;
+  memset(&state, 0, sizeof(state));
+  state.type = HANDOFF_ROOM;
+  state.worker = room->worker - workers;
+  state.phase = room->phase;
+  state.log_id = room->log_id;
+  state.table = room->table;
+  state.match = room->match;
+  state.seed = room->seed;
+  state.actions = room->actions;
+  state.send_calls = room->send_calls;
+  state.tally = room->tally;
+  state.game = room->game;
+
+  int fds[TOTAL_PER_ROOM];
+  int fd_count = 0;
+  size_t out_bytes = 0;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    Player* player = &room->players[i];
+    PlayerState* saved = &state.players[i];
+    saved->bot = player->bot;
+    saved->has_socket = player->socket_player >= 0;
+    saved->in_len = player->in_len;
+    saved->timeouts = player->timeouts;
+    saved->prompted_ns = player->prompted_ns;
+    saved->secret = player->secret;
+    saved->away_ns = player->away_ns;
+    saved->behind_ns = player->behind_ns;
+    saved->out_len = player->out.size;
+    saved->queued_count = player->queued_count;
+    saved->owner = player->owner;
+    saved->rating = player->rating;
+    memcpy(saved->name, player->name, PLAYER_NAME_SIZE);
+    memcpy(saved->queued, player->queued, sizeof(saved->queued));
+    memcpy(saved->in_buf, player->in_buf + player->in_start, player->in_len);
+    if (saved->has_socket) fds[fd_count++] = player->socket_player;
+    out_bytes += player->out.size;
+  }
+
+  string message((const char*)&state, sizeof(state));
+  message.reserve(sizeof(state) + out_bytes);
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    iovec iov[2];
+    int count = ring_iov(&room->players[i].out, iov);
+    for (int j = 0; j < count; j++) {
+      message.append((const char*)iov[j].iov_base, iov[j].iov_len);
+    }
+  }
+  return send_handoff(conn, message.data(), message.size(), fds, fd_count);
+}
+
+// A greeting connection goes over with the part of its first frame read
+// so far.
+bool send_lobby_entry(int conn, int shard, const LobbyEntry* entry) {
+  HandoffLobby lobby = {HANDOFF_LOBBY, (uint32_t)shard, entry->greeted, (uint32_t)entry->in_len, (uint32_t)entry->slot,
+                        entry->joined_ns, entry->owner, entry->rating, {}};
+  memcpy(lobby.name, entry->name, PLAYER_NAME_SIZE);
+  string message((const char*)&lobby, sizeof(lobby));
+  if (!entry->greeted) message.append((const char*)entry->in_buf, entry->in_len);
+  return send_handoff(conn, message.data(), message.size(), &entry->socket_player, 1);
+}
+
+bool send_table_request(int conn, const TableRequest& request) {
+  HandoffRequest saved = {HANDOFF_REQUEST, request.table, request.seat, request.secret};
+  return send_handoff(conn, &saved, sizeof(saved), &request.socket, 1);
+}
+
+bool send_pending_spectator(int conn, const PendingSpectator* pending) {
+  HandoffSpectator saved = {HANDOFF_SPECTATOR, (uint32_t)pending->len};
+  string message((const char*)&saved, sizeof(saved));
+  message.append((const char*)pending->buf, pending->len);
+  return send_handoff(conn, message.data(), message.size(), &pending->socket, 1);
+}
+
+// The bracket goes over as it stands; the lookups shard 0 keeps on the
+// side are rebuilt from it.
+bool send_tournament(int conn) {
+  HandoffTournament saved = {HANDOFF_TOURNAMENT, (uint32_t)tournament.size, (uint32_t)tournament.players,
+                             (uint32_t)tournament.playing, tournament.started_ns};
+  string message((const char*)&saved, sizeof(saved));
+  for (const TournamentSlot& slot : tournament.slots) {
+    SlotRecord record;
+    memset(&record, 0, sizeof(record));
+    record.state = slot.state;
+    record.playing = slot.playing;
+    record.ready_ns = slot.ready_ns;
+    record.owner = slot.owner;
+    memcpy(record.name, slot.name, PLAYER_NAME_SIZE);
+    message.append((const char*)&record, sizeof(record));
+  }
+  return message.size() <= HANDOFF_MAX_MESSAGE && send_handoff(conn, message.data(), message.size(), nullptr, 0);
+}
+
+bool send_arrival(int conn, const TournamentArrival& arrival) {
+  HandoffArrival saved = {HANDOFF_ARRIVAL, (uint32_t)arrival.match, arrival.rating, {}, arrival.owner};
+  memcpy(saved.name, arrival.name, PLAYER_NAME_SIZE);
+  return send_handoff(conn, &saved, sizeof(saved), &arrival.socket, arrival.socket >= 0 ? 1 : 0);
+}
+
+// A watcher goes over with the rest of the buffer it is halfway through,
+// so its stream stays framed, and starts on the new server from a fresh
+// snapshot. Once the game is over there is nothing to snapshot, so it
+// keeps everything it had queued instead.
+bool send_watcher(int conn, const Spectator* spectator) {
+  int keep = spectator->room->phase == ROOM_CLOSING ? spectator->queue_count : spectator->offset > 0 ? 1 : 0;
+  HandoffWatcher saved = {HANDOFF_WATCHER, 0};
+  string message((const char*)&saved, sizeof(saved));
+  size_t offset = spectator->offset;
+  for (int i = 0; i < keep; i++) {
+    const SharedBuffer* buffer = spectator->queue[(spectator->queue_head + i) % SPECTATOR_QUEUE_SLOTS];
+    message.append((const char*)buffer->data + offset, buffer->size - offset);
+    offset = 0;
+  }
+  ((HandoffWatcher*)&message[0])->len = message.size() - sizeof(saved);
+  return send_handoff(conn, message.data(), message.size(), &spectator->socket, 1);
+}
+
+// Runs on shard 0 once a new server connects. Everything is sent with the
+// other threads parked and the game logs flushed, so the new server starts
+// from exactly where this one stopped. If anything fails the workers carry
+// on and this server keeps running.
+void hand_off() {
+  int conn = accept4(handoff_fd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (conn < 0) return;
+
+  timeval timeout = {HANDOFF_TIMEOUT_S, 0};
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  park_threads();
+  vector<LogRecord> records;
+  write_logs(&records);
+  sync_ratings();
+
+  // A waiting room with a worker was paired but its worker had not started
+  // it; free rooms are waiting too, with no worker.
+  vector<Room*> rooms;
+  int waiting = 0;
+  for (int s = 0; s < total_shards; s++) {
+    for (Room* chunk : shards[s].room_pool.chunks) {
+      for (int i = 0; i < ROOM_POOL_CHUNK; i++) {
+        Room* room = &chunk[i];
+        if (room->phase != ROOM_CLOSED && (room->phase != ROOM_WAITING || room->worker)) rooms.push_back(room);
+      }
+    }
+    waiting += shards[s].lobby.waiting;
+  }
+
+  HandoffBegin begin = {HANDOFF_BEGIN, HANDOFF_VERSION, sizeof(RoomState), (uint32_t)total_shards,
+                        (uint32_t)total_workers, (uint32_t)rooms.size()};
+  bool ok = send_handoff(conn, &begin, sizeof(begin), &spectator_fd, spectator_fd >= 0 ? 1 : 0);
+  bool running = tournament.running.load(memory_order_relaxed);
+  if (running) ok = ok && send_tournament(conn);
+  for (int s = 0; ok && s < total_shards; s++) {
+    HandoffShard shard = {HANDOFF_SHARD, (uint32_t)s};
+    ok = send_handoff(conn, &shard, sizeof(shard), &shards[s].server_fd, 1);
+    for (int list = 0; list < 2; list++) {
+      LobbyEntry* entry = list == 0 ? shards[s].lobby.head : shards[s].lobby.greeting;
+      for (; ok && entry; entry = entry->next) {
+        ok = send_lobby_entry(conn, s, entry);
+      }
+    }
+  }
+  for (size_t i = 0; ok && running && i < tournament.slots.size(); i++) {
+    if (tournament.slots[i].entry) ok = send_lobby_entry(conn, 0, tournament.slots[i].entry);
+  }
+  for (size_t i = 0; ok && i < rooms.size(); i++) {
+    for (size_t j = 0; ok && j < rooms[i]->spectators.size(); j++) {
+      ok = send_watcher(conn, rooms[i]->spectators[j]);
+    }
+    ok = ok && send_room(conn, rooms[i]);
+  }
+  for (int w = 0; w < total_workers; w++) {
+    for (size_t i = 0; ok && i < workers[w].incoming_requests.size(); i++) {
+      ok = send_table_request(conn, workers[w].incoming_requests[i]);
+    }
+  }
+  for (size_t i = 0; ok && i < pending_spectators.size(); i++) {
+    ok = send_pending_spectator(conn, pending_spectators[i]);
+  }
+  // Workers are parked, so nothing joins the inbox while it is sent.
+  for (size_t i = 0; ok && i < tournament.inbox.size(); i++) {
+    ok = send_arrival(conn, tournament.inbox[i]);
+  }
+  uint32_t end = HANDOFF_END;
+  uint8_t ack = 0;
+  ok = ok && send_handoff(conn, &end, sizeof(end), nullptr, 0) && recv(conn, &ack, sizeof(ack), 0) == 1;
+
+  if (ok) {
+    cout << "Handed " << rooms.size() << " rooms and " << waiting << " waiting players to the new server." << endl;
+    exit(EXIT_SUCCESS);
+  }
+
+  cerr << "Handoff failed; carrying on." << endl;
+  close(conn);
+  resume_threads();
+}
+
+// Comes before everything else, so the slots rostered players wait in and
+// the matches rooms play are there to restore them into.
+bool restore_tournament(const uint8_t* message, size_t size) {
+  const HandoffTournament* saved = (const HandoffTournament*)message;
+  if (saved->size < 2 || (saved->size & (saved->size - 1)) ||
+      size != sizeof(*saved) + 2 * saved->size * sizeof(SlotRecord)) {
+    return false;
+  }
+
+  const SlotRecord* records = (const SlotRecord*)(saved + 1);
+  tournament.size = saved->size;
+  tournament.rounds = 31 - __builtin_clz(tournament.size);
+  tournament.players = saved->players;
+  tournament.playing = saved->playing;
+  tournament.started_ns = saved->started_ns;
+  tournament.slots.assign(2 * tournament.size, TournamentSlot());
+  vector<int> due;
+  for (int i = 2 * tournament.size - 1; i >= 1; i--) {
+    TournamentSlot* slot = &tournament.slots[i];
+    slot->state = (SlotState)records[i].state;
+    slot->playing = records[i].playing;
+    slot->ready_ns = records[i].ready_ns;
+    slot->owner = records[i].owner;
+    memcpy(slot->name, records[i].name, PLAYER_NAME_SIZE);
+    if (i < tournament.size && slot->state == SLOT_OPEN && !slot->playing && slot->ready_ns != 0) due.push_back(i);
+    if (slot->state != SLOT_FILLED) continue;
+
+    // A player is still in from the highest slot it has reached, until
+    // the match that slot feeds is decided.
+    if (i >= tournament.size) tournament.roster.insert(roster_key(slot->name));
+    if (i > 1 && tournament.slots[i / 2].state == SLOT_OPEN) tournament.current[roster_key(slot->name)] = i;
+  }
+  sort(due.begin(), due.end(),
+       [](int a, int b) { return tournament.slots[a].ready_ns < tournament.slots[b].ready_ns; });
+  tournament.due.assign(due.begin(), due.end());
+  pthread_mutex_init(&tournament.lock, nullptr);
+  tournament.running.store(true);
+  return true;
+}
+
+// Runs before the room it watches is restored; resume_room() hands it to
+// the worker's epoll.
+Spectator* restore_watcher(const uint8_t* message, size_t size, int socket) {
+  const HandoffWatcher* saved = (const HandoffWatcher*)message;
+  if (saved->len > SPECTATOR_MAX_QUEUED_BYTES + SHARED_BUFFER_SIZE || size != sizeof(*saved) + saved->len) {
+    return nullptr;
+  }
+
+  Spectator* spectator = new Spectator;
+  spectator->socket = socket;
+  spectator->room = nullptr;
+  spectator->offset = 0;
+  spectator->queue_head = 0;
+  spectator->queue_count = 0;
+  spectator->queued_bytes = 0;
+  spectator->skips = 0;
+  spectator->want_write = false;
+  const uint8_t* bytes = (const uint8_t*)(saved + 1);
+  for (uint32_t done = 0; done < saved->len;) {
+    SharedBuffer* buffer = new SharedBuffer;
+    buffer->refs = 0;
+    buffer->size = min((uint32_t)SHARED_BUFFER_SIZE, saved->len - done);
+    memcpy(buffer->data, bytes + done, buffer->size);
+    enqueue_buffer(spectator, buffer);
+    done += buffer->size;
+  }
+  return spectator;
+}
+
+bool restore_room(const uint8_t* message, size_t size, const int* fds, int fd_count, vector<Spectator*>* watchers) {
+  const RoomState* state = (const RoomState*)message;
+  size_t out_bytes = 0;
+  int sockets = 0;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    const PlayerState* saved = &state->players[i];
+    if (saved->out_len > OUT_RING_SIZE || saved->in_len > PLAYER_IN_BUF_SIZE || saved->queued_count < 0 ||
+        saved->queued_count > PLAYER_MAX_QUEUED) {
+      return false;
+    }
+    out_bytes += state->players[i].out_len;
+    sockets += state->players[i].has_socket;
+  }
+  if (size < sizeof(RoomState) || size != sizeof(RoomState) + out_bytes || sockets != fd_count ||
+      state->worker >= (uint32_t)total_workers || (state->match != 0 && state->match >= tournament.slots.size())) {
+    return false;
+  }
+
+  Worker* worker = &workers[state->worker];
+  Room* room = acquire_room(&worker->shard->room_pool);
+  room->total_players = TOTAL_PER_ROOM;
+  room->phase = (RoomPhase)state->phase;
+  room->seed = state->seed;
+  room->actions = state->actions;
+  room->send_calls = state->send_calls;
+  room->log_id = state->log_id;
+  room->table = state->table;
+  room->match = state->match;
+  room->tally = state->tally;
+  room->game = state->game;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    room->spectator_points[i] = state->game.players[i].points;
+  }
+
+  const char* out = (const char*)(state + 1);
+  int next_fd = 0;
+  for (int i = 0; i < TOTAL_PER_ROOM; i++) {
+    const PlayerState* saved = &state->players[i];
+    Player* player = &room->players[i];
+    player->socket_player = saved->has_socket ? fds[next_fd++] : -1;
+    player->bot = saved->bot;
+    player->prompted_ns = saved->prompted_ns;
+    player->timeouts = saved->timeouts;
+    player->secret = saved->secret;
+    player->away_ns = saved->away_ns;
+    init_timer_node(&player->grace_timer, room);
+    player->room = room;
+    player->seat = i;
+    player->in_start = 0;
+    player->in_len = saved->in_len;
+    memcpy(player->in_buf, saved->in_buf, saved->in_len);
+    player->queued_count = saved->queued_count;
+    player->owner = saved->owner;
+    player->rating = saved->rating;
+    memcpy(player->name, saved->name, PLAYER_NAME_SIZE);
+    memcpy(player->queued, saved->queued, sizeof(player->queued));
+    ring_clear(&player->out);
+    ring_write(&player->out, out, saved->out_len);
+    player->behind_ns = saved->behind_ns;
+    player->want_write = false;
+    out += saved->out_len;
+  }
+  for (Spectator* spectator : *watchers) {
+    spectator->room = room;
+    room->spectators.push_back(spectator);
+  }
+  watchers->clear();
+
+  count_metric(COUNTER_ROOMS_RESUMED);
+  assign_room(room, worker);
+  return true;
+}
+
+// Started with -u: takes the listening sockets, the lobbies and every room
+// from the server listening on handoff_path, then takes its place there.
+// The shard and worker layout is the old server's, whatever -S says.
+void take_over_server() {
+  sockaddr_un address;
+  int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (conn < 0 || handoff_address(handoff_path, &address) < 0 ||
+      connect(conn, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    perror("Failed to reach the running server");
+    exit(EXIT_FAILURE);
+  }
+
+  vector<uint8_t> message(HANDOFF_MAX_MESSAGE);
+  int fds[HANDOFF_MAX_FDS];
+  int fd_count;
+  ssize_t size = recv_handoff(conn, message.data(), message.size(), fds, &fd_count);
+  const HandoffBegin* begin = (const HandoffBegin*)message.data();
+  if (size != sizeof(HandoffBegin) || begin->type != HANDOFF_BEGIN || begin->version != HANDOFF_VERSION ||
+      begin->room_state_size != sizeof(RoomState) || begin->shards < 1) {
+    cerr << "The running server refused the handoff or is not compatible with this build; it keeps running." << endl;
+    exit(EXIT_FAILURE);
+  }
+  uint32_t expected_rooms = begin->rooms;
+  if (fd_count == 1) spectator_fd = fds[0];
+  build_shards(begin->shards, begin->workers);
+
+  uint32_t rooms = 0;
+  int waiting = 0;
+  int watching = 0;
+  vector<Spectator*> watchers;
+  while (true) {
+    size = recv_handoff(conn, message.data(), message.size(), fds, &fd_count);
+    uint32_t type = size >= (ssize_t)sizeof(uint32_t) ? *(const uint32_t*)message.data() : 0;
+    if (type == HANDOFF_END && watchers.empty()) break;
+
+    bool ok = false;
+    if (type == HANDOFF_SHARD && size == sizeof(HandoffShard) && fd_count == 1) {
+      const HandoffShard* shard = (const HandoffShard*)message.data();
+      if (shard->shard < (uint32_t)total_shards) {
+        shards[shard->shard].server_fd = fds[0];
+        ok = true;
+      }
+    } else if (type == HANDOFF_TOURNAMENT && !tournament.running.load(memory_order_relaxed)) {
+      ok = restore_tournament(message.data(), size);
+    } else if (type == HANDOFF_LOBBY && size >= (ssize_t)sizeof(HandoffLobby) && fd_count == 1) {
+      const HandoffLobby* lobby = (const HandoffLobby*)message.data();
+      size_t in_len = lobby->greeted ? 0 : lobby->in_len;
+      bool seated = lobby->slot == 0 || (lobby->shard == 0 && lobby->greeted && lobby->slot < tournament.slots.size() &&
+                                         tournament.slots[lobby->slot].state == SLOT_FILLED &&
+                                         tournament.slots[lobby->slot].entry == nullptr);
+      if (seated && lobby->shard < (uint32_t)total_shards && in_len < MAX_FRAME_SIZE &&
+          size == (ssize_t)(sizeof(*lobby) + in_len)) {
+        Shard* shard = &shards[lobby->shard];
+        LobbyEntry* entry = add_greeting(shard, fds[0]);
+        entry->joined_ns = lobby->joined_ns;
+        entry->in_len = in_len;
+        memcpy(entry->in_buf, lobby + 1, in_len);
+        // The bucket comes from the rating, so it is set before queueing.
+        entry->owner = lobby->owner;
+        entry->rating = lobby->rating;
+        memcpy(entry->name, lobby->name, PLAYER_NAME_SIZE);
+        if (lobby->slot != 0) {
+          wait_for_match(shard, entry, lobby->slot);
+          waiting++;
+        } else if (lobby->greeted) {
+          wait_for_opponent(shard, entry);
+          waiting++;
+        }
+        ok = true;
+      }
+    } else if (type == HANDOFF_WATCHER && size >= (ssize_t)sizeof(HandoffWatcher) && fd_count == 1) {
+      Spectator* spectator = restore_watcher(message.data(), size, fds[0]);
+      if (spectator) {
+        watchers.push_back(spectator);
+        watching++;
+        ok = true;
+      }
+    } else if (type == HANDOFF_ROOM) {
+      ok = restore_room(message.data(), size, fds, fd_count, &watchers);
+      rooms++;
+    } else if (type == HANDOFF_REQUEST && size == sizeof(HandoffRequest) && fd_count == 1) {
+      // Sent after every room, so the table it names is already queued.
+      const HandoffRequest* saved = (const HandoffRequest*)message.data();
+      TableRequest request = {fds[0], saved->table, (uint8_t)saved->seat, saved->secret};
+      route_to_table(request);
+      ok = true;
+    } else if (type == HANDOFF_SPECTATOR && size >= (ssize_t)sizeof(HandoffSpectator) && fd_count == 1) {
+      const HandoffSpectator* saved = (const HandoffSpectator*)message.data();
+      if (saved->len < MAX_FRAME_SIZE && size == (ssize_t)(sizeof(*saved) + saved->len)) {
+        PendingSpectator* pending = new PendingSpectator;
+        pending->socket = fds[0];
+        pending->len = saved->len;
+        memcpy(pending->buf, saved + 1, saved->len);
+        pending_spectators.push_back(pending);
+        ok = true;
+      }
+    } else if (type == HANDOFF_ARRIVAL && size == sizeof(HandoffArrival) && fd_count <= 1) {
+      // Shard 0 seats these once it runs, as it would have on the old server.
+      const HandoffArrival* saved = (const HandoffArrival*)message.data();
+      if (saved->match == 0 ? fd_count == 1 : saved->match < tournament.slots.size()) {
+        enter_tournament(fd_count == 1 ? fds[0] : -1, saved->match, saved->name, saved->owner, saved->rating);
+        ok = true;
+      }
+    }
+    if (!ok) {
+      // The old server still owns every socket and resumes once we are gone.
+      cerr << "Handoff was cut short; the running server keeps going." << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  init_handoff_listener();
+  uint8_t ack = 1;
+  if (send(conn, &ack, sizeof(ack), MSG_NOSIGNAL) != 1) {
+    perror("Failed to confirm handoff");
+    exit(EXIT_FAILURE);
+  }
+  close(conn);
+
+  cout << "Took over " << rooms << " of " << expected_rooms << " rooms, " << waiting << " waiting players and "
+       << watching << " spectators." << endl;
+  if (tournament.running.load(memory_order_relaxed)) {
+    cout << "Took over the tournament with " << tournament.current.size() << " players left." << endl;
+  }
+  for (int i = 0; i < total_shards; i++) {
+    wake_workers(&shards[i]);
+  }
+}
+
+void run_shard(Shard* shard) {
+  thread_metrics = shard->metrics;
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->server_fd, &ev);
+  if (shard->index == 0) {
+    ev.data.ptr = &stats_signal_fd;
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, stats_signal_fd, &ev);
+    ev.data.ptr = &handoff_fd;
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, handoff_fd, &ev);
+    if (spectator_fd >= 0) {
+      ev.data.ptr = &spectator_fd;
+      epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, spectator_fd, &ev);
+      ev.data.ptr = &spectator_epoll_fd;
+      epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, spectator_epoll_fd, &ev);
+    }
+  }
+
+  epoll_event events[WORKER_EVENTS];
+  while (true) {
+    int ready = epoll_wait(shard->epoll_fd, events, WORKER_EVENTS, lobby_timeout(shard));
+    count_metric(COUNTER_EPOLL_WAITS);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait failed");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < ready; i++) {
+      if (events[i].data.ptr == nullptr) {
+        accept_players(shard);
+        continue;
+      }
+      if (events[i].data.ptr == &shard->wake_fd) {
+        uint64_t count;
+        if (read(shard->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+          perror("Failed to read shard wakeup");
+        }
+        if (shard->index == 0) accept_tournament(shard);
+        continue;
+      }
+      if (events[i].data.ptr == &stats_signal_fd) {
+        dump_stats();
+        continue;
+      }
+      if (events[i].data.ptr == &handoff_fd) {
+        hand_off();
+        continue;
+      }
+      if (events[i].data.ptr == &spectator_fd) {
+        accept_spectators();
+        continue;
+      }
+      if (events[i].data.ptr == &spectator_epoll_fd) {
+        read_pending_spectators();
+        continue;
+      }
+
+      LobbyEntry* entry = (LobbyEntry*)events[i].data.ptr;
+      if (entry->socket_player < 0) continue;
+      if (!entry->greeted) {
+        read_greeting(shard, entry);
+        continue;
+      }
+
+      epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, entry->socket_player, nullptr);
+      close(entry->socket_player);
+      lobby_remove(&shard->lobby, entry);
+    }
+
+    pair_relaxed(shard);
+    if (bot_wait_ms >= 0) seat_bots(shard);
+    if (shard->index == 0) expire_no_shows(shard);
+    lobby_recycle(&shard->lobby);
+    wake_workers(shard);
+    shard->waiting.store(shard->lobby.waiting, memory_order_relaxed);
+
+    if (shard->index != 0 && handoff_pending.load(memory_order_acquire)) park_thread(&handoff_pending);
+  }
+}
+
+void* shard_thread(void* arg) {
+  run_shard((Shard*)arg);
+  return nullptr;
+}
+
+// A server that took over keeps the old one's spectator socket, on
+// whatever port that one used, and the spectators it had not routed yet.
+void init_spectators() {
+  if (spectator_port <= 0 && spectator_fd >= 0) {
+    close(spectator_fd);
+    spectator_fd = -1;
+  } else if (spectator_port > 0 && spectator_fd < 0) {
+    spectator_fd = init_main_socket(spectator_port);
+    cout << "Spectators on port " << spectator_port << endl;
+  }
+  if (spectator_fd < 0) {
+    for (PendingSpectator* pending : pending_spectators) {
+      close(pending->socket);
+      delete pending;
+    }
+    pending_spectators.clear();
+    return;
+  }
+
+  spectator_epoll_fd = epoll_create1(0);
+  if (spectator_epoll_fd < 0) {
+    perror("Failed to create spectator event loop");
+    exit(EXIT_FAILURE);
+  }
+  for (PendingSpectator* pending : pending_spectators) {
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = pending;
+    epoll_ctl(spectator_epoll_fd, EPOLL_CTL_ADD, pending->socket, &ev);
+  }
+}
+
+// Shard 0 runs on the main thread and alone handles stats dumps, handoffs
+// and spectators; every other shard gets a thread of its own.
+void run_server(int shard_count) {
+  init_stats_signal();
+  if (take_over) {
+    take_over_server();
+  } else {
+    build_shards(shard_count, 1);
+    for (int i = 0; i < total_shards; i++) {
+      shards[i].server_fd = init_main_socket(PORT);
+    }
+    init_handoff_listener();
+    cout << "Server listening on port " << PORT << endl;
+  }
+  init_spectators();
+  start_log_writer();
+  init_ratings();
+  init_tournament();
+
+  for (int i = 1; i < total_shards; i++) {
+    if (pthread_create(&shards[i].id, nullptr, shard_thread, &shards[i]) != 0) {
+      perror("Failed to create shard thread");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(shards[i].id);
+  }
+  run_shard(&shards[0]);
+}
+
+void usage(const char* name) {
+  cerr << "Usage: " << name << " [-b bot_wait_ms] [-B bot_budget_us] [-s stats_path] [-t turn_timeout_ms]"
+       << " [-l log_prefix] [-H handoff_path] [-u] [-S shards] [-w spectator_port]"
+       << " [-r resume_grace_ms] [-R ratings_path] [-T roster_path]" << endl;
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+  int shard_count = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:B:s:t:l:H:uS:w:r:R:T:")) != -1) {
+    switch (opt) {
+      case 's': stats_path = optarg; break;
+      case 'b': bot_wait_ms = atoi(optarg); break;
+      case 'B': bot_budget_ns = strtoull(optarg, nullptr, 10) * 1000; break;
+      case 't': turn_timeout_ms = atoi(optarg); break;
+      case 'l': log_prefix = optarg; break;
+      case 'H': handoff_path = optarg; break;
+      case 'u': take_over = true; break;
+      case 'S': shard_count = atoi(optarg); break;
+      case 'w': spectator_port = atoi(optarg); break;
+      case 'r': resume_grace_ms = atoi(optarg); break;
+      case 'R': ratings_path = optarg; break;
+      case 'T': roster_path = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (shard_count < 1) usage(argv[0]);
+
+  hand_score_table();
+  run_server(shard_count);
+  return 0;
+}
@@ -0,0 +1,135 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+
+// Hierarchical timer wheel. Level 0 has one slot per tick, and each level
+// above has slots TIMER_SLOTS times coarser. Timers sit at the level that
+// matches how far away they are and cascade down as they approach, so
+// scheduling, cancelling and firing are all O(1) per timer. Nodes are
+// intrusive and owned by the caller. A wheel is used by one thread only.
+
+typedef struct TimerNode {
+  uint64_t expires;
+  struct TimerNode* next;
+  struct TimerNode** pprev;
+  void* owner;
+} TimerNode;
+
+typedef struct {
+  uint64_t now;
+  size_t pending;
+  TimerNode* slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+inline void init_timer_node(TimerNode* node, void* owner) {
+  node->next = nullptr;
+  node->pprev = nullptr;
+  node->owner = owner;
+}
+
+inline bool timer_pending(const TimerNode* node) {
+  return node->pprev != nullptr;
+}
+
+inline void init_timer_wheel(TimerWheel* wheel, uint64_t now) {
+  wheel->now = now;
+  wheel->pending = 0;
+  for (int level = 0; level < TIMER_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+      wheel->slots[level][slot] = nullptr;
+    }
+  }
+}
+
+inline void timer_link(TimerWheel* wheel, TimerNode* node) {
+  uint64_t delta = node->expires > wheel->now ? node->expires - wheel->now : 0;
+  int level = 0;
+  while (level < TIMER_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_SLOT_BITS * (level + 1))) {
+    level++;
+  }
+
+  uint64_t expires = node->expires;
+  uint64_t span = (uint64_t)1 << (TIMER_SLOT_BITS * (level + 1));
+  if (delta >= span) expires = wheel->now + span - 1;
+
+  TimerNode** head = &wheel->slots[level][(expires >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK];
+  node->next = *head;
+  if (node->next) node->next->pprev = &node->next;
+  node->pprev = head;
+  *head = node;
+}
+
+inline void timer_unlink(TimerNode* node) {
+  *node->pprev = node->next;
+  if (node->next) node->next->pprev = node->pprev;
+  node->next = nullptr;
+  node->pprev = nullptr;
+}
+
+inline void timer_cancel(TimerWheel* wheel, TimerNode* node) {
+  if (!timer_pending(node)) return;
+  timer_unlink(node);
+  wheel->pending--;
+}
+
+inline void timer_schedule(TimerWheel* wheel, TimerNode* node, uint64_t expires) {
+  timer_cancel(wheel, node);
+  node->expires = expires > wheel->now ? expires : wheel->now + 1;
+  timer_link(wheel, node);
+  wheel->pending++;
+}
+
+// Moves every timer in a coarse slot back into the wheel, where it lands
+// in a finer level now that it is closer.
+inline void timer_cascade(TimerWheel* wheel, int level) {
+  int slot = (wheel->now >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK;
+  TimerNode* node = wheel->slots[level][slot];
+  wheel->slots[level][slot] = nullptr;
+
+  while (node) {
+    TimerNode* next = node->next;
+    node->next = nullptr;
+    node->pprev = nullptr;
+    timer_link(wheel, node);
+    node = next;
+  }
+
+  if (slot == 0 && level + 1 < TIMER_LEVELS) timer_cascade(wheel, level + 1);
+}
+
+// Advances to tick now and calls on_expire(node) for every timer that came
+// due. A callback may schedule or cancel any timer, including its own.
+template <typename F>
+inline void timer_advance(TimerWheel* wheel, uint64_t now, F on_expire) {
+  if (wheel->pending == 0) {
+    if (now > wheel->now) wheel->now = now;
+    return;
+  }
+
+  while (wheel->now < now) {
+    wheel->now++;
+    int slot = wheel->now & TIMER_SLOT_MASK;
+    if (slot == 0) timer_cascade(wheel, 1);
+
+    TimerNode* node;
+    while ((node = wheel->slots[0][slot]) != nullptr) {
+      timer_unlink(node);
+      wheel->pending--;
+      on_expire(node);
+    }
+
+    if (wheel->pending == 0) {
+      wheel->now = now;
+      return;
+    }
+  }
+}
+
+#endif
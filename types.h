@@ -1,49 +1,295 @@
 #ifndef TYPES_H
 #define TYPES_H
 
-#include <map>
+#include <stdint.h>
 #include <string>
+#include "cards.h"
 
-#define MESSAGE_SIZE 256
+#define PROTOCOL_VERSION 4
+#define TOTAL_PER_ROOM 2
+#define NO_SEAT 0xFF
+#define FEATURED_TABLE 0
+#define SESSION_TOKEN_SIZE 13
+#define PLAYER_NAME_SIZE 16
+#define PLAYER_SECRET_SIZE 8
+
+// Every frame is [payload length][opcode][payload], with one byte each for
+// the length and the opcode. Payloads are the structs below, all made of
+// single bytes so they have no padding and no byte order.
+#define FRAME_HEADER_SIZE 2
+#define MAX_FRAME_PAYLOAD 255
+#define MAX_FRAME_SIZE (FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD)
 
 using namespace std;
 
 typedef enum {
-  MSG_TEXT,           
-  MSG_HAND,           
-  MSG_TABLE,         
-  MSG_SCOREBOARD,     
-  MSG_YOUR_TURN,      
-  MSG_WINNER,         
-  MSG_ROOM_JOIN,      
-  MSG_GAME_ACTION     
+  // Server to client.
+  MSG_ROOM_JOIN = 1,
+  MSG_SNAPSHOT,
+  MSG_DEAL,
+  MSG_CARD_PLAYED,
+  MSG_SCORE,
+  MSG_FLOR,
+  MSG_YOUR_TURN,
+  MSG_TRUCO_CALL,
+  MSG_TRUCO_RESULT,
+  MSG_ENVIDO_CALL,
+  MSG_ENVIDO_RESULT,
+  MSG_ROUND_RESULT,
+  MSG_HAND_RESULT,
+  MSG_WINNER,
+  MSG_NOTICE,
+  MSG_IDENTITY,
+
+  // Client to server. A move sent before the player's turn is queued, and
+  // NOTICE_ACTION_QUEUED says so; it is made as soon as a prompt it answers
+  // comes up. Queued moves are forgotten when a new hand is dealt.
+  MSG_HELLO = 64,
+  MSG_PLAY_CARD,
+  MSG_CALL_TRUCO,
+  MSG_CALL_ENVIDO,
+  MSG_ACCEPT,
+  MSG_REJECT,
+  MSG_RESYNC,
+  MSG_SPECTATE,
+  MSG_RESUME
 } MessageType;
 
+typedef enum {
+  PROMPT_PLAY,
+  PROMPT_TRUCO_ANSWER,
+  PROMPT_ENVIDO_ANSWER
+} PromptKind;
+
+typedef enum {
+  HAND_WON_ROUNDS,
+  HAND_WON_TIE
+} HandResultReason;
+
+typedef enum {
+  WIN_BY_SCORE,
+  WIN_BY_ENVIDO,
+  WIN_BY_DISCONNECT,
+  WIN_BY_TIMEOUT
+} WinReason;
+
+typedef enum {
+  NOTICE_NOT_YOUR_TURN,
+  NOTICE_INVALID_CARD,
+  NOTICE_CARD_ALREADY_PLAYED,
+  NOTICE_TRUCO_MAX,
+  NOTICE_ENVIDO_MAX,
+  NOTICE_ENVIDO_DONE,
+  NOTICE_ENVIDO_FIRST_ROUND,
+  NOTICE_TRUCO_RAISED,
+  NOTICE_ENVIDO_RAISED,
+  NOTICE_ANSWER_FIRST,
+  NOTICE_BAD_VERSION,
+  NOTICE_TURN_TIMEOUT,
+  NOTICE_NO_TABLE,
+  NOTICE_OPPONENT_AWAY,
+  NOTICE_OPPONENT_BACK,
+  NOTICE_SESSION_EXPIRED,
+  NOTICE_ACTION_QUEUED,
+  // Sent to the winner of a tournament match just before MSG_WINNER. One
+  // who advances keeps the connection and gets MSG_ROOM_JOIN again when its
+  // next opponent is there.
+  NOTICE_TOURNAMENT_ADVANCED,
+  NOTICE_TOURNAMENT_WON,
+  // The name in HELLO belongs to another player, whose secret was missing
+  // or wrong, or is in a tournament on another connection already. The
+  // connection is closed.
+  NOTICE_NAME_TAKEN
+} NoticeCode;
+
+// name is zero-padded and keys the player's rating; all zeros plays
+// anonymously, unrated. secret is what MSG_IDENTITY issued for the name, or
+// all zeros the first time the name is used.
+typedef struct {
+  uint8_t version;
+  char name[PLAYER_NAME_SIZE];
+  uint8_t secret[PLAYER_SECRET_SIZE];
+} HelloPayload;
+
+// Sent after HELLO with a name that came without a secret. The client keeps
+// it and sends it with every later HELLO under that name; once the name has
+// a rating, nobody gets to use the name without it.
+typedef struct {
+  uint8_t secret[PLAYER_SECRET_SIZE];
+} IdentityPayload;
+
+// token lets a player whose connection drops take the seat back with
+// MSG_RESUME for a while; it is all zeros for spectators.
+typedef struct {
+  uint8_t version;
+  uint8_t seat;
+  uint8_t token[SESSION_TOKEN_SIZE];
+} RoomJoinPayload;
+
+// Sent instead of MSG_HELLO by a player reconnecting to a game in progress.
+// The server answers as it does a new player, with ROOM_JOIN and a
+// snapshot, or with NOTICE_SESSION_EXPIRED once the seat is gone.
+typedef struct {
+  uint8_t version;
+  uint8_t token[SESSION_TOKEN_SIZE];
+} ResumePayload;
+
+// The first frame on the spectator port. table is a table id as seen in
+// the server log, little endian, or FEATURED_TABLE for whichever table the
+// server features. Spectators get ROOM_JOIN, a snapshot with seat NO_SEAT
+// and no cards in hand, and then every public frame of the table.
+typedef struct {
+  uint8_t version;
+  uint8_t table[4];
+} SpectatePayload;
+
+// Full state of the game as one player sees it. Sent when the game starts
+// and on MSG_RESYNC; every other update is a delta applied on top of it.
+// Cards already played are NO_CARD in hand so slots keep their numbers.
+typedef struct {
+  uint8_t seat;
+  uint8_t points[TOTAL_PER_ROOM];
+  uint8_t hand[HAND_SIZE];
+  uint8_t table[TOTAL_PER_ROOM];
+  uint8_t hand_value;
+} SnapshotPayload;
+
+// A new hand was dealt; the table starts empty.
+typedef struct {
+  uint8_t cards[HAND_SIZE];
+} DealPayload;
+
+typedef struct {
+  uint8_t seat;
+  uint8_t slot;
+  uint8_t card;
+} CardPlayedPayload;
+
+// Points gained by each seat since the last snapshot or score frame.
+typedef struct {
+  uint8_t delta[TOTAL_PER_ROOM];
+} ScorePayload;
+
+typedef struct {
+  uint8_t points;
+} FlorPayload;
+
+typedef struct {
+  uint8_t prompt;
+  uint8_t can_raise;
+} YourTurnPayload;
+
+// level is 1 for truco, 2 for retruco and 3 for vale 4.
+typedef struct {
+  uint8_t seat;
+  uint8_t level;
+  uint8_t value;
+} TrucoCallPayload;
+
+// On a refusal value is what the caller scores; on acceptance it is the
+// new worth of the hand.
+typedef struct {
+  uint8_t seat;
+  uint8_t accepted;
+  uint8_t value;
+} TrucoResultPayload;
+
+// level is 1 for envido, 2 for real envido and 3 for falta envido.
+typedef struct {
+  uint8_t seat;
+  uint8_t level;
+  uint8_t value;
+} EnvidoCallPayload;
+
+typedef struct {
+  uint8_t winner;
+  uint8_t points;
+  uint8_t accepted;
+  uint8_t tie;
+  uint8_t envido[TOTAL_PER_ROOM];
+} EnvidoResultPayload;
+
+// The table is cleared once a round result is announced.
+typedef struct {
+  uint8_t winner;
+} RoundResultPayload;
+
+typedef struct {
+  uint8_t winner;
+  uint8_t points;
+  uint8_t reason;
+} HandResultPayload;
+
 typedef struct {
-  MessageType type;
-  char text[MESSAGE_SIZE];
-} Message;
-
-inline int get_card_rank(const string& card) {
-  static map<string, int> ranking = {
-    {"AE", 14}, {"AP", 13},
-    {"7E", 12}, {"7O", 11},
-    {"3C", 10}, {"3E", 10}, {"3P", 10}, {"3O", 10},
-    {"2C", 9},  {"2E", 9},  {"2P", 9},  {"2O", 9},
-    {"AC", 8},  {"AO", 8},
-    {"KC", 7},  {"KE", 7},  {"KP", 7},  {"KO", 7},
-    {"QC", 6},  {"QE", 6},  {"QP", 6},  {"QO", 6},
-    {"JC", 5},  {"JE", 5},  {"JP", 5},  {"JO", 5},
-    {"7C", 4},  {"7P", 4},
-    {"6C", 3},  {"6E", 3},  {"6P", 3},  {"6O", 3},
-    {"5C", 2},  {"5E", 2},  {"5P", 2},  {"5O", 2},
-    {"4C", 1},  {"4E", 1},  {"4P", 1},  {"4O", 1}
-  };
-  
-  if (ranking.find(card) != ranking.end()) {
-    return ranking[card];
+  uint8_t winner;
+  uint8_t reason;
+} WinnerPayload;
+
+typedef struct {
+  uint8_t code;
+} NoticePayload;
+
+typedef struct {
+  uint8_t slot;
+} PlayCardPayload;
+
+typedef struct {
+  uint8_t opcode;
+  uint8_t length;
+  const uint8_t* payload;
+} Frame;
+
+inline void append_frame(string* out, uint8_t opcode, const void* payload, uint8_t length) {
+  out->push_back((char)length);
+  out->push_back((char)opcode);
+  out->append((const char*)payload, length);
+}
+
+// Returns the size of the first complete frame in data, or 0 when more
+// bytes are needed.
+inline size_t parse_frame(const uint8_t* data, size_t size, Frame* frame) {
+  if (size < FRAME_HEADER_SIZE || size < (size_t)FRAME_HEADER_SIZE + data[0]) return 0;
+
+  frame->length = data[0];
+  frame->opcode = data[1];
+  frame->payload = data + FRAME_HEADER_SIZE;
+  return FRAME_HEADER_SIZE + frame->length;
+}
+
+inline const char* message_name(uint8_t opcode) {
+  switch (opcode) {
+    case MSG_ROOM_JOIN: return "ROOM_JOIN";
+    case MSG_SNAPSHOT: return "SNAPSHOT";
+    case MSG_DEAL: return "DEAL";
+    case MSG_CARD_PLAYED: return "CARD_PLAYED";
+    case MSG_SCORE: return "SCORE";
+    case MSG_FLOR: return "FLOR";
+    case MSG_YOUR_TURN: return "YOUR_TURN";
+    case MSG_TRUCO_CALL: return "TRUCO_CALL";
+    case MSG_TRUCO_RESULT: return "TRUCO_RESULT";
+    case MSG_ENVIDO_CALL: return "ENVIDO_CALL";
+    case MSG_ENVIDO_RESULT: return "ENVIDO_RESULT";
+    case MSG_ROUND_RESULT: return "ROUND_RESULT";
+    case MSG_HAND_RESULT: return "HAND_RESULT";
+    case MSG_WINNER: return "WINNER";
+    case MSG_NOTICE: return "NOTICE";
+    case MSG_IDENTITY: return "IDENTITY";
+    case MSG_HELLO: return "HELLO";
+    case MSG_PLAY_CARD: return "PLAY_CARD";
+    case MSG_CALL_TRUCO: return "CALL_TRUCO";
+    case MSG_CALL_ENVIDO: return "CALL_ENVIDO";
+    case MSG_ACCEPT: return "ACCEPT";
+    case MSG_REJECT: return "REJECT";
+    case MSG_RESYNC: return "RESYNC";
+    case MSG_SPECTATE: return "SPECTATE";
+    case MSG_RESUME: return "RESUME";
+    default: return "UNKNOWN";
   }
-  return 0; 
+}
+
+template <typename T>
+inline const T* frame_payload(const Frame& frame) {
+  return frame.length >= sizeof(T) ? (const T*)frame.payload : nullptr;
 }
 
 #endif